@@ -10,10 +10,10 @@
  -------------------
  Atari sends command to mcu on cart by writing to $D5DF ($D5E0-$D5FF = SDX)
  (extra paramters for the command in $D500-$D5DE)
- Atari must be running from RAM when it sends a command, since the mcu on the cart will
- go away at that point.
- Atari polls $D500 until it reads $11. At this point it knows the mcu is back
- and it is safe to rts back to code in cartridge ROM again.
+ The cartridge ROM stays visible while the mcu runs the command, so the Atari
+ can carry on from ROM.
+ Atari polls $D500 until it reads $11 (it reads $12 while the command is busy,
+ and $D5DF counts up as the command progresses).
  Results of the command are in $D501-$D5DF
 */
 
@@ -23,15 +23,26 @@ CART_CMD_GET_DIR_ENTRY = $2
 CART_CMD_UP_DIR = $3
 CART_CMD_ROOT_DIR = $4
 CART_CMD_SEARCH = $5
+CART_CMD_SEARCH_PREVIEW = $6
 CART_CMD_LOAD_SOFT_OS = $10
 CART_CMD_SOFT_OS_CHUNK = $11
+CART_CMD_MAP_WINDOW = $12
+CART_CMD_RENDER_DIR = $14
 CART_CMD_RESET_FLASH = $F0
 CART_CMD_NO_CART = $FE
 CART_CMD_ACTIVATE_CART = $FF
 
+XEX_TABLE_PAGE = $8000			; $D500 page of the XEX segment table, see parse_xex()
+XEX_WAIT_PAGE = $4000			; $D500 page that reads 0 until the page set before is ready
+XEX_SEG_INIT = $01			; segment flag, the segment writes INITAD
+XEX_SEG_RUN = $02			; segment flag, the segment writes RUNAD
+
 DIR_START_ROW = 7
 DIR_END_ROW = 21
 ITEMS_PER_PAGE = DIR_END_ROW-DIR_START_ROW+1
+SEARCH_ROW = 8				; the search box, drawn by the cart with the preview under it
+PREVIEW_ROW = 12			; search results shown under the search box as it is typed
+DIR_WINDOW = $B000			; CART_CMD_RENDER_DIR, keep $B000-$B7FF free
 
 ;@com.wudsn.ide.asm.outputfileextension=.rom
 
@@ -89,22 +100,16 @@ GRACTL	equ $D01D
 
 sm_ptr = $58				; screen memory
 search_string = $600
-wait_for_cart = $620			; routine copied here
 reboot_to_selected_cart = $630		; routine copied here
-
-PMBuffer = $800
-Player0Data = $A00
-Player1Data = $A80
-Player2Data = $B00
-Player3Data = $B80
+os_from_window = $640		; routine copied here
 
 ; ************************ VARIABLES ****************************
-num_dir_entries = $80
-dir_entry	= $81
+num_dir_entries = $80	// word
 ypos		= $82
-cur_ypos	= $83
-top_item	= $84
-cur_item	= $85
+search_walking	= $83	; the cart is still walking the drive for the preview
+top_item	= $84	// word
+cur_item	= $8d	// word
+search_previewed = $8f
 search_text_len	= $86
 search_results_mode = $87
 trigger_state	= $88
@@ -117,7 +122,6 @@ text_out_x	= $92	// word
 text_out_y	= $94	// word
 text_out_ptr	= $96	// word
 text_out_len	= $98
-cur_chunk	= $99
 
 ; XEX loader stuff from Jon Halliday/FJC
 LoaderAddress	equ $700
@@ -217,9 +221,8 @@ patch_boot
 	mwa #reset_routine CASINI
 	
         jsr display_boot_screen
-	jsr copy_wait_for_cart
 	jsr copy_reboot_to_selected_cart
-	jsr setup_pmg
+	jsr copy_os_from_window
 	jsr init_joystick
 	
 ; check for trigger pressed on startup to reset flash on cartridge
@@ -240,35 +243,29 @@ check_read_dir
 	jmp read_current_directory
 	
 read_dir_ok
-	lda $D502
-	sta num_dir_entries
-	mva #0 top_item
-	mva #0 cur_item
+	mwa $D502 num_dir_entries	; a word, listings can be bigger than 255 entries
+	mwa $D504 top_item	; where the cursor was when the folder was last left
+	mwa $D506 cur_item
 	
 ; display_directory
 display_directory
-	jsr output_header_text
-	jsr clear_screen
-	
+	jsr output_directory
 	lda num_dir_entries
-	bne dir_ok
-	
-no_dir	jsr output_empty_dir_msg
-	jsr hide_pmg_cursor
-	jmp main_loop
-	
-dir_ok	jsr output_directory
-	jsr draw_cursor
+	ora num_dir_entries+1
+	bne main_loop
+	jsr output_empty_dir_msg
 	
 main_loop
 	jsr wait_for_vsync
 	jsr GetKey
 	beq check_joystick
 	cmp #$1C ; cur up
-	beq up_pressed
+	beq @+
 	cmp #'-'
-	beq up_pressed
+	bne _0
+@	jmp up_pressed
 	
+_0
 	cmp #$1D ; cur down
 	beq down_pressed
 	cmp #'='
@@ -297,7 +294,9 @@ check_joystick
 	jsr read_joystick
 	lda trigger_pressed
 	cmp #1
-	beq return_pressed
+	bne @+
+	jmp return_pressed
+@
 	
 	lda stick_input
 	and #$01
@@ -310,13 +309,14 @@ check_joystick
 	jmp main_loop
 
 down_pressed
-	lda cur_item
-	clc
-	adc #1
-	cmp num_dir_entries
-	bcs main_loop
+	mwa cur_item tmp_ptr
+	inw tmp_ptr
+	cpw tmp_ptr num_dir_entries
+	bcc down_ok
+	jmp main_loop
+down_ok
 ; single row down
-	inc cur_item
+	mwa tmp_ptr cur_item
 ; do we need to page down?
 	lda cur_item
 	sec
@@ -324,41 +324,35 @@ down_pressed
 	clc	
 	cmp #ITEMS_PER_PAGE
 	beq page_down
-	jsr draw_cursor
-	jmp main_loop
+	jmp display_directory
 page_down
-	lda top_item
-	clc
-	adc #ITEMS_PER_PAGE
-	sta top_item
+	adw top_item #ITEMS_PER_PAGE
 	jmp display_directory
 
 up_pressed
 	lda cur_item
-	cmp #0
-	beq main_loop
-; single row up
-	dec cur_item
-; do we need to page up
-	lda cur_item
-	cmp top_item
-	bmi page_up
-	jsr draw_cursor
+	ora cur_item+1
+	bne up_ok
 	jmp main_loop
+up_ok
+; do we need to page up
+	cpw cur_item top_item
+	beq page_up
+; single row up
+	sbw cur_item #1
+	jmp display_directory
 page_up
-	lda top_item
-	sec
-	sbc #ITEMS_PER_PAGE
-	sta top_item
+	sbw cur_item #1
+	sbw top_item #ITEMS_PER_PAGE
 	jmp display_directory
 	
 return_pressed
 	lda num_dir_entries
+	ora num_dir_entries+1
 	bne return_pressed_ok	; check for empty dir
 	jmp main_loop
 return_pressed_ok
-	lda cur_item
-	sta $D500
+	mwa cur_item $D500
 	lda #CART_CMD_OPEN_ITEM
 	jsr wait_for_cart
 
@@ -387,6 +381,7 @@ back_pressed
 	lda search_results_mode
 	cmp #1
 	beq exit_search_results
+	mwa cur_item $D500	; the cart remembers it for when we come back
 	lda #CART_CMD_UP_DIR
 	jsr wait_for_cart
 exit_search_results
@@ -398,12 +393,10 @@ disable_pressed
 	jmp reboot_to_selected_cart
 
 launch_xex
-	jsr disable_pmg
 	jsr copy_XEX_loader
 	jmp LoadBinaryFile
 	
 launch_atr
-	jsr disable_pmg
 	jsr copy_soft_rom
 	cmp #0
 	beq reboot_atr
@@ -412,29 +405,24 @@ reboot_atr
 	jmp reboot_to_selected_cart
 		
 search_pressed
-	jsr output_search_box
+	jsr clear_screen
+	mva #0 search_previewed
 	jsr get_search_string
 	lda search_text_len
 	cmp #0
 	bne search
-	jmp display_directory
+	lda search_previewed
+	beq @+
+	jmp read_current_directory	; the preview replaced the listing on the cart
+@	jmp display_directory
 search
-	; copy search_text_len bytes from search_text to $D5xx
-	ldy #0
-@	lda search_string,y
-	sta $D500,y
-	iny
-	tya
-	cmp search_text_len
-	bcc @-
-	; null terminate
-	lda #0
-	sta $D500,y
-		
+	jsr copy_search_string
+	lda search_previewed
+	bne @+		; the cart has the results already, this is quick
 	jsr clear_screen
 	jsr output_searching_msg
 		
-	lda #CART_CMD_SEARCH
+@	lda #CART_CMD_SEARCH
 	jsr wait_for_cart
 	mva #1 search_results_mode
 	jmp check_read_dir
@@ -518,52 +506,8 @@ swap	php	; save processor status
 	AND #$FE
 	STA PORTB
 	; copy
+	jsr os_from_window
 
-	mwa #OSROM tmp_ptr
-	mva #0 cur_chunk
-copy_page
-	lda tmp_ptr+1
-	cmp #$D0
-	bne copy_first_half
-	; skip $D000-D800
-	lda #$D8
-	sta tmp_ptr+1
-	lda #$30
-	sta cur_chunk
-copy_first_half
-	lda #$00
-	sta tmp_ptr
-	; fetch the first 128 bytes from the cartridge
-	lda cur_chunk
-	sta $D500
-	lda #CART_CMD_SOFT_OS_CHUNK
-	jsr wait_for_cart
-	ldy #0
-@	lda $D501,y
-	sta (tmp_ptr),y
-	iny
-	cpy #128
-	bne @-
-	inc cur_chunk
-copy_second_half
-	lda #$80
-	sta tmp_ptr
-	; fetch the next 128 bytes from the cartridge
-	lda cur_chunk
-	sta $D500
-	lda #CART_CMD_SOFT_OS_CHUNK
-	jsr wait_for_cart
-	ldy #0
-@	lda $D501,y
-	sta (tmp_ptr),y
-	iny
-	cpy #128
-	bne @-
-	inc cur_chunk
-	; move to the next page
-	inc tmp_ptr+1
-	bne copy_page
-	
 enable	pla
 	sta NMIEN
 	plp
@@ -576,7 +520,12 @@ enable	pla
 	jmp output
 loop
 	jsr GetKey
+	bne key
+	lda search_walking	; more results to come, go on with the walk
 	beq loop
+	jsr preview_search
+	jmp loop
+key
 	cmp #$1B ; esc
 	beq cancel
 	cmp #$7E; del
@@ -590,39 +539,53 @@ loop
 delete	
 	lda search_text_len
 	beq loop
-	; erase character
-	clc
-	adc #16
-	sta text_out_x
-	mwa #cursor_text text_out_ptr
-	mva #1 text_out_len
-	jsr output_text
-	
 	dec search_text_len
 	jmp output
 newchar		
 	ldy search_text_len
 	sta search_string,y
 	inc search_text_len
-output	
-	mva #16 text_out_x
-	mva #9 text_out_y
-	mwa #search_string text_out_ptr
-	mva search_text_len text_out_len
-	jsr output_text
-	; draw cursor
-	lda text_out_x
-	clc
-	adc text_out_len
-	sta text_out_x
-	mwa #cursor_text text_out_ptr
-	mva #1 text_out_len
-	jsr output_text_inverted
-	
+output	jsr preview_search	; the box with the text typed
 	jmp loop
 cancel	mva #0 search_text_len
 done	rts
 	.endp
+
+; copy search_text_len bytes from search_string to $D5xx, null terminated
+.proc	copy_search_string
+	ldy #0
+@	cpy search_text_len
+	beq @+
+	lda search_string,y
+	sta $D500,y
+	iny
+	bne @-
+@	lda #0
+	sta $D500,y
+	rts
+	.endp
+
+; draw the search box with the text so far, and the first results under it:
+; the listing if the cart answered from its index, otherwise the best of its
+; walk of the drive so far, which goes on each time this is called again
+.proc	preview_search
+	jsr copy_search_string
+	lda #CART_CMD_SEARCH_PREVIEW
+	jsr wait_for_cart
+	mva #0 search_walking
+	lda $D501
+	bne @+		; 2 = from a walk of the drive, 1 = error
+	mva #1 search_previewed
+	jmp draw
+@	cmp #2
+	bne draw
+	mva $D502 search_walking
+draw	mwa #DIR_WINDOW+[SEARCH_ROW-DIR_START_ROW+2]*40 text_out_ptr	; drawn into DIR_WINDOW
+	mwa sm_ptr tmp_ptr
+	adw tmp_ptr #SEARCH_ROW*40
+	ldx #DIR_END_ROW-SEARCH_ROW+1
+	jmp copy_rows
+	.endp
 .proc	reset_routine
 	mva #3 BOOT
 	lda #CART_CMD_ROOT_DIR ; tell the mcu we've done a reset
@@ -631,7 +594,7 @@ done	rts
 	.endp
 
 .proc	display_error_msg_from_cart
-	jsr hide_pmg_cursor
+	jsr clear_screen
 	mva #1 text_out_x
 	mva #8 text_out_y
 	mwa #error_text1 text_out_ptr
@@ -656,7 +619,6 @@ done	rts
 	.endp
 	
 .proc	reset_flash_prompt
-	jsr hide_pmg_cursor
 	mva #1 text_out_x
 	mva #8 text_out_y
 	mwa #reset_flash_text1 text_out_ptr
@@ -681,42 +643,31 @@ reset	lda #CART_CMD_RESET_FLASH
 	rts
 	.endp
 	
+; the cart draws the header and the page, with the cursor, into DIR_WINDOW
 .proc	output_directory
-	mva top_item dir_entry
-	mva #DIR_START_ROW ypos
-next_entry
-	ldy ypos
-	dey
-	tya
-	cmp #DIR_END_ROW
-	beq end_of_page
-	lda dir_entry
-	cmp num_dir_entries
-	beq end_of_page
-	sta $D500
-	lda #CART_CMD_GET_DIR_ENTRY ; request from mcu
+	mwa top_item $D500
+	mwa cur_item $D502
+	mva search_results_mode $D504
+	lda #CART_CMD_RENDER_DIR
 	jsr wait_for_cart
-	
-; output the directory entry
-	mva ypos text_out_y
-	mva #4 text_out_x
-	ldx $D501 ; 0 = file, 1 = folder
-	mwa #$D502 text_out_ptr
-;	mwa #test_text text_out_ptr
-	mva #31 text_out_len
-	cpx #1
-	beq folder
-file	jsr output_text
-	jmp next
-folder	jsr output_text
-	mva #0 text_out_x
-	mva #3 text_out_len
-	mwa #folder_text text_out_ptr
-	jsr output_text_inverted
-next	inc ypos
-	inc dir_entry
-	jmp next_entry
-end_of_page
+	mwa #DIR_WINDOW text_out_ptr
+	mwa sm_ptr tmp_ptr
+	adw tmp_ptr #[DIR_START_ROW-2]*40
+	ldx #DIR_END_ROW-DIR_START_ROW+3
+	jmp copy_rows
+	.endp
+
+; copy X rows of 40 from text_out_ptr to tmp_ptr
+.proc	copy_rows
+row	ldy #39
+@	lda (text_out_ptr),y
+	sta (tmp_ptr),y
+	dey
+	bpl @-
+	adw text_out_ptr #40
+	adw tmp_ptr #40
+	dex
+	bne row
 	rts
 	.endp
 
@@ -741,17 +692,6 @@ xloop	sta (tmp_ptr),y
 	rts
 	.endp
 
-.proc 	draw_cursor
-	lda cur_item
-	sec
-	sbc top_item
-	clc
-	adc #DIR_START_ROW
-	sta cur_ypos
-	jsr draw_pmg_cursor
-	rts
-	.endp
-
 ;	Scan keyboard (returns N = 1 for no key pressed, else ASCII in A)
 .proc	GetKey
 	ldx CH
@@ -764,87 +704,6 @@ NoKey
 	rts
 	.endp
 	
-.proc	setup_pmg 
-	mva #>PMBuffer PMBASE	
-	mva #$2E SDMCTL
-	
-	mva #$3 SizeP0
-	mva #$48 PCOLR0
-	mva #$40 HPosP0
-	
-	mva #$3 SizeP1
-	mva #$48 PCOLR1
-	mva #$60 HPosP1
-	
-	mva #$3 SizeP2
-	mva #$48 PCOLR2
-	mva #$80 HPosP2
-	
-	mva #$3 SizeP3
-	mva #$48 PCOLR3
-	mva #$A0 HPosP3
-	
-	mva #$1 GPRIOR
-	rts
-	.endp
-
-.proc	disable_pmg
-	mva #34 SDMCTL
-	lda #0
-	sta GRACTL
-	ldy #$0c
-@
-	sta $D000,y
-	dey
-	bpl @-
-	
-	mva #$0 PCOLR0
-	mva #$0 PCOLR1
-	mva #$0 PCOLR2
-	mva #$0 PCOLR3
-	
-	lda:cmp:req 20	; wait vbl
-	rts
-	.endp
-	
-.proc	hide_pmg_cursor
-	lda:cmp:req 20	; wait vbl
-	mva #$0 GRACTL
-	rts
-	.endp
-	
-.proc	draw_pmg_cursor
-	lda:cmp:req 20	; wait vbl
-	mva #$3 GRACTL
-	lda #0 ; clear pmg memory
-	ldy #127
-@	sta Player0Data,y
-	sta Player1Data,y
-	sta Player2Data,y
-	sta Player3Data,y
-	dey
-	bpl @-
-
-	lda #$C ; offset row 0
-	ldy cur_ypos
-	clc
-@	adc #4	; skip character lines
-	dey
-	bpl @-
-	tay
-	
-	lda #$FF ; draw
-	ldx #3
-@	sta Player0Data,y
-	sta Player1Data,y
-	sta Player2Data,y
-	sta Player3Data,y
-	iny
-	dex
-	bpl @-
-	rts
-	.endp
-
 .proc	display_boot_screen
 	mva #0 text_out_x
 	mva #0 text_out_y
@@ -874,20 +733,6 @@ NoKey
 	rts
 	.endp
 
-.proc	output_header_text
-	mva #9 text_out_x
-	mva #DIR_START_ROW-2 text_out_y
-	lda search_results_mode
-	bne _2
-_1	mwa #directory_text text_out_ptr
-	mva #(.len directory_text) text_out_len
-	jmp out
-_2	mwa #search_results_text text_out_ptr
-	mva #(.len search_results_text) text_out_len
-out	jsr output_text_inverted
-	rts
-	.endp
-
 .proc	output_empty_dir_msg
 	mva #6 text_out_x
 	mva #DIR_START_ROW+1 text_out_y
@@ -906,25 +751,6 @@ out	jsr output_text_inverted
 	rts
 	.endp
 
-.proc	output_search_box
-	jsr hide_pmg_cursor
-	mva #8 text_out_x
-	mva #8 text_out_y
-	mwa #search_text1 text_out_ptr
-	mva #(.len search_text1) text_out_len
-	jsr output_text_internal
-	inc text_out_y
-	mwa #search_text2 text_out_ptr
-	mva #(.len search_text2) text_out_len
-	jsr output_text_internal
-	inc text_out_y
-	mwa #search_text3 text_out_ptr
-	mva #(.len search_text3) text_out_len
-	jsr output_text_internal
-	rts
-	.endp
-
-	
 .proc	wait_key
 	mva #$FF CH		; set last key pressed to none
 @	ldx CH
@@ -1014,21 +840,11 @@ endoftext
 	rts
 	.endp
 
-.proc	copy_wait_for_cart
-	ldy #.len[WaitForCartCode]
-@
-	lda WaitForCartCode-1,y
-	sta wait_for_cart-1,y
-	dey
-	bne @-
-	rts
-	.endp
-	
 ; cmd is in Accumulator
-.proc WaitForCartCode
+.proc wait_for_cart
 	sta $D5DF	; send cmd to the cart
 @	lda $D500
-	cmp #$11	; wait for the cart to signal it's back
+	cmp #$11	; wait for the cart to signal it's done
 	bne @-
 	rts
 	.endp
@@ -1043,6 +859,51 @@ endoftext
 	rts
 	.endp
 	
+.proc	copy_os_from_window
+	ldy #.len[OSFromWindowCode]
+@
+	lda OSFromWindowCode-1,y
+	sta os_from_window-1,y
+	dey
+	bne @-
+	rts
+	.endp
+
+; copy the 16k OS loaded by CART_CMD_LOAD_SOFT_OS to the RAM under the OS ROM,
+; 8k at a time through the window at $A000 (CART_CMD_MAP_WINDOW). The boot
+; ROM is swapped out while it copies, so this runs from RAM.
+.proc OSFromWindowCode
+	mwa #OSROM tmp_ptr
+	ldx #0			; 8k block of the cart's memory
+map	stx $D500
+	lda #CART_CMD_MAP_WINDOW
+	sta $D5DF
+	mwa #$A000 text_out_ptr
+	ldy #0
+page	lda tmp_ptr+1
+	cmp #$D0		; skip the I/O area $D000-$D7FF
+	bcc @+
+	cmp #$D8
+	bcc next
+@	lda (text_out_ptr),y
+	sta (tmp_ptr),y
+	iny
+	bne @-
+next	inc tmp_ptr+1
+	inc text_out_ptr+1
+	lda text_out_ptr+1
+	cmp #$C0
+	bne page
+	inx
+	cpx #2
+	bne map
+	lda #$FF		; boot ROM back
+	sta $D500
+	lda #CART_CMD_MAP_WINDOW
+	sta $D5DF
+	rts
+	.endp
+
 .proc RebootToSelectedCartCode
 	sei				; prevent GINTLK check in deferred vbi
 	lda #CART_CMD_ACTIVATE_CART	; tell the cart we're ready for it switch ROM
@@ -1106,13 +967,6 @@ Loop
 	.local menu_text_bottom
 	.byte 'CurUp/Dn/Retn=Sel B=Back X=Boot Esc=Find'
 	.endl
-	.local directory_text
-	.byte '[Directory contents]'
-	.endl
-	.local search_results_text
-	.byte '[  Search results  ]'
-	.endl
-	
 	.local error_text1
 	.byte 81,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,69
 	.endl
@@ -1123,16 +977,6 @@ Loop
 	.byte 90,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,"P"+$80,"r"+$80,"e"+$80,"s"+$80,"s"+$80," "+$80,"a"+$80," "+$80,"k"+$80,"e"+$80,"y"+$80,67
 	.endl
 	
-	.local search_text1
-	.byte 81,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,69
-	.endl
-	.local search_text2
-	.byte 124,"Search:",0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,124
-	.endl
-	.local search_text3
-	.byte 90,82,82,82,82,82,82,82,82,82,82,82,82,"E"+$80,"S"+$80,"C"+$80," "+$80,"C"+$80,"a"+$80,"n"+$80,"c"+$80,"e"+$80,"l"+$80,67
-	.endl
-
 	.local reset_flash_text1
 	.byte 81,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,69
 	.endl
@@ -1156,10 +1000,6 @@ Loop
 	.byte 'Searching....'
 	.endl
 	
-	.local cursor_text
-	.byte ' '
-	.endl
-	
 	.local test_text
 	.byte 'Hello',0
 	.endl
@@ -1188,6 +1028,9 @@ Loop
 	bne @+
 	mwa BStart RunVec	; set run address to start of first block
 @
+	lda Entry+7		; only call through INITAD if the block wrote it
+	and #XEX_SEG_INIT
+	beq Loop
 	jsr DoInit
 	jmp Loop
 Error
@@ -1207,47 +1050,47 @@ Return
 
 
 //
-//	Read block from executable
+//	Read block from executable, the next entry of the segment table the cart
+//	publishes from page XEX_TABLE_PAGE on (start, length, page, pos, flags)
 //
 
 	.proc ReadBlock
-	jsr ReadWord
-	bmi Error
-	lda HeaderBuf
-	and HeaderBuf+1
-	cmp #$ff
-	bne NoSignature
-	jsr ReadWord
-	bmi Error
-NoSignature
-	mwa HeaderBuf BStart
-	jsr ReadWord
+	mva TablePage ReadBuffer.SegmentLo
+	mva #>XEX_TABLE_PAGE ReadBuffer.SegmentHi
+	jsr ReadBuffer.SetSegment
+	ldx TableIndex
+	ldy #0
+@
+	lda $D500,x
+	sta Entry,y
+	inx
+	iny
+	cpy #8
+	bne @-
+	stx TableIndex
+	bne @+
+	inc TablePage
+@
+	lda Entry+7		; flags, XEX_SEG_END sets N
 	bmi Error
-	sbw HeaderBuf BStart BLen
-	inw BLen
-	mwa BStart IOPtr
+	mwa Entry BStart
+	mwa Entry IOPtr
+	mwa Entry+2 BLen
+	mva Entry+4 ReadBuffer.SegmentLo
+	mva Entry+5 ReadBuffer.SegmentHi
+	mva Entry+6 ReadBuffer.Pos
 	jsr ReadBuffer
 Error
 	rts
 	.endp
 	
 	
-	
-	
-//
-//	Read word from XEX
-//
-
-	.proc ReadWord
-	mwa #HeaderBuf IOPtr
-	mwa #2 BLen		; fall into ReadBuffer
-	.endp
-
-
-
 //
 //	Read buffer from XEX
 //	Returns Z=1 on EOF
+//	Copies a run at a time: the rest of the page at $D5xx, or what is left of
+//	the buffer or the file if less. The page and the destination are indexed
+//	by the same Y, so the copy is an unrolled LDA/STA pair per byte.
 //
 	
 	.proc ReadBuffer
@@ -1255,77 +1098,119 @@ Error
 Loop
 	lda BLen
 	ora BLen+1
-	beq Done
-	
+	bne @+
+	ldy #1			; done, the copy is too long to branch to the end
+	rts
+@
 	lda FileSize		; first ensure we're not at the end of the file
 	ora FileSize+1
 	ora FileSize+2
 	ora FileSize+3
-	beq EOF
-
-	inc BufIndex
-	bne NoBurst			; don't burst unless we're at the end of the buffer
-	
-BurstLoop
-	inc SegmentLo			; bump segment if we reached end of buffer
 	bne @+
-	inc SegmentHi
+	ldy #IOErr.EOF
+	rts
 @
-	jsr SetSegment
 
-	lda Blen+1		; see if we can burst read the next 256 bytes
-	beq NoBurst
-	lda FileSize+1	; ensure buffer and remaining bytes in file are both >= 256
-	ora FileSize+2
+	ldy #0			; Count = 256 - Pos, the rest of the page
+	tya
+	sec
+	sbc Pos
+	sta Count
+	bne @+
+	iny
+@
+	sty Count+1
+	cpw BLen Count
+	bcs @+
+	mwa BLen Count
+@
+	lda FileSize+2
 	ora FileSize+3
-	beq NoBurst
-
-	ldy #0			; read a whole page into RAM
+	bne @+
+	cpw FileSize Count
+	bcs @+
+	mwa FileSize Count
 @
-	lda $D500,y		; doesn't matter about speculative reads (?)
-	sta (IOPtr),y
+	sec			; the destination of $D500 is IOPtr - Pos
+	lda IOPtr
+	sbc Pos
+	sta Dest
+	sta Dest0
+	sta Dest1
+	sta Dest2
+	sta Dest3
+	lda IOPtr+1
+	sbc #0
+	sta Dest+1
+	sta Dest0+1
+	sta Dest1+1
+	sta Dest2+1
+	sta Dest3+1
+
+	ldy Pos
+	lda Count		; odd bytes first
+	and #3
+	beq Quads
+	tax
+Single
+	lda $D500,y
+	sta $FFFF,y
+Dest	equ *-2
 	iny
-	bne @-
-	inc IOPtr+1		; bump address for next time
-
-	ldx #3			; y is already 0
-	sec
-@
-	lda FileSize,y	; reduce file size by 256
-	sbc L256,y
-	sta FileSize,y
+	dex
+	bne Single
+Quads
+	lda Count+1		; then Count / 4 (256 is 64)
+	lsr @
+	lda Count
+	ror @
+	lsr @
+	tax
+	beq Copied
+Quad
+	lda $D500,y
+	sta $FFFF,y
+Dest0	equ *-2
+	iny
+	lda $D500,y
+	sta $FFFF,y
+Dest1	equ *-2
+	iny
+	lda $D500,y
+	sta $FFFF,y
+Dest2	equ *-2
+	iny
+	lda $D500,y
+	sta $FFFF,y
+Dest3	equ *-2
 	iny
 	dex
-	bpl @-
-	dec Blen+1		; reduce buffer length by 256
-	dec BufIndex
-	bne ReadBuffer
-
-NoBurst
-	lda $D500
-BufIndex	equ *-2
-	ldy #0
-	sta (IOPtr),y
-	inw IOPtr
-	dew BLen
+	bne Quad
+Copied
+	sty Pos
+	adw IOPtr Count
+	sbw BLen Count
 	
-	ldx #3		; y is already 0
+	ldx #3
+	ldy #0
 	sec
 @
 	lda FileSize,y
-	sbc L1,y
+	sbc Count,y
 	sta FileSize,y
 	iny
 	dex
 	bpl @-
-	bmi Loop
-	
-Done
-	ldy #1
-	rts
-EOF
-	ldy #IOErr.EOF
-	rts
+
+	lda Pos
+	beq @+
+	jmp Loop
+@
+	inc SegmentLo		; bump segment if we reached end of page
+	bne @+
+	inc SegmentHi
+@
+	jmp ReadBuffer
 	
 SetSegment
 	ldy #0
@@ -1334,15 +1219,22 @@ SegmentLo equ *-1
 SegmentHi equ *-1
 	sty $D500
 	stx $D501
+	lda #>XEX_WAIT_PAGE	; until the cart has the page in SRAM
+	sta $D501
+@	lda $D500
+	beq @-
+	stx $D501
 	rts
-L1
-	.dword 1
-L256
-	.dword 256
+Pos
+	.byte 0			; of the next byte in the page
+Count
+	.dword 0		; of the run, the top two bytes stay 0
 	.endp
 
 
-HeaderBuf	.word 0
+Entry		.byte 0,0,0,0,0,0,0,0
+TablePage	.byte 0
+TableIndex	.byte 0
 BStart		.word 0
 BLen		.word 0
 
@@ -1373,13 +1265,7 @@ BLen		.word 0
 	bpl @-
 	jsr ClearRAM
 	
-	ldy #3
-@
-	lda $D500,y
-	sta FileSize,y
-	dey
-	bpl @-
-	mva #3 ReadBuffer.BufIndex
+	mva #1 FileSize+3		; never runs out, the segment table ends the file
 	rts
 	.endp
 
@@ -1480,6 +1366,10 @@ LoaderCodeSize	= EndLoaderCode-LoaderCode
 	opt f-
 	org LoaderCodeStart + LoaderCodeSize
 	opt f+
+
+	.if * > DIR_WINDOW
+	.error "Menu code runs into DIR_WINDOW"
+	.endif
 	
 
 ; ************************ CARTRIDGE CONTROL BLOCK *****************
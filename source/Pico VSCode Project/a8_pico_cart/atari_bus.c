@@ -0,0 +1,252 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * PIO cartridge bus front end (see atari_bus.pio)
+ */
+
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
+#include "hardware/vreg.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/structs/scb.h"
+
+#include "atari_bus.h"
+#include "atari_bus.pio.h"
+
+#define ALL_PIN_MASK    0x3FFFFFFF
+#define BUS_PIN_MASK    0x03FFFFFF  // A0-A12, D0-D7, CCTL, PHI2, R/W, S4, S5
+#define DATA_PIN_MASK   0x001FE000
+
+// shortest phi2 low half (PAL and NTSC), less some slack for the clock's duty cycle
+#define PHI2_LOW_NS     250
+
+// lowest first
+static const struct {
+    uint32_t khz;
+    enum vreg_voltage vreg;
+} bus_clocks[] = {
+    { 125000, VREG_VOLTAGE_1_10 },
+    { 150000, VREG_VOLTAGE_1_10 },
+    { 200000, VREG_VOLTAGE_1_10 },
+    { ATARI_BUS_MAX_KHZ, VREG_VOLTAGE_1_15 },
+};
+
+#define NUM_BUS_CLOCKS  (sizeof(bus_clocks) / sizeof(bus_clocks[0]))
+
+static uint bus_offset;
+static uint rom_offset;
+static uint cctl_offset;
+static bool early;
+
+void atari_bus_init()
+{
+    gpio_init_mask(ALL_PIN_MASK);
+    gpio_set_dir_in_masked(BUS_PIN_MASK);
+    gpio_set_dir_out_masked(RD4_GPIO_MASK|RD5_GPIO_MASK);
+
+    bus_offset = pio_add_program(ATARI_BUS_PIO, &atari_bus_program);
+    atari_bus_program_init(ATARI_BUS_PIO, ATARI_BUS_SM, bus_offset);
+    rom_offset = pio_add_program(ATARI_ROM_PIO, &atari_rom_program);
+
+    // the idle state machine wakes the CPU from __wfe() through its IRQ (see
+    // atari_bus_sleep()), the IRQ itself stays disabled in the NVIC. It is set up
+    // here once, so atari_bus_sleep() only has to restart it.
+    cctl_offset = pio_add_program(ATARI_IDLE_PIO, &atari_cctl_program);
+    atari_cctl_program_init(ATARI_IDLE_PIO, ATARI_IDLE_SM, cctl_offset);
+    pio_set_irq0_source_enabled(ATARI_IDLE_PIO, pis_sm0_rx_fifo_not_empty + ATARI_IDLE_SM, true);
+}
+
+// the lowest clock of at least min_khz, or the fastest there is, returns it
+static uint32_t set_bus_clock(uint32_t min_khz)
+{
+    int i = 0;
+    while (i < NUM_BUS_CLOCKS - 1 && bus_clocks[i].khz < min_khz)
+        i++;
+    // the voltage goes up before the clock, and down after it
+    if (bus_clocks[i].khz > clock_get_hz(clk_sys) / 1000) {
+        vreg_set_voltage(bus_clocks[i].vreg);
+        sleep_ms(1);
+        set_sys_clock_khz(bus_clocks[i].khz, true);
+    }
+    else {
+        set_sys_clock_khz(bus_clocks[i].khz, true);
+        vreg_set_voltage(bus_clocks[i].vreg);
+    }
+#if BUS_TIMING
+    bus_timing.sys_khz = bus_clocks[i].khz;
+#endif
+    return bus_clocks[i].khz;
+}
+
+// what the clock picked gives an engine of cpu_clocks, in BUSTIME.TXT. Even the
+// fastest clock can leave a heavy engine over budget, ATARI_BUS_READ_NS() lets
+// atari_cart.c check its engines against BUS_BUDGET_NS when it is built.
+static void record_clock(uint cpu_clocks, uint32_t ns, uint32_t budget_ns)
+{
+#if BUS_TIMING
+    bus_timing.engine_clocks = cpu_clocks;
+    bus_timing.answer_ns = ns;
+    bus_timing.budget_ns = budget_ns;
+#endif
+}
+
+// run at the lowest clock that answers a read cycle within BUS_BUDGET_NS, for an
+// engine that takes cpu_clocks to answer (0 if the CPU isn't involved)
+void atari_bus_clock(uint cpu_clocks)
+{
+    uint32_t khz = set_bus_clock(cpu_clocks ? (cpu_clocks + ATARI_BUS_READ_CLOCKS) * 1000000 / BUS_BUDGET_NS : 0);
+    record_clock(cpu_clocks, cpu_clocks ? (cpu_clocks + ATARI_BUS_READ_CLOCKS) * 1000000 / khz : 0, BUS_BUDGET_NS);
+}
+
+// the same for atari_bus_start_early(), where the CPU answers before phi2 rises
+void atari_bus_clock_early(uint cpu_clocks)
+{
+    uint32_t khz = set_bus_clock((cpu_clocks + ATARI_BUS_SETTLE_CLOCKS) * 1000000 / PHI2_LOW_NS);
+    record_clock(cpu_clocks, (cpu_clocks + ATARI_BUS_SETTLE_CLOCKS) * 1000000 / khz, PHI2_LOW_NS);
+}
+
+// the SDK's pio_sm_init() and pio_sm_set_pindirs_with_mask() run from flash,
+// which the engines can't wait for when they wake from atari_bus_sleep(). These
+// two do the same with the SDK's inline register helpers, on a state machine
+// whose configuration was set once before.
+
+// release D0-D7, the out pins of both bus programs, through the stopped state
+// machine. pio_sm_restart() then drops what this left in the OSR.
+static __force_inline void release_data(PIO pio, uint sm)
+{
+    pio_sm_exec(pio, sm, pio_encode_mov(pio_osr, pio_null));
+    pio_sm_exec(pio, sm, pio_encode_out(pio_pindirs, 8));
+}
+
+// run the stopped state machine from offset with empty FIFOs and a clean state
+static __force_inline void restart_at(PIO pio, uint sm, uint offset)
+{
+    pio_sm_clear_fifos(pio, sm);
+    pio_sm_restart(pio, sm);
+    pio_sm_clkdiv_restart(pio, sm);
+    pio_sm_exec(pio, sm, pio_encode_jmp(offset));
+    pio_sm_set_enabled(pio, sm, true);
+}
+
+// (re)start the state machine with empty FIFOs and the data bus released,
+// nothing sampled while the CPU was away from the bus is left behind
+void __not_in_flash_func(atari_bus_start)()
+{
+    pio_sm_set_enabled(ATARI_IDLE_PIO, ATARI_IDLE_SM, false);
+    pio_sm_set_enabled(ATARI_BUS_PIO, ATARI_BUS_SM, false);
+    ATARI_BUS_PIO->irq = 1u << ATARI_BUS_DROP_IRQ;
+    release_data(ATARI_BUS_PIO, ATARI_BUS_SM);
+    restart_at(ATARI_BUS_PIO, ATARI_BUS_SM, bus_offset);
+}
+
+// replace atari_bus with atari_bus_early for the rest of the session, it needs
+// all of the PIO's instruction memory. Runs from flash, before the engine starts.
+static void load_early()
+{
+    pio_remove_program(ATARI_BUS_PIO, &atari_bus_program, bus_offset);
+    bus_offset = pio_add_program(ATARI_BUS_PIO, &atari_bus_early_program);
+    atari_bus_early_program_init(ATARI_BUS_PIO, ATARI_BUS_SM, bus_offset);
+    early = true;
+}
+
+// atari_bus_start() for atari_bus_early, loading it the first time
+void __not_in_flash_func(atari_bus_start_early)()
+{
+    pio_sm_set_enabled(ATARI_IDLE_PIO, ATARI_IDLE_SM, false);
+    pio_sm_set_enabled(ATARI_BUS_PIO, ATARI_BUS_SM, false);
+    if (!early)
+        load_early();
+    release_data(ATARI_BUS_PIO, ATARI_BUS_SM);
+    restart_at(ATARI_BUS_PIO, ATARI_BUS_SM, bus_offset + atari_bus_early_offset_cycle);
+}
+
+void __not_in_flash_func(atari_bus_stop)()
+{
+    pio_sm_set_enabled(ATARI_BUS_PIO, ATARI_BUS_SM, false);
+    release_data(ATARI_BUS_PIO, ATARI_BUS_SM);
+}
+
+// hand the bus over to the idle state machine, which only reports CCTL accesses,
+// until atari_bus_start() or atari_bus_start_early(). Anything that can switch
+// the cartridge back on goes through $D5xx, so the CPU can sleep in between.
+void __not_in_flash_func(atari_bus_sleep)()
+{
+#if BUS_TIMING
+    bus_timing_end(systick_hw->cvr);    // the access that switched the cartridge off
+#endif
+    atari_bus_stop();
+    restart_at(ATARI_IDLE_PIO, ATARI_IDLE_SM, cctl_offset);
+    // a pending (but disabled) interrupt is a __wfe() event
+    scb_hw->scr |= M0PLUS_SCR_SEVONPEND_BITS;
+}
+
+// while asleep, wait for the next CCTL access, returns the pins sampled on phi2 low
+uint32_t __not_in_flash_func(atari_bus_next_cctl)()
+{
+    while (pio_sm_is_rx_fifo_empty(ATARI_IDLE_PIO, ATARI_IDLE_SM)) {
+        // the IRQ has to go pending again for the next event, so clear it and
+        // check the FIFO once more before sleeping
+        irq_clear(ATARI_IDLE_IRQ);
+        if (pio_sm_is_rx_fifo_empty(ATARI_IDLE_PIO, ATARI_IDLE_SM))
+            __wfe();
+    }
+    uint32_t pins = pio_sm_get(ATARI_IDLE_PIO, ATARI_IDLE_SM);
+#if BUS_TRACE
+    bus_trace_record(pins);
+#endif
+    return pins;
+}
+
+// two chained DMA channels close the loop between the address the state machine
+// pushes and the byte it pulls: the first one copies the SRAM address into the
+// read address (and trigger) of the second, which copies the byte back to the
+// TX FIFO and re-arms the first
+static void rom_window_start(uint sm, uint select_pin, const uint8_t *window)
+{
+    uint addr_chan = dma_claim_unused_channel(true);
+    uint data_chan = dma_claim_unused_channel(true);
+
+    dma_channel_config c = dma_channel_get_default_config(addr_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(ATARI_ROM_PIO, sm, false));
+    channel_config_set_high_priority(&c, true);
+    dma_channel_configure(addr_chan, &c, &dma_hw->ch[data_chan].al3_read_addr_trig,
+        &ATARI_ROM_PIO->rxf[sm], 1, false);
+
+    c = dma_channel_get_default_config(data_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_chain_to(&c, addr_chan);
+    channel_config_set_high_priority(&c, true);
+    dma_channel_configure(data_chan, &c, &ATARI_ROM_PIO->txf[sm], window, 1, false);
+
+    atari_rom_program_init(ATARI_ROM_PIO, sm, rom_offset, select_pin, (uint32_t)window);
+    dma_channel_start(addr_chan);
+    pio_sm_set_enabled(ATARI_ROM_PIO, sm, true);
+}
+
+// serve up to two fixed 8k windows (NULL if not mapped) without the CPU, the
+// windows must be 8k aligned in SRAM. The data pins are handed over from the
+// bus state machine, so atari_bus_start() can't be used after this.
+void atari_rom_start(const uint8_t *s4_window, const uint8_t *s5_window)
+{
+    atari_bus_stop();
+    if (s4_window)
+        rom_window_start(ATARI_ROM_SM_S4, 24, s4_window);
+    if (s5_window)
+        rom_window_start(ATARI_ROM_SM_S5, 25, s5_window);
+}
@@ -0,0 +1,197 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * PIO cartridge bus front end (see atari_bus.pio)
+ *
+ * This is the only interface between the cartridge emulation in atari_cart.c
+ * and the hardware, everything on the cartridge port goes through here.
+ */
+
+#ifndef __ATARI_BUS_H__
+#define __ATARI_BUS_H__
+
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+
+#include "bus_trace.h"
+
+// BUS_EARLY=1 looks up the data in the phi2 low half of the cycle (see atari_bus_early
+// in atari_bus.pio), for machines with little data setup margin
+#ifndef BUS_EARLY
+#define BUS_EARLY           0
+#endif
+
+#define RD4_GPIO_MASK       0x04000000  // gpio 26
+#define RD5_GPIO_MASK       0x08000000  // gpio 27
+
+#define ATARI_BUS_PIO       pio0
+#define ATARI_BUS_SM        0
+#define ATARI_BUS_DROP_IRQ  4           // PIO flag set for an answer that came too late
+
+// fixed ROM windows served by PIO + DMA (see atari_rom in atari_bus.pio)
+#define ATARI_ROM_PIO       pio1
+#define ATARI_ROM_SM_S4     0
+#define ATARI_ROM_SM_S5     1
+
+// $D5xx watch while the cartridge is switched off (see atari_cctl in atari_bus.pio)
+#define ATARI_IDLE_PIO      pio1
+#define ATARI_IDLE_SM       2
+#define ATARI_IDLE_IRQ      PIO1_IRQ_0
+
+// fixed PIO latency around the CPU's part of a cycle (see atari_bus.pio): input
+// synchroniser, wait, jmp, in and the CPU noticing the FIFO before, and pull, the
+// phi2 check and out pindirs after; and from phi2 falling to the data bus being released
+#define ATARI_BUS_READ_CLOCKS       18
+#define ATARI_BUS_RELEASE_CLOCKS    5
+// with BUS_EARLY, from phi2 falling to the address being sampled (synchroniser,
+// wait and settle delay), and from the address to phi2 rising the CPU has the rest
+// of the phi2 low half to answer in
+#define ATARI_BUS_SETTLE_CLOCKS     34
+
+// data has to be on the bus this long after phi2 rises: the shortest phi2 high half
+// (PAL and NTSC, less the same slack as PHI2_LOW_NS in atari_bus.c), less the data
+// setup of the 2MHz grade 6502s the 400/800 and XL/XE use, less the data buffers
+// and slot on the slower boards
+#define PHI2_HIGH_NS                250
+#define CPU_DATA_SETUP_NS           50
+#define BOARD_DATA_NS               30
+#define BUS_BUDGET_NS               (PHI2_HIGH_NS - CPU_DATA_SETUP_NS - BOARD_DATA_NS)
+// the fastest system clock atari_bus_clock() picks, and phi2 rising to data driven
+// at it for an engine that takes cpu_clocks to answer
+#define ATARI_BUS_MAX_KHZ           250000
+#define ATARI_BUS_READ_NS(cpu_clocks)   (((cpu_clocks) + ATARI_BUS_READ_CLOCKS) * 1000000 / ATARI_BUS_MAX_KHZ)
+
+#define ATARI_BUS_ADDR_MASK         0x00001FFF
+#define ATARI_BUS_S4_S5_MASK        0x03000000
+
+void atari_bus_init();
+void atari_bus_clock(uint cpu_clocks);
+void atari_bus_clock_early(uint cpu_clocks);
+void atari_bus_start();
+void atari_bus_start_early();
+void atari_bus_stop();
+void atari_bus_sleep();
+uint32_t atari_bus_next_cctl();
+void atari_rom_start(const uint8_t *s4_window, const uint8_t *s5_window);
+
+// BUS_EARLY: answer the address with what the S4 and S5 windows would return,
+// ATARI_BUS_DATA(byte) or 0 if the window isn't mapped
+#define ATARI_BUS_DATA(d)   (((uint32_t)(d) << 1) | 1)
+
+// BUS_EARLY: true if a read cycle still has to be answered with atari_bus_drive()
+// or atari_bus_float(), because the address moved after it was sampled or the
+// cycle isn't for the S4/S5 windows
+static __force_inline bool atari_bus_late(uint32_t pins, uint32_t addr) {
+    return (pins & ATARI_BUS_ADDR_MASK) != addr || (pins & ATARI_BUS_S4_S5_MASK) == ATARI_BUS_S4_S5_MASK;
+}
+
+#if PICO_NO_HARDWARE
+// host builds stand the simulated bus of test/cart_sim.c in for the PIO, with the
+// same calls as below
+uint32_t atari_bus_next();
+void atari_bus_drive(uint8_t data);
+void atari_bus_float();
+uint32_t atari_bus_next_address();
+void atari_bus_drive_late(uint8_t data);
+void atari_bus_prefetch(uint32_t s4, uint32_t s5);
+uint32_t atari_bus_next_early();
+void atari_bus_rd(uint32_t mask, uint32_t levels);
+#else
+// wait for the next phi2 cycle, returns the pins sampled by the PIO
+// (same layout as gpio_get_all(), write cycles are sampled on phi2 low)
+static __force_inline uint32_t atari_bus_next() {
+#if BUS_TIMING
+    bus_timing_end(systick_hw->cvr);
+    bool late = !(ATARI_BUS_PIO->fstat & (1u << (PIO_FSTAT_RXEMPTY_LSB + ATARI_BUS_SM)));
+    if (late && (ATARI_BUS_PIO->fdebug & (1u << (PIO_FDEBUG_RXSTALL_LSB + ATARI_BUS_SM)))) {
+        // the FIFO filled up and the state machine missed cycles
+        ATARI_BUS_PIO->fdebug = 1u << (PIO_FDEBUG_RXSTALL_LSB + ATARI_BUS_SM);
+        bus_timing.missed++;
+    }
+    if (ATARI_BUS_PIO->irq & (1u << ATARI_BUS_DROP_IRQ)) {
+        // the last read was answered after phi2 fell, nothing was driven
+        ATARI_BUS_PIO->irq = 1u << ATARI_BUS_DROP_IRQ;
+        bus_timing.dropped++;
+    }
+#endif
+    while (ATARI_BUS_PIO->fstat & (1u << (PIO_FSTAT_RXEMPTY_LSB + ATARI_BUS_SM))) ;
+    uint32_t pins = ATARI_BUS_PIO->rxf[ATARI_BUS_SM];
+#if BUS_TIMING
+    bus_timing_begin(pins, systick_hw->cvr, late);
+#endif
+#if BUS_TRACE
+    bus_trace_record(pins);
+#endif
+    return pins;
+}
+
+// every read cycle returned by atari_bus_next() must be answered exactly once,
+// either by driving the data bus until phi2 low, or by leaving it floating
+static __force_inline void atari_bus_drive(uint8_t data) {
+    ATARI_BUS_PIO->txf[ATARI_BUS_SM] = ((uint32_t)data << 1) | 1;
+#if BUS_TIMING
+    bus_timing_end(systick_hw->cvr);
+#endif
+#if BUS_TRACE
+    bus_trace_driven(data);
+#endif
+}
+
+static __force_inline void atari_bus_float() {
+    ATARI_BUS_PIO->txf[ATARI_BUS_SM] = 0;
+#if BUS_TIMING
+    bus_timing_end(systick_hw->cvr);
+#endif
+}
+
+// BUS_EARLY: wait for the next cycle's address (A0-A12), sampled while phi2 is low
+static __force_inline uint32_t atari_bus_next_address() {
+    while (ATARI_BUS_PIO->fstat & (1u << (PIO_FSTAT_RXEMPTY_LSB + ATARI_BUS_SM))) ;
+    return ATARI_BUS_PIO->rxf[ATARI_BUS_SM] >> 19;
+}
+
+// BUS_EARLY: atari_bus_drive() for a read atari_bus_late() is true for. There is no
+// room left in atari_bus_early to check phi2 before driving the way atari_bus does,
+// so an answer that comes after phi2 has fallen is dropped here instead
+static __force_inline void atari_bus_drive_late(uint8_t data) {
+    if (gpio_get_all() & 0x00400000)    // phi2
+        atari_bus_drive(data);
+    else {
+        atari_bus_float();
+#if BUS_TIMING
+        bus_timing.dropped++;
+#endif
+    }
+}
+
+// BUS_EARLY: both answers for the address, see ATARI_BUS_DATA()
+static __force_inline void atari_bus_prefetch(uint32_t s4, uint32_t s5) {
+    ATARI_BUS_PIO->txf[ATARI_BUS_SM] = s4 | (s5 << 9);
+}
+
+// BUS_EARLY: the rest of the cycle after atari_bus_prefetch(), like atari_bus_next()
+static __force_inline uint32_t atari_bus_next_early() {
+    while (ATARI_BUS_PIO->fstat & (1u << (PIO_FSTAT_RXEMPTY_LSB + ATARI_BUS_SM))) ;
+    uint32_t pins = ATARI_BUS_PIO->rxf[ATARI_BUS_SM] >> 6;
+#if BUS_TRACE
+    bus_trace_record(pins);
+#endif
+    return pins;
+}
+
+// set the RD4/RD5 lines selected by mask to levels (RD4_GPIO_MASK/RD5_GPIO_MASK bits)
+static __force_inline void atari_bus_rd(uint32_t mask, uint32_t levels) {
+    gpio_put_masked(mask, levels);
+}
+
+#endif
+
+#endif
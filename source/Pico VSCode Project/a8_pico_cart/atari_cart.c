@@ -17,18 +17,36 @@
  * - Adds 4k carts (CAR type 58)
  * - Adds Turbsoft carts (CAR types 50,51)
  * - Adds ATRAX 128k cars (CAR type 17)
+ * - Cartridge bus is sampled and driven by a PIO state machine (atari_bus.pio)
+ * - Standard 4k/8k/16k carts are served by PIO + DMA with the CPU asleep
+ * - Banked carts are described by a table (cart_descs) driving one generic engine
+ * - Carts up to 1MB are served from flash through an SRAM bank cache (bank_cache.c)
+ * - XEX files up to 1MB are streamed from flash the same way
+ * - XEX files are checked and split into segments before the Atari reboots
+ * - The menu stays on the bus (core1) while its commands run on core0
+ * - Directories and search results of any size are paged, a chunk at a time
+ * - Searches are answered from the directory index built when the drive is ejected
+ * - The first search results are shown as the text is typed
+ * - Recent folders are listed from RAM, with the cursor where it was left
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
 #include "hardware/sync.h"
+#include "hardware/structs/bus_ctrl.h"
 
 #include "ff.h"
 #include "fatfs_disk.h"
+#include "atari_bus.h"
+#include "bank_cache.h"
+#include "dir_index.h"
+#include "name_match.h"
 
-#define ALL_GPIO_MASK   	0x3FFFFFFF
 #define ADDR_GPIO_MASK  	0x00001FFF
 #define DATA_GPIO_MASK  	0x001FE000
 #define CCTL_GPIO_MASK  	0x00200000  // gpio 21
@@ -40,15 +58,11 @@
 #define S4_S5_GPIO_MASK 	0x03000000
 #define CCTL_RW_GPIO_MASK 	0x00A00000
 
-#define RD4_PIN         26
-#define RD5_PIN         27
 
-#define RD4_LOW             gpio_put(RD4_PIN, 0)
-#define RD4_HIGH            gpio_put(RD4_PIN, 1)
-#define RD5_LOW             gpio_put(RD5_PIN, 0)
-#define RD5_HIGH            gpio_put(RD5_PIN, 1)
-#define SET_DATA_MODE_OUT   gpio_set_dir_out_masked(DATA_GPIO_MASK)
-#define SET_DATA_MODE_IN    gpio_set_dir_in_masked(DATA_GPIO_MASK)
+#define RD4_LOW             atari_bus_rd(RD4_GPIO_MASK, 0)
+#define RD4_HIGH            atari_bus_rd(RD4_GPIO_MASK, RD4_GPIO_MASK)
+#define RD5_LOW             atari_bus_rd(RD5_GPIO_MASK, 0)
+#define RD5_HIGH            atari_bus_rd(RD5_GPIO_MASK, RD5_GPIO_MASK)
 
 #include "rom.h"
 #include "osrom.h"
@@ -57,14 +71,23 @@ unsigned char cart_ram[128*1024];
 unsigned char cart_d5xx[256] = {0};
 char errorBuf[40];
 
+// mailbox status while the menu is up (see emulate_boot_rom())
+#define CART_STATUS_DONE			0x11	// $D500, results are in $D501-$D5DF
+#define CART_STATUS_BUSY			0x12	// $D500, the command is still running
+volatile uint8_t cart_busy;		// set by core1 when a command is written, cleared by core0 when it's done
+volatile uint8_t cart_progress;	// $D5DF while busy, entries found or percent loaded
+
 #define CART_CMD_OPEN_ITEM			0x00
 #define CART_CMD_READ_CUR_DIR		0x01
 #define CART_CMD_GET_DIR_ENTRY		0x02
 #define CART_CMD_UP_DIR				0x03
 #define CART_CMD_ROOT_DIR			0x04
 #define CART_CMD_SEARCH				0x05
+#define CART_CMD_SEARCH_PREVIEW		0x06	// SEARCH as the text is typed, see search_preview()
 #define CART_CMD_LOAD_SOFT_OS		0x10
 #define CART_CMD_SOFT_OS_CHUNK		0x11
+#define CART_CMD_MAP_WINDOW			0x12	// handled by core1, see emulate_boot_rom()
+#define CART_CMD_RENDER_DIR			0x14
 #define CART_CMD_MOUNT_ATR			0x20	// unused, done automatically by firmware
 #define CART_CMD_READ_ATR_SECTOR	0x21
 #define CART_CMD_WRITE_ATR_SECTOR	0x22
@@ -103,6 +126,18 @@ char errorBuf[40];
 #define CART_TYPE_TURBOSOFT_64K		27	// 64k
 #define CART_TYPE_TURBOSOFT_128K	28	// 128k
 #define CART_TYPE_ATRAX_128K		29	// 128k
+#define CART_TYPE_XEGS_256K			30	// 256k, served by the bank cache from here on
+#define CART_TYPE_XEGS_512K			31	// 512k
+#define CART_TYPE_XEGS_1M			32	// 1M
+#define CART_TYPE_SW_XEGS_256K		33	// 256k
+#define CART_TYPE_SW_XEGS_512K		34	// 512k
+#define CART_TYPE_SW_XEGS_1M		35	// 1M
+#define CART_TYPE_MEGACART_256K		36	// 256k
+#define CART_TYPE_MEGACART_512K		37	// 512k
+#define CART_TYPE_MEGACART_1M		38	// 1M
+#define CART_TYPE_ATARIMAX_8MBIT	39	// 1M
+#define CART_TYPE_SIC_256K			40	// 256k
+#define CART_TYPE_SIC_512K			41	// 512k
 #define CART_TYPE_ATR				254
 #define CART_TYPE_XEX				255
 
@@ -111,52 +146,319 @@ typedef struct {
 	char filename[13];
 	char long_filename[32];
 	char full_path[210];
-} DIR_ENTRY;	// 256 bytes = 256 entries in 64k
+} DIR_ENTRY;	// one entry of the listing written out, see get_dir_entry()
+
+// The listing the menu pages through, a directory or the results of a search, can
+// be any size. A directory in the index (see dir_index.h) is read straight from
+// flash. Anything else is walked into a chunk of up to DIR_CHUNK entries in order,
+// from entry chunk_first, and walked again for the chunk either side of it,
+// keeping the entries that follow the last one of the chunk before (or come before
+// the first one of the chunk after) in key_compare() order. That is a total
+// order, so a page always holds the same entries however it was reached.
+//
+// The chunk is kept compact in cart_ram: a DIR_HEADER per entry in slots that
+// are picked into and dropped from in any order, chunk_order listing the slots in
+// order, the names in an arena of variable sized records, and the folders of
+// search results in a table of their own, each stored once however many results
+// it holds.
+#define DIR_CHUNK			2400	// 160 pages of the menu
+#define SEARCH_FIRST_CHUNK	15		// a page, see pick_chunk()
+#define MAX_DIR_ENTRIES		0xFFFF	// the menu counts entries in a word
+
+typedef struct {
+	uint32_t key;		// the first four characters of the long name, case-folded, big endian
+	uint16_t record;	// in dir_arena: slot (word), size, long name, 8.3 name if it isn't the same
+	uint16_t path;		// of a search result's folder in dir_paths, 0 ("") for none
+	uint8_t isDir;		// or the search score
+	uint8_t alt;		// where the 8.3 name starts after the long name, 0 if the same
+} DIR_HEADER;
+
+#define DIR_ARENA_SIZE		0x10000
+#define DIR_PATHS_SIZE		0x4000
+#define DIR_HEADER_OFFSET	DIR_ARENA_SIZE
+#define DIR_PATHS_OFFSET	(DIR_HEADER_OFFSET + DIR_CHUNK * sizeof(DIR_HEADER))
+#define DIR_ORDER_OFFSET	(DIR_PATHS_OFFSET + DIR_PATHS_SIZE)
+#define RECORD_HEADER		3
+#define NO_SLOT				0xFFFF
+#define COMPACT_SLACK		0x1000	// compacting moves the whole arena, free this much first
+
+static unsigned char *const dir_arena = &cart_ram[0];
+static DIR_HEADER *const dir_headers = (DIR_HEADER *)&cart_ram[DIR_HEADER_OFFSET];
+static char *const dir_paths = (char *)&cart_ram[DIR_PATHS_OFFSET];
+static uint16_t *const chunk_order = (uint16_t *)&cart_ram[DIR_ORDER_OFFSET];
+static uint32_t arena_used, paths_used, last_path;
+
+int num_dir_entries = 0; // how many entries in the current listing
+static int chunk_first = 0;
+static int chunk_count = 0;
+static bool chunk_valid = false;
+static char listing_path[256];
+static char listing_search[32];		// "" for a directory
+static const DIR_INDEX_DIR *listing_index;
+// the first and last entries of the chunk (with the search score in isDir), where
+// the walks for the chunks either side of it start from
+static DIR_ENTRY chunk_head, chunk_tail;
+
+// an entry as key_compare() sees it, wherever it is kept
+typedef struct {
+	uint32_t key;
+	uint8_t isDir;
+	const char *name;
+	const char *alt;
+	const char *path;
+} DIR_KEY;
+
+static void entry_key(const DIR_ENTRY *e, DIR_KEY *k) {
+	k->key = name_key(e->long_filename);
+	k->isDir = e->isDir;
+	k->name = e->long_filename;
+	k->alt = e->filename;
+	k->path = e->full_path;
+}
 
-int num_dir_entries = 0; // how many entries in the current directory
+static void header_key(const DIR_HEADER *h, DIR_KEY *k) {
+	k->key = h->key;
+	k->isDir = h->isDir;
+	k->name = (const char *)dir_arena + h->record + RECORD_HEADER;
+	k->alt = k->name + h->alt;
+	k->path = dir_paths + h->path;
+}
 
-int entry_compare(const void* p1, const void* p2)
+// folders (or better search matches) first, then by name, most pairs are told
+// apart by their keys without looking at the names
+int key_compare(const DIR_KEY *k1, const DIR_KEY *k2)
 {
-	DIR_ENTRY* e1 = (DIR_ENTRY*)p1;
-	DIR_ENTRY* e2 = (DIR_ENTRY*)p2;
-	if (e1->isDir && !e2->isDir) return -1;
-	else if (!e1->isDir && e2->isDir) return 1;
-	else return strcasecmp(e1->long_filename, e2->long_filename);
+	if (k1->isDir && !k2->isDir) return -1;
+	else if (!k1->isDir && k2->isDir) return 1;
+	if (k1->key != k2->key) return k1->key < k2->key ? -1 : 1;
+	int ret = name_compare(k1->name, k2->name);
+	if (!ret)	// the same name in two folders (search results)
+		ret = strcmp(k1->path, k2->path);
+	if (!ret)	// or long names that only differ after 31 characters
+		ret = strcmp(k1->alt, k2->alt);
+	return ret;
 }
 
-char *get_filename_ext(char *filename) {
-    char *dot = strrchr(filename, '.');
-    if(!dot || dot == filename) return "";
-    return dot + 1;
+static void unpack_entry(const DIR_HEADER *h, DIR_ENTRY *e) {
+	DIR_KEY k;
+	header_key(h, &k);
+	e->isDir = h->isDir;
+	strcpy(e->long_filename, k.name);
+	strcpy(e->filename, k.alt);
+	strcpy(e->full_path, k.path);
 }
 
 int is_valid_file(char *filename) {
-	char *ext = get_filename_ext(filename);
-	if (strcasecmp(ext, "CAR") == 0 || strcasecmp(ext, "ROM") == 0
-			|| strcasecmp(ext, "XEX") == 0 || strcasecmp(ext, "ATR") == 0)
+	switch (name_ext(filename)) {
+	case NAME_EXT('c','a','r'):
+	case NAME_EXT('r','o','m'):
+	case NAME_EXT('x','e','x'):
+	case NAME_EXT('a','t','r'):
 		return 1;
+	}
 	return 0;
 }
 
 FILINFO fno;
 char search_fname[FF_LFN_BUF + 1];
 
-// polyfill :-)
-char *stristr(const char *str, const char *strSearch) {
-    char *sors, *subs, *res = NULL;
-    if ((sors = strdup (str)) != NULL) {
-        if ((subs = strdup (strSearch)) != NULL) {
-            res = strstr (strlwr (sors), strlwr (subs));
-            if (res != NULL)
-                res = (char*)str + (res - sors);
-            free (subs);
-        }
-        free (sors);
-    }
-    return res;
+// listing_search prepared for scan_files(), once per walk
+static NAME_PATTERN search_pattern;
+
+// the chunk a walk is picking: the limit entries nearest to bound, after it
+// (dir 1, or from the start without a bound) or before it (dir -1), as many as
+// fit in the arena. chunk_order is only kept sorted from when the chunk first
+// fills up, until then it is sorted once at the end. Once anything has been left
+// out the chunk is closed, and only takes entries that come before its last one.
+static struct {
+	const DIR_KEY *bound;
+	int dir;
+	int limit;		// DIR_CHUNK, or less for the first page of a search
+	int count;		// entries in chunk_order
+	bool sorted;
+	bool closed;
+	int slots;		// dir_headers used so far, some may be free again
+	int free_slot;	// list of those through path, NO_SLOT at the end
+	uint32_t dead;	// bytes of dir_arena still held by dropped entries
+	int seen;		// entries in the whole listing
+	bool overflow;	// too many folders for dir_paths
+} pick;
+static DIR_ENTRY candidate;
+
+static int slot_compare(const void *p1, const void *p2) {
+	DIR_KEY k1, k2;
+	header_key(&dir_headers[*(const uint16_t *)p1], &k1);
+	header_key(&dir_headers[*(const uint16_t *)p2], &k2);
+	return key_compare(&k1, &k2) * pick.dir;
+}
+
+static void sort_chunk() {
+	qsort(chunk_order, pick.count, sizeof(uint16_t), slot_compare);
+	pick.sorted = true;
+}
+
+// squeeze the records of dropped entries out of the arena
+static void compact_arena() {
+	uint32_t src = 0, dst = 0;
+	while (src < arena_used) {
+		unsigned char *rec = dir_arena + src;
+		uint32_t slot = rec[0] | (rec[1] << 8), size = rec[2];
+		if (slot != NO_SLOT) {
+			memmove(dir_arena + dst, rec, size);
+			dir_headers[slot].record = dst;
+			dst += size;
+		}
+		src += size;
+	}
+	arena_used = dst;
+	pick.dead = 0;
+}
+
+// drop the last entry of the sorted chunk to make room
+static void drop_last() {
+	uint16_t slot = chunk_order[--pick.count];
+	unsigned char *rec = dir_arena + dir_headers[slot].record;
+	rec[0] = rec[1] = NO_SLOT & 0xFF;
+	pick.dead += rec[2];
+	dir_headers[slot].path = pick.free_slot;
+	pick.free_slot = slot;
+}
+
+// the folder of the candidate in dir_paths, results from the same folder come
+// one after the other
+static int candidate_path() {
+	const char *path = candidate.full_path;
+	if (!path[0])
+		return 0;
+	if (strcmp(dir_paths + last_path, path)) {
+		uint32_t len = strlen(path) + 1;
+		if (paths_used + len > DIR_PATHS_SIZE) {
+			pick.overflow = true;
+			return 0;
+		}
+		last_path = paths_used;
+		memcpy(dir_paths + paths_used, path, len);
+		paths_used += len;
+	}
+	return last_path;
+}
+
+// whether k goes before the last entry of the sorted chunk
+static bool before_last(const DIR_KEY *k) {
+	DIR_KEY last;
+	if (!pick.count)
+		return false;
+	header_key(&dir_headers[chunk_order[pick.count - 1]], &last);
+	return key_compare(k, &last) * pick.dir < 0;
+}
+
+static void pick_candidate() {
+	DIR_KEY k;
+	cart_progress = ++pick.seen;
+	entry_key(&candidate, &k);
+	if (pick.bound && key_compare(&k, pick.bound) * pick.dir <= 0)
+		return;
+	uint32_t name_len = strlen(candidate.long_filename) + 1;
+	uint32_t size = RECORD_HEADER + name_len;
+	bool same = strcmp(candidate.filename, candidate.long_filename) == 0;
+	if (!same)
+		size += strlen(candidate.filename) + 1;
+	if (pick.closed || pick.count == pick.limit || arena_used + size > DIR_ARENA_SIZE) {
+		if (!pick.sorted)
+			sort_chunk();
+		if (!before_last(&k)) {
+			pick.closed = true;
+			return;
+		}
+	}
+	// make room, dropping entries from the end
+	while (pick.count == pick.limit || arena_used + size > DIR_ARENA_SIZE) {
+		if (pick.count < pick.limit && pick.dead >= size && (pick.dead >= COMPACT_SLACK || !before_last(&k))) {
+			compact_arena();
+			continue;
+		}
+		if (!before_last(&k))
+			return;
+		drop_last();
+		pick.closed = true;
+	}
+
+	uint16_t slot;
+	if (pick.free_slot != NO_SLOT) {
+		slot = pick.free_slot;
+		pick.free_slot = dir_headers[slot].path;
+	}
+	else
+		slot = pick.slots++;
+	DIR_HEADER *h = &dir_headers[slot];
+	unsigned char *rec = dir_arena + arena_used;
+	rec[0] = slot & 0xFF;
+	rec[1] = slot >> 8;
+	rec[2] = size;
+	memcpy(rec + RECORD_HEADER, candidate.long_filename, name_len);
+	if (!same)
+		strcpy((char *)rec + RECORD_HEADER + name_len, candidate.filename);
+	h->key = k.key;
+	h->record = arena_used;
+	h->path = candidate_path();
+	h->isDir = candidate.isDir;
+	h->alt = same ? 0 : name_len;
+	arena_used += size;
+
+	int lo = pick.count;
+	if (pick.sorted) {
+		int hi = pick.count;
+		lo = 0;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			DIR_KEY m;
+			header_key(&dir_headers[chunk_order[mid]], &m);
+			if (key_compare(&k, &m) * pick.dir < 0)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		memmove(&chunk_order[lo + 1], &chunk_order[lo], (pick.count - lo) * sizeof(uint16_t));
+	}
+	chunk_order[lo] = slot;
+	pick.count++;
+}
+
+// the names of the entry in fno
+static void candidate_names() {
+	// long file name
+	strncpy(candidate.long_filename, fno.fname, 31);
+	candidate.long_filename[31] = 0;
+	// 8.3 name
+	if (fno.altname[0])
+		strcpy(candidate.filename, fno.altname);
+	else {	// no altname when lfn is 8.3
+		strncpy(candidate.filename, fno.fname, 12);
+		candidate.filename[12] = 0;
+	}
 }
 
-int scan_files(char *path, char *search)
+// every entry of the directory at path the menu lists
+static FRESULT walk_directory(const char *path) {
+	DIR dir;
+	FRESULT res = f_opendir(&dir, path);
+	if (res != FR_OK)
+		return res;
+	for (;;) {
+		res = f_readdir(&dir, &fno);
+		if (res != FR_OK || fno.fname[0] == 0) break;
+		if (fno.fattrib & (AM_HID | AM_SYS)) continue;
+		candidate.isDir = fno.fattrib & AM_DIR ? 1 : 0;
+		if (!candidate.isDir && !is_valid_file(fno.fname)) continue;
+		candidate_names();
+		candidate.full_path[0] = 0; // path only for search results
+		pick_candidate();
+	}
+	f_closedir(&dir);
+	return res;
+}
+
+int scan_files(char *path, const NAME_PATTERN *search)
 {
     FRESULT res;
     DIR dir;
@@ -165,7 +467,6 @@ int scan_files(char *path, char *search)
 	res = f_opendir(&dir, path);
 	if (res == FR_OK) {
 		for (;;) {
-			if (num_dir_entries == 255) break;
 			res = f_readdir(&dir, &fno);
 			if (res != FR_OK || fno.fname[0] == 0) break;
 			if (fno.fattrib & (AM_HID | AM_SYS)) continue;
@@ -183,25 +484,14 @@ int scan_files(char *path, char *search)
 			}
 			else if (is_valid_file(fno.fname))
 			{
-				char *match = stristr(fno.fname, search);
+				const char *match = name_match(search, fno.fname);
 				if (match) {
-					DIR_ENTRY *dst = (DIR_ENTRY *)&cart_ram[0];
-					dst += num_dir_entries;
 					// fill out a record
-					dst->isDir = (match == fno.fname) ? 1 : 0;	// use this for a "score"
-					strncpy(dst->long_filename, fno.fname, 31);
-					dst->long_filename[31] = 0;
-					// 8.3 name
-					if (fno.altname[0])
-						strcpy(dst->filename, fno.altname);
-					else {	// no altname when lfn is 8.3
-						strncpy(dst->filename, fno.fname, 12);
-						dst->filename[12] = 0;
-					}
+					candidate.isDir = (match == fno.fname) ? 1 : 0;	// use this for a "score"
+					candidate_names();
 					// full path for search results
-					strcpy(dst->full_path, path);
-
-					num_dir_entries++;
+					strcpy(candidate.full_path, path);
+					pick_candidate();
 				}
 			}
 		}
@@ -210,74 +500,508 @@ int scan_files(char *path, char *search)
 	return res;
 }
 
-int search_directory(char *path, char *search) {
+static void index_entry(const DIR_INDEX_ENTRY *e, DIR_ENTRY *entry) {
+	entry->isDir = e->flags & DIR_INDEX_IS_DIR ? 1 : 0;
+	memcpy(entry->filename, e->altname, sizeof(e->altname));
+	entry->filename[12] = 0;
+	strcpy(entry->long_filename, e->name);
+}
+
+// a search result from the index
+static void index_candidate(const DIR_INDEX_DIR *dir, const DIR_INDEX_ENTRY *e, bool prefix) {
+	index_entry(e, &candidate);
+	candidate.isDir = prefix ? 1 : 0;	// the search "score", as scan_files() does
+	strcpy(candidate.full_path, dir->path);
+	pick_candidate();
+}
+
+// walk the listing for the chunk next to bound, see pick
+static int pick_chunk(const DIR_ENTRY *bound, int dir) {
 	char pathBuf[256];
-	strcpy(pathBuf, path);
-	num_dir_entries = 0;
-	int i;
-	FATFS FatFs;
-	if (f_mount(&FatFs, "", 1) == FR_OK) {
-		if (scan_files(pathBuf, search) == FR_OK) {
-			// sort by score, name
-			qsort((DIR_ENTRY *)&cart_ram[0], num_dir_entries, sizeof(DIR_ENTRY), entry_compare);
-			DIR_ENTRY *dst = (DIR_ENTRY *)&cart_ram[0];
-			// reset the "scores" back to 0
-			for (i=0; i<num_dir_entries; i++)
-				dst[i].isDir = 0;
-			return 1;
+	DIR_KEY bound_key;
+	FRESULT res;
+
+	if (bound)
+		entry_key(bound, &bound_key);
+	pick.bound = bound ? &bound_key : NULL;
+	pick.dir = dir;
+	pick.limit = DIR_CHUNK;
+	pick.count = 0;
+	pick.sorted = false;
+	pick.closed = false;
+	pick.slots = 0;
+	pick.free_slot = NO_SLOT;
+	pick.dead = 0;
+	pick.seen = 0;
+	pick.overflow = false;
+	arena_used = 0;
+	dir_paths[0] = 0;
+	paths_used = 1;
+	last_path = 0;
+	chunk_valid = false;
+	if (listing_search[0]) {
+		// from the index when it has every file, it doesn't open a directory. The
+		// first chunk is only the top page of matches then, ready for the menu as
+		// soon as the index has been searched, the rest are picked if paged to.
+		pick.limit = bound ? DIR_CHUNK : SEARCH_FIRST_CHUNK;
+		if (dir_index_search(listing_path, listing_search, index_candidate))
+			res = FR_OK;
+		else {
+			pick.limit = DIR_CHUNK;
+			strcpy(pathBuf, listing_path);
+			name_pattern(&search_pattern, listing_search);
+			res = scan_files(pathBuf, &search_pattern);
+		}
+	}
+	else
+		res = walk_directory(listing_path);
+	if (res != FR_OK || pick.overflow)
+		return 0;
+	if (!pick.sorted)
+		sort_chunk();
+	if (dir < 0) {
+		for (int i = 0, j = pick.count - 1; i < j; i++, j--) {
+			uint16_t t = chunk_order[i];
+			chunk_order[i] = chunk_order[j];
+			chunk_order[j] = t;
+		}
+	}
+	chunk_count = pick.count;
+	if (chunk_count) {
+		unpack_entry(&dir_headers[chunk_order[0]], &chunk_head);
+		unpack_entry(&dir_headers[chunk_order[chunk_count - 1]], &chunk_tail);
+	}
+	num_dir_entries = pick.seen < MAX_DIR_ENTRIES ? pick.seen : MAX_DIR_ENTRIES;
+	chunk_valid = true;
+	return 1;
+}
+
+// make the chunk in cart_ram the one holding entry n of a listing that isn't in
+// the index
+static int load_chunk(int n) {
+	if (chunk_valid && n < chunk_first && chunk_count) {
+		// backwards from the chunk in cart_ram
+		while (n < chunk_first) {
+			int first = chunk_first;
+			if (!pick_chunk(&chunk_head, -1))
+				return 0;
+			if (!chunk_count || chunk_count > first)
+				break;	// the listing has changed, start again
+			chunk_first = first - chunk_count;
+		}
+		if (n >= chunk_first && chunk_valid && chunk_count)
+			return n < chunk_first + chunk_count;
+	}
+	// forwards from the chunk in cart_ram, or from the start
+	if (!chunk_valid || n < chunk_first) {
+		if (!pick_chunk(NULL, 1))
+			return 0;
+		chunk_first = 0;
+	}
+	while (n >= chunk_first + chunk_count) {
+		int next = chunk_first + chunk_count;
+		if (!chunk_count || !pick_chunk(&chunk_tail, 1))
+			return 0;
+		chunk_first = next;
+	}
+	return 1;
+}
+
+// The folders read most recently, with where the menu's cursor was when it last
+// left each one. A folder that isn't in the index keeps its listing in
+// recent_pool as well, if all of it fitted in the chunk, so going back up to it
+// (or into it again) doesn't walk and sort it again. Anything written to the
+// drive since it was read (fatfs_disk_generation()) drops the listing, not the
+// cursor.
+#define RECENT_DIRS			8
+#define RECENT_POOL_SIZE	0x3000
+
+typedef struct {
+	char path[256];
+	uint32_t used;			// for least recently used, 0 for a free slot
+	uint32_t generation;	// of the drive when the listing was kept
+	uint16_t cursor;
+	uint16_t count;			// entries in the listing
+	uint16_t at;			// in recent_pool: offset (word) of each entry from here, then the entries
+	uint16_t size;			// 0 if the listing isn't kept
+} RECENT_DIR;
+
+static RECENT_DIR recent_dirs[RECENT_DIRS];
+static unsigned char recent_pool[RECENT_POOL_SIZE];
+static uint32_t recent_pool_used, recent_use_count;
+static const RECENT_DIR *listing_recent;	// the listing is the one kept there
+int dir_cursor = 0;	// of the menu in the listing just read
+
+// drop the listing kept for r, the ones after it move down to close the gap
+static void recent_drop(RECENT_DIR *r) {
+	if (!r->size)
+		return;
+	memmove(recent_pool + r->at, recent_pool + r->at + r->size, recent_pool_used - r->at - r->size);
+	for (int i = 0; i < RECENT_DIRS; i++)
+		if (recent_dirs[i].size && recent_dirs[i].at > r->at)
+			recent_dirs[i].at -= r->size;
+	recent_pool_used -= r->size;
+	r->size = 0;
+	if (listing_recent == r)
+		listing_recent = NULL;
+}
+
+// the slot of the folder at path, the least recently used one is taken over for
+// a folder that hasn't got one
+static RECENT_DIR *recent_dir(const char *path) {
+	RECENT_DIR *lru = &recent_dirs[0];
+	for (int i = 0; i < RECENT_DIRS; i++) {
+		RECENT_DIR *r = &recent_dirs[i];
+		if (r->used && strcmp(r->path, path) == 0) {
+			r->used = ++recent_use_count;
+			return r;
+		}
+		if (r->used < lru->used)
+			lru = r;
+	}
+	recent_drop(lru);
+	strcpy(lru->path, path);
+	lru->used = ++recent_use_count;
+	lru->cursor = 0;
+	return lru;
+}
+
+// keep the listing just read into the chunk for r, if the chunk holds all of it
+// and it fits, dropping the least recently used listings to make room
+static void recent_keep(RECENT_DIR *r) {
+	uint32_t size = chunk_count * 2;
+	DIR_KEY k;
+	if (!chunk_valid || chunk_first || chunk_count != num_dir_entries)
+		return;
+	for (int i = 0; i < chunk_count; i++) {
+		header_key(&dir_headers[chunk_order[i]], &k);
+		size += 1 + strlen(k.name) + 1 + (k.alt != k.name ? strlen(k.alt) : 0) + 1;
+	}
+	if (size > RECENT_POOL_SIZE)
+		return;
+	while (recent_pool_used + size > RECENT_POOL_SIZE) {
+		RECENT_DIR *lru = NULL;
+		for (int i = 0; i < RECENT_DIRS; i++)
+			if (recent_dirs[i].size && (!lru || recent_dirs[i].used < lru->used))
+				lru = &recent_dirs[i];
+		recent_drop(lru);
+	}
+	unsigned char *base = recent_pool + recent_pool_used;
+	uint32_t at = chunk_count * 2;
+	for (int i = 0; i < chunk_count; i++) {
+		const DIR_HEADER *h = &dir_headers[chunk_order[i]];
+		header_key(h, &k);
+		base[i * 2] = at & 0xFF;
+		base[i * 2 + 1] = at >> 8;
+		base[at++] = h->isDir;
+		strcpy((char *)base + at, k.name);
+		at += strlen(k.name) + 1;
+		strcpy((char *)base + at, k.alt != k.name ? k.alt : "");
+		at += strlen((char *)base + at) + 1;
+	}
+	r->generation = fatfs_disk_generation();
+	r->count = chunk_count;
+	r->at = recent_pool_used;
+	r->size = size;
+	recent_pool_used += size;
+}
+
+static void recent_entry(const RECENT_DIR *r, int n, DIR_ENTRY *entry) {
+	const unsigned char *base = recent_pool + r->at;
+	const char *rec = (const char *)base + (base[n * 2] | (base[n * 2 + 1] << 8));
+	const char *alt = rec + 1 + strlen(rec + 1) + 1;
+	entry->isDir = rec[0];
+	strcpy(entry->long_filename, rec + 1);
+	strcpy(entry->filename, alt[0] ? alt : rec + 1);
+	entry->full_path[0] = 0;
+}
+
+// the menu is leaving the folder listed with its cursor on entry n
+static void leave_directory(int n) {
+	if (!listing_search[0])
+		recent_dir(listing_path)->cursor = n;
+}
+
+// entry n of the listing, NULL if it isn't there (any more)
+DIR_ENTRY *get_dir_entry(int n) {
+	static DIR_ENTRY entry;
+	if (n >= num_dir_entries)
+		return NULL;
+	if (listing_recent) {
+		recent_entry(listing_recent, n, &entry);
+		return &entry;
+	}
+	if (listing_index) {
+		index_entry(dir_index_entries(listing_index) + n, &entry);
+		entry.full_path[0] = 0;
+		return &entry;
+	}
+	if (!load_chunk(n))
+		return NULL;
+	unpack_entry(&dir_headers[chunk_order[n - chunk_first]], &entry);
+	if (listing_search[0])
+		entry.isDir = 0;	// the search "score", not a folder
+	return &entry;
+}
+
+// The results shown under the search box as it is typed, when the index can't
+// answer: the drive is walked a slice at a time, each CART_CMD_SEARCH_PREVIEW going
+// on with the walk the last one left for the same text, and the best
+// PREVIEW_RESULTS matches so far are kept in key_compare() order. A different text
+// keeps the results that match it too and starts the walk again. The listing is
+// left alone, the menu still sends CART_CMD_SEARCH for it on return.
+#define PREVIEW_RESULTS		10		// rows under the search box
+#define PREVIEW_DEPTH		16		// folders deeper are left to the search
+#ifndef PREVIEW_SLICE_US
+#define PREVIEW_SLICE_US	20000	// or a single entry of the walk
+#endif
+
+static struct {
+	char text[32];
+	NAME_PATTERN pattern;
+	char from[256];			// the folder searched
+	uint32_t generation;	// of the drive the results are from
+	DIR dirs[PREVIEW_DEPTH];
+	int depth;				// of dirs open, 0 once the walk is done
+	char path[256];			// of dirs[depth - 1]
+	DIR_ENTRY top[PREVIEW_RESULTS];
+	int count;
+} preview;
+
+// into the results if it is better than the last, unless it is there already
+static void preview_add(const DIR_ENTRY *e) {
+	DIR_KEY k, t;
+	int at = preview.count;
+	entry_key(e, &k);
+	while (at > 0) {
+		entry_key(&preview.top[at - 1], &t);
+		int ret = key_compare(&k, &t);
+		if (ret == 0)
+			return;
+		if (ret > 0)
+			break;
+		at--;
+	}
+	if (at == PREVIEW_RESULTS)
+		return;
+	int n = preview.count < PREVIEW_RESULTS ? preview.count : PREVIEW_RESULTS - 1;
+	memmove(&preview.top[at + 1], &preview.top[at], (n - at) * sizeof(DIR_ENTRY));
+	preview.top[at] = *e;
+	if (preview.count < PREVIEW_RESULTS)
+		preview.count++;
+}
+
+static void preview_stop() {
+	while (preview.depth)
+		f_closedir(&preview.dirs[--preview.depth]);
+}
+
+// start the walk for text from path, keeping the results for the same folder
+// that match it
+static void preview_start(const char *path, const char *text) {
+	static DIR_ENTRY kept[PREVIEW_RESULTS];	// too big for the stack
+	int count = 0;
+	preview_stop();
+	name_pattern(&preview.pattern, text);
+	if (preview.generation == fatfs_disk_generation() && !strcmp(path, preview.from)) {
+		for (int i = 0; i < preview.count; i++) {
+			const char *match = name_match(&preview.pattern, preview.top[i].long_filename);
+			if (match) {
+				kept[count] = preview.top[i];
+				kept[count++].isDir = match == preview.top[i].long_filename ? 1 : 0;
+			}
+		}
+	}
+	preview.count = 0;
+	for (int i = 0; i < count; i++)
+		preview_add(&kept[i]);
+	strcpy(preview.text, text);
+	strcpy(preview.from, path);
+	preview.generation = fatfs_disk_generation();
+	strcpy(preview.path, path);
+	if (f_opendir(&preview.dirs[0], preview.path) == FR_OK)
+		preview.depth = 1;
+}
 
+// go on with the walk for text under path for a slice, false once it is done
+int search_preview(char *path, char *search) {
+	if (!mount_fatfs_volume()) {
+		preview.count = 0;
+		preview.text[0] = 0;
+		return 0;
+	}
+	if (strcmp(search, preview.text) || strcmp(path, preview.from) || preview.generation != fatfs_disk_generation())
+		preview_start(path, search);
+	uint32_t start = time_us_32();
+	for (int n = 0; preview.depth && (n == 0 || (int32_t)(time_us_32() - start) < PREVIEW_SLICE_US); n++) {
+		if (f_readdir(&preview.dirs[preview.depth - 1], &fno) != FR_OK || fno.fname[0] == 0) {
+			f_closedir(&preview.dirs[--preview.depth]);
+			char *slash = strrchr(preview.path, '/');
+			if (slash)
+				*slash = 0;	// back to the folder above
+			continue;
+		}
+		if (fno.fattrib & (AM_HID | AM_SYS)) continue;
+		if (fno.fattrib & AM_DIR) {
+			const char *name = fno.altname[0] ? fno.altname : fno.fname;	// no altname when lfn is 8.3
+			size_t len = strlen(preview.path);
+			if (preview.depth == PREVIEW_DEPTH || len + 1 + strlen(name) >= 210)
+				continue;	// no more room for path in DIR_ENTRY
+			preview.path[len] = '/';
+			strcpy(preview.path + len + 1, name);
+			if (f_opendir(&preview.dirs[preview.depth], preview.path) == FR_OK)
+				preview.depth++;
+			else
+				preview.path[len] = 0;
 		}
+		else if (is_valid_file(fno.fname)) {
+			const char *match = name_match(&preview.pattern, fno.fname);
+			if (match) {
+				candidate.isDir = (match == fno.fname) ? 1 : 0;	// the search "score", as scan_files() does
+				candidate_names();
+				strcpy(candidate.full_path, preview.path);
+				preview_add(&candidate);
+			}
+		}
+	}
+	return preview.depth != 0;
+}
+
+// result n of the walk so far, NULL if there isn't one
+DIR_ENTRY *get_preview_entry(int n) {
+	return n < preview.count ? &preview.top[n] : NULL;
+}
+
+// the menu screen below its title (DIR_START_ROW-2 to DIR_END_ROW in the boot ROM)
+// as screen codes, for the menu to copy straight to its screen memory: the header,
+// the directory rows with the cursor's row inverted, or the search box with the
+// results so far under it
+#define DIR_PAGE_OFFSET		(DIR_ORDER_OFFSET + DIR_CHUNK * sizeof(uint16_t))
+#define DIR_PAGE_ROWS		15
+#define SCREEN_COLS			40
+#define MENU_HEADER_ROW		5	// DIR_START_ROW-2
+#define MENU_DIR_ROW		7	// DIR_START_ROW
+#define MENU_SEARCH_ROW		8	// the search box
+#define MENU_PREVIEW_ROW	12	// PREVIEW_ROW
+#define MENU_END_ROW		21	// DIR_END_ROW
+#define MENU_PAGE_SIZE		((MENU_END_ROW - MENU_HEADER_ROW + 1) * SCREEN_COLS)
+#define MENU_PAGE_DIR		0	// page kinds ($D504 of CART_CMD_RENDER_DIR)
+#define MENU_PAGE_RESULTS	1
+
+static unsigned char *menu_row(int row) {
+	return &cart_ram[DIR_PAGE_OFFSET + (row - MENU_HEADER_ROW) * SCREEN_COLS];
+}
+
+// ATASCII to screen code, keeping inverse video
+static unsigned char screen_code(unsigned char c) {
+	unsigned char code = c & 0x7F;
+	code = code < 32 ? code + 64 : code < 96 ? code - 32 : code;
+	return code | (c & 0x80);
+}
+
+static void put_text(unsigned char *at, const char *text, unsigned char invert) {
+	while (*text)
+		*at++ = screen_code(*text++) ^ invert;
+}
+
+// entries n from top on the rows from first to last, from get(n) until it
+// returns NULL, the entry at cursor inverted
+static void render_entries(int first, int last, DIR_ENTRY *(*get)(int), int top, int cursor) {
+	static const unsigned char folder_marker[3] = { 'D'-32+0x80, 'I'-32+0x80, 'R'-32+0x80 };	// inverse "DIR"
+	for (int n = top, r = first; r <= last; n++, r++) {
+		unsigned char *row = menu_row(r);
+		DIR_ENTRY *entry = get(n);
+		if (!entry)
+			break;
+		if (entry->isDir)
+			memcpy(row, folder_marker, sizeof(folder_marker));
+		put_text(row + 4, entry->long_filename, 0);
+		if (n == cursor)
+			for (int i = 0; i < SCREEN_COLS; i++)
+				row[i] ^= 0x80;
+	}
+}
+
+void render_dir_page(int top, int cursor, int kind) {
+	memset(menu_row(MENU_HEADER_ROW), 0, MENU_PAGE_SIZE);
+	put_text(menu_row(MENU_HEADER_ROW) + 9,
+		kind == MENU_PAGE_RESULTS ? "[  Search results  ]" : "[Directory contents]", 0x80);
+	render_entries(MENU_DIR_ROW, MENU_END_ROW, get_dir_entry, top, cursor);
+}
+
+// the box the menu types the search into (rows MENU_SEARCH_ROW on), with the text
+// and the cursor after it, and the first results of the listing or of the walk
+// for the preview under it (MENU_SHOW_*)
+#define MENU_SHOW_NONE		0
+#define MENU_SHOW_LISTING	1
+#define MENU_SHOW_PREVIEW	2
+
+void render_search_page(const char *text, int results) {
+	static const unsigned char box_top[24] = { 81,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,82,69 };
+	static const unsigned char box_bottom[24] = { 90,82,82,82,82,82,82,82,82,82,82,82,82,
+		'E'-32+0x80,'S'-32+0x80,'C'-32+0x80,0x80,'C'-32+0x80,'a'+0x80,'n'+0x80,'c'+0x80,'e'+0x80,'l'+0x80, 67 };
+	memset(menu_row(MENU_SEARCH_ROW), 0, (MENU_END_ROW - MENU_SEARCH_ROW + 1) * SCREEN_COLS);
+	unsigned char *row = menu_row(MENU_SEARCH_ROW) + 8;
+	memcpy(row, box_top, sizeof(box_top));
+	row += SCREEN_COLS;
+	row[0] = row[23] = 124;
+	put_text(row + 1, "Search:", 0);
+	put_text(row + 8, text, 0);
+	row[8 + strlen(text)] = 0x80;	// inverse space
+	memcpy(row + SCREEN_COLS, box_bottom, sizeof(box_bottom));
+	if (results != MENU_SHOW_NONE)
+		render_entries(MENU_PREVIEW_ROW, MENU_END_ROW,
+			results == MENU_SHOW_LISTING ? get_dir_entry : get_preview_entry, 0, -1);
+}
+
+int search_directory(char *path, char *search) {
+	num_dir_entries = 0;
+	chunk_valid = false;
+	if (mount_fatfs_volume()) {
+		strcpy(listing_path, path);
+		strcpy(listing_search, search);
+		listing_index = NULL;
+		listing_recent = NULL;
+		dir_cursor = 0;
+		// sorted by score, name. The menu searches again as each key is typed, a
+		// longer text only looks through the files the last one found (see
+		// dir_index_search()).
+		if (load_chunk(0) || chunk_valid)
+			return 1;
 	}
 	strcpy(errorBuf, "Problem searching flash");
 	return 0;
 }
 
 int read_directory(char *path) {
-	int ret = 0;
 	num_dir_entries = 0;
-	DIR_ENTRY *dst = (DIR_ENTRY *)&cart_ram[0];
-
-    if (!fatfs_is_mounted())
-       mount_fatfs_disk();
-
-	FATFS FatFs;
-	if (f_mount(&FatFs, "", 1) == FR_OK) {
-		DIR dir;
-		if (f_opendir(&dir, path) == FR_OK) {
-			while (num_dir_entries < 255) {
-				if (f_readdir(&dir, &fno) != FR_OK || fno.fname[0] == 0)
-					break;
-				if (fno.fattrib & (AM_HID | AM_SYS))
-					continue;
-				dst->isDir = fno.fattrib & AM_DIR ? 1 : 0;
-				if (!dst->isDir)
-					if (!is_valid_file(fno.fname)) continue;
-				// copy file record to first ram block
-				// long file name
-				strncpy(dst->long_filename, fno.fname, 31);
-				dst->long_filename[31] = 0;
-				// 8.3 name
-				if (fno.altname[0])
-		            strcpy(dst->filename, fno.altname);
-				else {	// no altname when lfn is 8.3
-					strncpy(dst->filename, fno.fname, 12);
-					dst->filename[12] = 0;
-				}
-				dst->full_path[0] = 0; // path only for search results
-	            dst++;
-				num_dir_entries++;
-			}
-			f_closedir(&dir);
-		}
-		else
-			strcpy(errorBuf, "Can't read directory");
-		f_mount(0, "", 1);
-		qsort((DIR_ENTRY *)&cart_ram[0], num_dir_entries, sizeof(DIR_ENTRY), entry_compare);
-		ret = 1;
+	chunk_valid = false;
+	if (!mount_fatfs_volume()) {
+		strcpy(errorBuf, "Can't read flash memory");
+		return 0;
+	}
+	strcpy(listing_path, path);
+	listing_search[0] = 0;
+	listing_recent = NULL;
+	RECENT_DIR *recent = recent_dir(path);
+	if (recent->size && recent->generation != fatfs_disk_generation())
+		recent_drop(recent);
+	// already filtered and sorted when the drive was last ejected
+	listing_index = dir_index_find(path);
+	if (listing_index)
+		num_dir_entries = listing_index->count;
+	else if (recent->size) {	// read since the drive was last written to
+		listing_recent = recent;
+		num_dir_entries = recent->count;
+	}
+	else if (!load_chunk(0) && !chunk_valid) {
+		strcpy(errorBuf, "Can't read directory");
+		num_dir_entries = 0;	// list it as empty
 	}
 	else
-		strcpy(errorBuf, "Can't read flash memory");
-	return ret;
+		recent_keep(recent);
+	dir_cursor = recent->cursor < num_dir_entries ? recent->cursor : 0;
+	return 1;
 }
 
 /* ATR Handling */
@@ -304,17 +1028,11 @@ typedef struct {
 
 MountedATR mountedATRs[1] = {0};
 
-FATFS FatFs;
-int doneFatFsInit = 0;
-
 int mount_atr(char *filename) {
 	// returns 0 for success or error code
 	// 1 = no media, 2 = no file, 3 = bad atr
-	if (!doneFatFsInit) {
-		if (f_mount(&FatFs, "", 1) != FR_OK)
-			return 1;
-		doneFatFsInit = 1;
-	}
+	if (!mount_fatfs_volume())
+		return 1;
 	MountedATR *mountedATR = &mountedATRs[0];
 	if (f_open(&mountedATR->fil, filename, FA_READ|FA_WRITE) != FR_OK)
 		return 2;
@@ -376,28 +1094,343 @@ int write_atr_sector(uint16_t sector, uint8_t page, uint8_t *buf) {
 	return 0;
 }
 
+/* CARTRIDGE TYPES */
+
+// state of the banking hardware, one entry per key (the byte written to $D5xx,
+// or the low address byte of the $D5xx access) plus the power on state
+typedef struct {
+	unsigned char *win[4];	// 4k windows at $8000,$9000 (S4) and $A000,$B000 (S5), NULL = not mapped
+	uint16_t page[4];		// the same as 4k pages of the image, for images in the bank cache
+	uint32_t rd;			// RD4/RD5 levels, or BANK_KEEP if the key doesn't touch the banking
+} BANK_STATE;
+
+#define BANK_KEEP			0x80000000
+#define BANK_RESUME			0x40000000	// switch back on with the last bank
+#define BANK_POWER_ON		256
+
+// CCTL decode
+#define CCTL_DATA			0x01	// key is the byte written, otherwise the low address byte
+#define CCTL_ANY_ACCESS		0x02	// reads from $D5xx switch banks too (address keyed only)
+#define CCTL_READBACK		0x04	// reads from the bank register return the last byte written
+
+// window layouts for the generic decoder
+#define LAYOUT_S5_8K		0		// 8k bank at $A000
+#define LAYOUT_S4_8K		1		// 8k bank at $8000, last 8k of the image fixed at $A000
+#define LAYOUT_16K			2		// 16k bank at $8000
+
+typedef struct CART_DESC CART_DESC;
+struct CART_DESC {
+	uint8_t car_type;		// .CAR file type
+	uint8_t cart_type;		// CART_TYPE_*
+	uint32_t size;			// expected .CAR image size
+	uint8_t cctl;			// CCTL_* flags
+	uint8_t reg_mask;		// $D5xx accesses that hit the bank register,
+	uint8_t reg_match;		// (addr & reg_mask) == reg_match
+	uint8_t layout;			// LAYOUT_*
+	uint8_t bank_mask;		// bank = (key ^ bank_xor) & bank_mask
+	uint8_t bank_xor;
+	uint8_t off_bit;		// key bit that switches the cartridge off
+	void (*decode)(const CART_DESC *desc, int key, BANK_STATE *st);
+};
+
+// map the image from offset into a window, win is only meaningful if the image is in cart_ram
+static void map_4k(BANK_STATE *st, int win, uint32_t offset) {
+	st->win[win] = offset < sizeof(cart_ram) ? &cart_ram[offset] : NULL;
+	st->page[win] = offset >> 12;
+}
+
+static void map_8k(BANK_STATE *st, int win, uint32_t offset) {
+	map_4k(st, win, offset);
+	map_4k(st, win+1, offset + 0x1000);
+}
+
+// powers on with bank 0 selected
+void decode_generic(const CART_DESC *desc, int key, BANK_STATE *st) {
+	int bank = 0;
+	if (key != BANK_POWER_ON) {
+		if (!(desc->cctl & CCTL_DATA) && (key & desc->reg_mask) != desc->reg_match)
+			{ st->rd = BANK_KEEP; return; }
+		if (key & desc->off_bit)
+			{ st->rd = 0; return; }
+		bank = (key ^ desc->bank_xor) & desc->bank_mask;
+	}
+	if (desc->layout == LAYOUT_S5_8K) {
+		map_8k(st, 2, 8192*bank);
+		st->rd = RD5_GPIO_MASK;
+	}
+	else if (desc->layout == LAYOUT_S4_8K) {
+		map_8k(st, 0, 8192*bank);
+		map_8k(st, 2, desc->size - 8192);
+		st->rd = RD4_GPIO_MASK | RD5_GPIO_MASK;
+	}
+	else {
+		map_8k(st, 0, 16384*bank);
+		map_8k(st, 2, 16384*bank + 8192);
+		st->rd = RD4_GPIO_MASK | RD5_GPIO_MASK;
+	}
+}
+
+// powers on with the 4k bank at $A000 selected by key 0, $B000 is fixed. The 8k
+// version only has the two banks, A0 makes no difference to it
+void decode_OSS_B(const CART_DESC *desc, int key, BANK_STATE *st) {
+	int a0 = key & 1, a3 = key & 8;
+	if (key == BANK_POWER_ON) a0 = a3 = 0;
+	if (a3 && !a0) { st->rd = 0; return; }
+	int bank = 1;
+	if (!a3 && a0) bank = 3;
+	else if (a3 && a0) bank = 2;
+	bank &= desc->size / 4096 - 1;
+	map_4k(st, 2, 4096*bank);
+	map_4k(st, 3, 0);
+	st->rd = RD5_GPIO_MASK;
+}
+
+void decode_OSS_A(const CART_DESC *desc, int key, BANK_STATE *st) {
+	int is034M = desc->cart_type == CART_TYPE_OSS_16K_034M;
+	if (key == BANK_POWER_ON) key = 0;
+	key &= 0xF;
+	if (key & 0x8) { st->rd = 0; return; }
+	int bank;
+	if (key == 0x0) bank = 0;
+	else if (key == 0x3 || key == 0x7) bank = is034M ? 1 : 2;
+	else if (key == 0x4) bank = is034M ? 2 : 1;
+	else { st->rd = BANK_RESUME; return; }
+	map_4k(st, 2, 4096*bank);
+	map_4k(st, 3, 0x3000);	// 4k bank #3 always mapped to $Bxxx
+	st->rd = RD5_GPIO_MASK;
+}
+
+// $D5E0-$D5EF selects the 8k banks of the first 64k (second 64k for the 128k version)
+void decode_SDX(const CART_DESC *desc, int key, BANK_STATE *st) {
+	uint32_t base = 0;
+	if (key == BANK_POWER_ON)
+		key = 0xE7;
+	else if ((key & 0xF0) == 0xE0) {
+		if (desc->size == 131072) base = 65536;
+	}
+	else if ((key & 0xF0) != 0xF0 || desc->size != 131072)
+		{ st->rd = BANK_KEEP; return; }
+	if (key & 0x8) { st->rd = 0; return; }
+	map_8k(st, 2, base + 8192*((~key) & 0x7));
+	st->rd = RD5_GPIO_MASK;
+}
+
+void decode_SIC(const CART_DESC *desc, int key, BANK_STATE *st) {
+	if (key == BANK_POWER_ON) key = 0;
+	int bank = key & desc->bank_mask;
+	st->rd = 0;
+	if (key & 0x20) {
+		map_8k(st, 0, 16384*bank);
+		st->rd |= RD4_GPIO_MASK;
+	}
+	if (!(key & 0x40)) {
+		map_8k(st, 2, 16384*bank + 8192);
+		st->rd |= RD5_GPIO_MASK;
+	}
+}
+
+// any access to $D5xx switches the cartridge off for good
+void decode_blizzard(const CART_DESC *desc, int key, BANK_STATE *st) {
+	(void) desc;
+	if (key != BANK_POWER_ON) { st->rd = 0; return; }
+	map_8k(st, 0, 0);
+	map_8k(st, 2, 8192);
+	st->rd = RD4_GPIO_MASK | RD5_GPIO_MASK;
+}
+
+// the original 8 Mbit Atarimax powers on with the last bank selected
+void decode_atarimax_8mbit(const CART_DESC *desc, int key, BANK_STATE *st) {
+	decode_generic(desc, key == BANK_POWER_ON ? desc->bank_mask : key, st);
+}
+
+// .CAR type, cart type, size, cctl, register mask/match, layout, bank mask/xor, off bit, decoder
+// cart types without a decoder have their own emulation loop
+const CART_DESC cart_descs[] = {
+	{ 1, CART_TYPE_8K, 8192, 0, 0, 0, 0, 0, 0, 0, NULL },
+	{ 2, CART_TYPE_16K, 16384, 0, 0, 0, 0, 0, 0, 0, NULL },
+	{ 3, CART_TYPE_OSS_16K_034M, 16384, CCTL_ANY_ACCESS, 0, 0, 0, 0, 0, 0, decode_OSS_A },
+	{ 8, CART_TYPE_WILLIAMS_64K, 65536, CCTL_ANY_ACCESS, 0xF0, 0x00, LAYOUT_S5_8K, 0x07, 0, 0x08, decode_generic },
+	{ 9, CART_TYPE_EXPRESS_64K, 65536, CCTL_ANY_ACCESS, 0xF0, 0x70, LAYOUT_S5_8K, 0x07, 0xFF, 0x08, decode_generic },
+	{ 10, CART_TYPE_DIAMOND_64K, 65536, CCTL_ANY_ACCESS, 0xF0, 0xD0, LAYOUT_S5_8K, 0x07, 0xFF, 0x08, decode_generic },
+	{ 11, CART_TYPE_SDX_64K, 65536, CCTL_ANY_ACCESS, 0, 0, 0, 0, 0, 0, decode_SDX },
+	{ 12, CART_TYPE_XEGS_32K, 32768, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x03, 0, 0, decode_generic },
+	{ 13, CART_TYPE_XEGS_64K, 65536, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x07, 0, 0, decode_generic },
+	{ 14, CART_TYPE_XEGS_128K, 131072, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x0F, 0, 0, decode_generic },
+	{ 23, CART_TYPE_XEGS_256K, 262144, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x1F, 0, 0, decode_generic },
+	{ 24, CART_TYPE_XEGS_512K, 524288, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x3F, 0, 0, decode_generic },
+	{ 25, CART_TYPE_XEGS_1M, 1048576, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x7F, 0, 0, decode_generic },
+	{ 15, CART_TYPE_OSS_16K_TYPE_B, 16384, CCTL_ANY_ACCESS, 0, 0, 0, 0, 0, 0, decode_OSS_B },
+	{ 17, CART_TYPE_ATRAX_128K, 131072, CCTL_DATA, 0, 0, LAYOUT_S5_8K, 0x0F, 0, 0x80, decode_generic },
+	{ 18, CART_TYPE_BOUNTY_BOB, 40960, 0, 0, 0, 0, 0, 0, 0, NULL },
+	{ 22, CART_TYPE_WILLIAMS_64K, 32768, CCTL_ANY_ACCESS, 0xF0, 0x00, LAYOUT_S5_8K, 0x03, 0, 0x08, decode_generic },
+	{ 26, CART_TYPE_MEGACART_16K, 16384, CCTL_DATA, 0, 0, LAYOUT_16K, 0x00, 0, 0x80, decode_generic },
+	{ 27, CART_TYPE_MEGACART_32K, 32768, CCTL_DATA, 0, 0, LAYOUT_16K, 0x01, 0, 0x80, decode_generic },
+	{ 28, CART_TYPE_MEGACART_64K, 65536, CCTL_DATA, 0, 0, LAYOUT_16K, 0x03, 0, 0x80, decode_generic },
+	{ 29, CART_TYPE_MEGACART_128K, 131072, CCTL_DATA, 0, 0, LAYOUT_16K, 0x07, 0, 0x80, decode_generic },
+	{ 30, CART_TYPE_MEGACART_256K, 262144, CCTL_DATA, 0, 0, LAYOUT_16K, 0x0F, 0, 0x80, decode_generic },
+	{ 31, CART_TYPE_MEGACART_512K, 524288, CCTL_DATA, 0, 0, LAYOUT_16K, 0x1F, 0, 0x80, decode_generic },
+	{ 32, CART_TYPE_MEGACART_1M, 1048576, CCTL_DATA, 0, 0, LAYOUT_16K, 0x3F, 0, 0x80, decode_generic },
+	{ 33, CART_TYPE_SW_XEGS_32K, 32768, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x03, 0, 0x80, decode_generic },
+	{ 34, CART_TYPE_SW_XEGS_64K, 65536, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x07, 0, 0x80, decode_generic },
+	{ 35, CART_TYPE_SW_XEGS_128K, 131072, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x0F, 0, 0x80, decode_generic },
+	{ 36, CART_TYPE_SW_XEGS_256K, 262144, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x1F, 0, 0x80, decode_generic },
+	{ 37, CART_TYPE_SW_XEGS_512K, 524288, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x3F, 0, 0x80, decode_generic },
+	{ 38, CART_TYPE_SW_XEGS_1M, 1048576, CCTL_DATA, 0, 0, LAYOUT_S4_8K, 0x7F, 0, 0x80, decode_generic },
+	{ 40, CART_TYPE_BLIZZARD_16K, 16384, CCTL_ANY_ACCESS, 0, 0, 0, 0, 0, 0, decode_blizzard },
+	{ 41, CART_TYPE_ATARIMAX_1MBIT, 131072, CCTL_ANY_ACCESS, 0xE0, 0x00, LAYOUT_S5_8K, 0x0F, 0, 0x10, decode_generic },
+	{ 42, CART_TYPE_ATARIMAX_8MBIT, 1048576, CCTL_ANY_ACCESS, 0x00, 0x00, LAYOUT_S5_8K, 0x7F, 0, 0x80, decode_atarimax_8mbit },
+	{ 43, CART_TYPE_SDX_128K, 131072, CCTL_ANY_ACCESS, 0, 0, 0, 0, 0, 0, decode_SDX },
+	{ 44, CART_TYPE_OSS_8K, 8192, CCTL_ANY_ACCESS, 0, 0, 0, 0, 0, 0, decode_OSS_B },
+	{ 45, CART_TYPE_OSS_16K_043M, 16384, CCTL_ANY_ACCESS, 0, 0, 0, 0, 0, 0, decode_OSS_A },
+	{ 50, CART_TYPE_TURBOSOFT_64K, 65536, CCTL_ANY_ACCESS, 0x00, 0x00, LAYOUT_S5_8K, 0x07, 0, 0x10, decode_generic },
+	{ 51, CART_TYPE_TURBOSOFT_128K, 131072, CCTL_ANY_ACCESS, 0x00, 0x00, LAYOUT_S5_8K, 0x0F, 0, 0x10, decode_generic },
+	{ 54, CART_TYPE_SIC_128K, 131072, CCTL_DATA|CCTL_READBACK, 0xE0, 0x00, 0, 0x07, 0, 0, decode_SIC },
+	{ 55, CART_TYPE_SIC_256K, 262144, CCTL_DATA|CCTL_READBACK, 0xE0, 0x00, 0, 0x0F, 0, 0, decode_SIC },
+	{ 56, CART_TYPE_SIC_512K, 524288, CCTL_DATA|CCTL_READBACK, 0xE0, 0x00, 0, 0x1F, 0, 0, decode_SIC },
+	{ 58, CART_TYPE_4K, 4096, 0, 0, 0, 0, 0, 0, 0, NULL },
+};
+
+#define NUM_CART_DESCS	(int)(sizeof(cart_descs) / sizeof(cart_descs[0]))
+
+const CART_DESC *find_car_type(int car_type) {
+	for (int i = 0; i < NUM_CART_DESCS; i++)
+		if (cart_descs[i].car_type == car_type)
+			return &cart_descs[i];
+	return NULL;
+}
+
+const CART_DESC *find_cart_type(int cart_type) {
+	for (int i = 0; i < NUM_CART_DESCS; i++)
+		if (cart_descs[i].cart_type == cart_type)
+			return &cart_descs[i];
+	return NULL;
+}
+
 /* CARTRIDGE/XEX HANDLING */
 
+static const CART_DESC *car_desc;	// the .CAR type load_file() found, cart types can have more than one
+static bool xex_cached;	// the XEX was left in flash by load_file(), for the bank cache
+
+// segment table of the XEX, the loader reads it from $D5xx pages XEX_TABLE_PAGE on
+// (see xex_engine()) and copies each segment straight from its place in the stream
+typedef struct {
+	uint16_t start;
+	uint16_t len;		// end - start + 1
+	uint16_t page;		// where the data is in the stream the loader reads (the
+	uint8_t pos;		// file behind its length, see load_file())
+	uint8_t flags;
+} XEX_SEGMENT;
+
+#define XEX_MAX_SEGMENTS	1024
+#define XEX_TABLE_PAGE		0x8000
+#define XEX_WAIT_PAGE		0x4000	// reads 0 until the block of the page set before is in SRAM
+#define XEX_TABLE_PAGES		(XEX_MAX_SEGMENTS * sizeof(XEX_SEGMENT) / 256)
+#define XEX_SEG_INIT		0x01	// writes INITAD ($2E2-$2E3), the loader calls it after
+#define XEX_SEG_RUN			0x02	// writes RUNAD ($2E0-$2E1)
+#define XEX_SEG_END			0x80	// end of the table
+
+static XEX_SEGMENT xex_table[XEX_MAX_SEGMENTS];
+static uint16_t xex_segments;
+static uint32_t xex_bytes;
+
+// read a little endian word of the XEX, false at the end of the file
+static bool read_xex_word(FIL *fil, uint16_t *word) {
+	uint8_t buf[2];
+	UINT br;
+	if (f_read(fil, buf, 2, &br) != FR_OK || br != 2)
+		return false;
+	*word = buf[0] | (buf[1] << 8);
+	return true;
+}
+
+// build xex_table from the segment headers of an open XEX, and leave the file at
+// the start. Returns 0 with errorBuf set if the file isn't one the loader can run.
+// Bytes after the last segment that are too few for the segment they start
+// (padding, or a copy cut short) end the table instead of turning the file down.
+static int parse_xex(FIL *fil) {
+	uint32_t size = f_size(fil), offset = 0;
+	uint16_t start, end;
+	XEX_SEGMENT *seg = xex_table;
+
+	xex_segments = 0;
+	xex_bytes = 0;
+	while (offset < size) {
+		if (!read_xex_word(fil, &start))
+			goto truncated;
+		offset += 2;
+		if (start == 0xFFFF) {
+			if (!read_xex_word(fil, &start))
+				goto truncated;
+			offset += 2;
+		}
+		else if (xex_segments == 0) {
+			strcpy(errorBuf, "Not an XEX file");
+			return 0;
+		}
+		if (!read_xex_word(fil, &end))
+			goto truncated;
+		offset += 2;
+		if (end < start) {
+			snprintf(errorBuf, sizeof(errorBuf), "XEX segment %d ends before start", xex_segments + 1);
+			return 0;
+		}
+		if (offset + end - start + 1 > size)
+			goto truncated;
+		if (xex_segments == XEX_MAX_SEGMENTS - 1) {
+			snprintf(errorBuf, sizeof(errorBuf), "XEX has over %d segments", XEX_MAX_SEGMENTS - 1);
+			return 0;
+		}
+		seg->start = start;
+		seg->len = end - start + 1;
+		seg->page = (4 + offset) >> 8;
+		seg->pos = (4 + offset) & 0xFF;
+		seg->flags = 0;
+		if (start <= 0x2E3 && end >= 0x2E2)
+			seg->flags |= XEX_SEG_INIT;
+		if (start <= 0x2E1 && end >= 0x2E0)
+			seg->flags |= XEX_SEG_RUN;
+		offset += end - start + 1;
+		if (f_lseek(fil, offset) != FR_OK)
+			goto truncated;
+		xex_bytes += end - start + 1;
+		xex_segments++;
+		seg++;
+	}
+	if (xex_segments == 0) {
+		strcpy(errorBuf, "Empty XEX file");
+		return 0;
+	}
+end:
+	seg->flags = XEX_SEG_END;
+	return f_lseek(fil, 0) == FR_OK;
+
+truncated:
+	if (xex_segments)
+		goto end;	// trailing bytes
+	snprintf(errorBuf, sizeof(errorBuf), "XEX segment %d is truncated", xex_segments + 1);
+	return 0;
+}
+
 int load_file(char *filename) {
-	FATFS FatFs;
 	int cart_type = CART_TYPE_NONE;
-	int car_file = 0, xex_file = 0, expectedSize = 0;
+	int car_file = 0, xex_file = 0;
 	unsigned char carFileHeader[16];
-	UINT br, size = 0;
+	UINT br, size = 0, expectedSize = 0;
 
 	if (strncasecmp(filename+strlen(filename)-4, ".CAR", 4) == 0)
 		car_file = 1;
 	if (strncasecmp(filename+strlen(filename)-4, ".XEX", 4) == 0)
 		xex_file = 1;
 
-	if (f_mount(&FatFs, "", 1) != FR_OK) {
+	car_desc = NULL;
+	if (!mount_fatfs_volume()) {
 		strcpy(errorBuf, "Can't read flash memory");
 		return 0;
 	}
 	FIL fil;
 	if (f_open(&fil, filename, FA_READ) != FR_OK) {
 		strcpy(errorBuf, "Can't open file");
-		goto cleanup;
+		return 0;
 	}
 
 	// read the .CAR file header?
@@ -406,59 +1439,81 @@ int load_file(char *filename) {
 			strcpy(errorBuf, "Bad CAR file");
 			goto closefile;
 		}
-		int car_type = carFileHeader[7];
-		if (car_type == 1)			{ cart_type = CART_TYPE_8K; expectedSize = 8192; }
-		else if (car_type == 2)		{ cart_type = CART_TYPE_16K; expectedSize = 16384; }
-		else if (car_type == 3) 	{ cart_type = CART_TYPE_OSS_16K_034M; expectedSize = 16384; }
-		else if (car_type == 8)		{ cart_type = CART_TYPE_WILLIAMS_64K; expectedSize = 65536; }
-		else if (car_type == 9)		{ cart_type = CART_TYPE_EXPRESS_64K; expectedSize = 65536; }
-		else if (car_type == 10)	{ cart_type = CART_TYPE_DIAMOND_64K; expectedSize = 65536; }
-		else if (car_type == 11)	{ cart_type = CART_TYPE_SDX_64K; expectedSize = 65536; }
-		else if (car_type == 12) 	{ cart_type = CART_TYPE_XEGS_32K; expectedSize = 32768; }
-		else if (car_type == 13) 	{ cart_type = CART_TYPE_XEGS_64K; expectedSize = 65536; }
-		else if (car_type == 14) 	{ cart_type = CART_TYPE_XEGS_128K; expectedSize = 131072; }
-		else if (car_type == 15) 	{ cart_type = CART_TYPE_OSS_16K_TYPE_B; expectedSize = 16384; }
-		else if (car_type == 17) 	{ cart_type = CART_TYPE_ATRAX_128K; expectedSize = 131072; }
-		else if (car_type == 18) 	{ cart_type = CART_TYPE_BOUNTY_BOB; expectedSize = 40960; }
-		else if (car_type == 22)	{ cart_type = CART_TYPE_WILLIAMS_64K; expectedSize = 32768; }
-		else if (car_type == 26)	{ cart_type = CART_TYPE_MEGACART_16K; expectedSize = 16384; }
-		else if (car_type == 27)	{ cart_type = CART_TYPE_MEGACART_32K; expectedSize = 32768; }
-		else if (car_type == 28)	{ cart_type = CART_TYPE_MEGACART_64K; expectedSize = 65536; }
-		else if (car_type == 29)	{ cart_type = CART_TYPE_MEGACART_128K; expectedSize = 131072; }
-		else if (car_type == 33)	{ cart_type = CART_TYPE_SW_XEGS_32K; expectedSize = 32768; }
-		else if (car_type == 34)	{ cart_type = CART_TYPE_SW_XEGS_64K; expectedSize = 65536; }
-		else if (car_type == 35)	{ cart_type = CART_TYPE_SW_XEGS_128K; expectedSize = 131072; }
-		else if (car_type == 40)	{ cart_type = CART_TYPE_BLIZZARD_16K; expectedSize = 16384; }
-		else if (car_type == 41)	{ cart_type = CART_TYPE_ATARIMAX_1MBIT; expectedSize = 131072; }
-		else if (car_type == 43)	{ cart_type = CART_TYPE_SDX_128K; expectedSize = 131072; }
-		else if (car_type == 44)	{ cart_type = CART_TYPE_OSS_8K; expectedSize = 8192; }
-		else if (car_type == 45) 	{ cart_type = CART_TYPE_OSS_16K_043M; expectedSize = 16384; }
-		else if (car_type == 50)	{ cart_type = CART_TYPE_TURBOSOFT_64K; expectedSize = 65536; }
-		else if (car_type == 51)	{ cart_type = CART_TYPE_TURBOSOFT_128K; expectedSize = 131072; }
-		else if (car_type == 54)	{ cart_type = CART_TYPE_SIC_128K; expectedSize = 131072; }
-		else if (car_type == 58)	{ cart_type = CART_TYPE_4K; expectedSize = 4096; }
+		const CART_DESC *desc = find_car_type(carFileHeader[7]);
+		if (desc) {
+			car_desc = desc;
+			cart_type = desc->cart_type;
+			expectedSize = desc->size;
+		}
 		else {
 			strcpy(errorBuf, "Unsupported CAR type");
 			goto closefile;
 		}
 	}
 
+	if (xex_file && !parse_xex(&fil))
+		goto closefile;
+
 	// set a default error
 	strcpy(errorBuf, "Can't read file");
 
+	if (expectedSize > sizeof(cart_ram)) {
+		// too big for SRAM, leave it in flash for the bank cache
+		if (f_size(&fil) != 16 + expectedSize) {
+			strcpy(errorBuf, "CAR file is wrong size");
+			cart_type = CART_TYPE_NONE;
+		}
+		else if (!bank_cache_open(&fil, expectedSize)) {
+			strcpy(errorBuf, "CAR file too fragmented");
+			cart_type = CART_TYPE_NONE;
+		}
+		else if (!bank_cache_fits(sizeof(cart_ram))) {
+			strcpy(errorBuf, "CAR has over 120k of different banks");
+			cart_type = CART_TYPE_NONE;
+		}
+		goto closefile;
+	}
+
+	xex_cached = false;
+	if (xex_file) {
+		// streamed from flash as the loader reads it, through the bank cache
+		if (bank_cache_open_xex(&fil)) {
+			cart_type = CART_TYPE_XEX;
+			xex_cached = true;
+			goto closefile;
+		}
+		// else it has to fit in cart_ram
+		if (f_size(&fil) > BANK_CACHE_MAX_IMAGE - 4) {
+			strcpy(errorBuf, "XEX too big (>1MB)");
+			goto closefile;
+		}
+		if (f_size(&fil) > sizeof(cart_ram) - 4) {
+			strcpy(errorBuf, "XEX file too fragmented");
+			goto closefile;
+		}
+	}
+
 	unsigned char *dst = &cart_ram[0];
-	int bytes_to_read = 128 * 1024;
+	UINT bytes_to_read = 128 * 1024;
 	if (xex_file) {
 		dst += 4;	// leave room for the file length at the start of sram
 		bytes_to_read -= 4;
 	}
-	// read the file to SRAM
-	if (f_read(&fil, dst, bytes_to_read, &br) != FR_OK) {
-		cart_type = CART_TYPE_NONE;
-		goto closefile;
+	// read the file to SRAM, 8k at a time for the progress shown by the menu
+	for (UINT n = 8192; size < bytes_to_read; size += br) {
+		if (bytes_to_read - size < n)
+			n = bytes_to_read - size;
+		if (f_read(&fil, dst + size, n, &br) != FR_OK) {
+			cart_type = CART_TYPE_NONE;
+			goto closefile;
+		}
+		if (br < n) {
+			size += br;
+			break;
+		}
+		cart_progress = (uint64_t)(size + br) * 100 / f_size(&fil);
 	}
-	size += br;
-	if (br == bytes_to_read) {
+	if (size == bytes_to_read) {
 		// that's 128k read, is there any more?
 		if (f_read(&fil, carFileHeader, 1, &br) != FR_OK) {
 			cart_type = CART_TYPE_NONE;
@@ -507,72 +1562,161 @@ int load_file(char *filename) {
 
 closefile:
 	f_close(&fil);
-cleanup:
-	f_mount(0, "", 1);
-
 	return cart_type;
 }
 
 
+// worst case CPU clocks from a cycle arriving to it being answered, for each engine.
+// atari_bus_clock() picks the system clock from these. To measure one, build with
+// BUS_TIMING=1 and run software that works the engine hard (bank switching games for
+// BANKED, a big XEX for XEX_LOADER), then switch the Atari off: BUSTIME.TXT gives the
+// top of the highest S4/S5/CCTL read bucket as "engine clocks measured", the number
+// to put here, and flags one that is over the value the session ran with. Take the
+// highest over a few sessions. For BOOT_ROM, switch the Atari off with the menu up.
+// BANKED covers the bank cache too, a cached image is all resident and takes the
+// same path as one in cart_ram.
+#define ENGINE_CLOCKS_BOOT_ROM		22
+#define ENGINE_CLOCKS_BANKED		24
+#define ENGINE_CLOCKS_BOUNTY_BOB	24
+#define ENGINE_CLOCKS_XEX_LOADER	16
+
+// an engine the fastest clock can't get on the bus within BUS_BUDGET_NS would miss
+// reads on the slower boards, it has to get faster before it can go in
+#if ATARI_BUS_READ_NS(ENGINE_CLOCKS_BOOT_ROM) > BUS_BUDGET_NS
+#error "ENGINE_CLOCKS_BOOT_ROM misses BUS_BUDGET_NS at ATARI_BUS_MAX_KHZ"
+#endif
+#if ATARI_BUS_READ_NS(ENGINE_CLOCKS_BANKED) > BUS_BUDGET_NS || ATARI_BUS_READ_NS(ENGINE_CLOCKS_BOUNTY_BOB) > BUS_BUDGET_NS
+#error "ENGINE_CLOCKS_BANKED or ENGINE_CLOCKS_BOUNTY_BOB misses BUS_BUDGET_NS at ATARI_BUS_MAX_KHZ"
+#endif
+#if ATARI_BUS_READ_NS(ENGINE_CLOCKS_XEX_LOADER) > BUS_BUDGET_NS
+#error "ENGINE_CLOCKS_XEX_LOADER misses BUS_BUDGET_NS at ATARI_BUS_MAX_KHZ"
+#endif
+
 /*
  Theory of Operation
  -------------------
  Atari sends command to mcu on cart by writing to $D5DF ($D5E0-$D5FF = SDX)
  (extra paramters for the command in $D500-$D5DE)
- Atari must be running from RAM when it sends a command, since the mcu on the cart will
- go away at that point.
- Atari polls $D500 until it reads $11. At this point it knows the mcu is back
- and it is safe to rts back to code in cartridge ROM again.
+ The boot ROM and $D5xx stay on the bus while the command runs (core1 serves
+ them, core0 runs the command), so the Atari can carry on from cartridge ROM.
+ Atari polls $D500 until it reads $11 (CART_STATUS_DONE), it reads $12
+ (CART_STATUS_BUSY) until then, and $D5DF counts up as the command progresses.
+ Writes to $D5xx are ignored while the command is busy.
  Results of the command are in $D501-$D5DF
+ Bulk data doesn't have to squeeze through the mailbox: CART_CMD_MAP_WINDOW maps
+ 8k block $D500 of cart_ram at $A000-$BFFF in place of the boot ROM ($FF maps
+ the ROM back), straight away on the write to $D5DF. The Atari has to be running
+ from RAM to use it, and copies at full speed with plain LDA/STA loops.
+ CART_CMD_RENDER_DIR has core0 draw the page of the directory from entry
+ $D500-$D501 (a word, listings can be bigger than 255 entries) with the cursor
+ on entry $D502-$D503 and the header for page kind $D504, the way the menu shows
+ it (see render_dir_page()), and map that at $B000-$B7FF, which the boot ROM
+ leaves free, so the menu can draw a page without a command per entry.
+ CART_CMD_SEARCH_PREVIEW draws the search box the same way, with the text typed
+ and the first results under it (see render_search_page()). From the index it
+ answers 0 and the results are the listing, otherwise it answers 2 with the
+ best results of the walk so far and $D502 1 until the walk is done (see
+ search_preview()).
 */
 
-int __not_in_flash_func(emulate_boot_rom)(int atrMode) {
-	if (atrMode) RD5_LOW; else RD5_HIGH;
-	RD4_LOW;
-    cart_d5xx[0x00] = 0x11;	// signal that we are here
-    uint32_t pins, last;
+// 2k windows at $A000,$A800,$B000,$B800, the boot ROM unless remapped by a command
+// (on either core)
+static const unsigned char *volatile boot_win[4];
+
+// runs on core1 for as long as the menu is up, nothing in here may touch flash
+// since core0 writes to it while running commands
+void __not_in_flash_func(emulate_boot_rom)() {
+    const unsigned char *base;
+    uint32_t pins;
     uint16_t addr;
     uint8_t data;
+#if BUS_TIMING
+    bus_timing_systick();   // core1's own, bus_trace_start_menu() ran on core0
+#endif
+    atari_bus_start();
     while (1)
     {
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            if (pins & RW_GPIO_MASK)
-            {   // atari is reading
-                SET_DATA_MODE_OUT;
-                addr = pins & ADDR_GPIO_MASK;
-                gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(cart_d5xx[addr&0xFF])) << 13);
-                // wait for phi2 low
-                while (gpio_get_all() & PHI2_GPIO_MASK) ;
-                SET_DATA_MODE_IN;
+        pins = atari_bus_next();
+
+        if (pins & RW_GPIO_MASK)
+        {   // atari is reading
+            addr = pins & ADDR_GPIO_MASK;
+            if (!(pins & CCTL_GPIO_MASK)) {
+                addr &= 0xFF;
+                data = cart_d5xx[addr];
+                if (cart_busy) {
+                    if (addr == 0x00) data = CART_STATUS_BUSY;
+                    else if (addr == 0xDF) data = cart_progress;
+                }
+                atari_bus_drive(data);
             }
+            else if (!(pins & S5_GPIO_MASK))
+                atari_bus_drive(boot_win[addr >> 11][addr & 0x7FF]);
             else
-            {   // atari is writing
-                addr = pins & 0xFF;
-				last = pins;
-                // read data bus on falling edge of phi2
-                while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-                    last = pins;
-                data = (last & DATA_GPIO_MASK) >> 13;
-                cart_d5xx[addr] = data;
-                if (addr == 0xDF)	// write to $D5DF
-                    break;
-            }
+                atari_bus_float();
         }
-        else if (!(pins & S5_GPIO_MASK))
-        {   // normal cartridge read
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(A8PicoCart_rom[addr])) << 13);
-            // wait for phi2 low
-            while (gpio_get_all() & PHI2_GPIO_MASK) ;
-            SET_DATA_MODE_IN;
+        else if (!(pins & CCTL_GPIO_MASK) && !cart_busy)
+        {   // atari is writing to $D5xx
+            addr = pins & 0xFF;
+            data = (pins & DATA_GPIO_MASK) >> 13;
+            cart_d5xx[addr] = data;
+            if (addr == 0xDF && data == CART_CMD_MAP_WINDOW) {
+                base = cart_d5xx[0x00] < sizeof(cart_ram) / 0x2000 ? &cart_ram[cart_d5xx[0x00] << 13] : A8PicoCart_rom;
+                for (int i = 0; i < 4; i++)
+                    boot_win[i] = base + i * 0x800;
+                cart_d5xx[0x00] = CART_STATUS_DONE;
+            }
+            else if (addr == 0xDF) {	// write to $D5DF, hand the command to core0
+                cart_progress = 0;
+                cart_busy = 1;
+                __sev();
+            }
         }
     }
-    return data;
+}
+
+// put the menu on the bus on core1, which gets bus priority over core0
+void boot_rom_start(int atrMode) {
+	if (atrMode) RD5_LOW; else RD5_HIGH;
+	RD4_LOW;
+	cart_d5xx[0x00] = CART_STATUS_DONE;	// signal that we are here
+	cart_busy = 0;
+	for (int i = 0; i < 4; i++)
+		boot_win[i] = A8PicoCart_rom + i * 0x800;
+	bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_PROC1_BITS;
+	multicore_launch_core1(emulate_boot_rom);
+}
+
+// take the bus back from core1, for the cartridge emulation
+void boot_rom_stop() {
+	multicore_reset_core1();
+	bus_ctrl_hw->priority = 0;
+}
+
+// the next command written to $D5DF
+int boot_rom_command() {
+	while (!cart_busy)
+#if BUS_TRACE || BUS_TIMING
+		bus_trace_watch();	// the menu's session ends when the Atari is switched off
+#else
+		__wfe();
+#endif
+	return cart_d5xx[0xDF];
+}
+
+// the results are in the mailbox, let the Atari carry on
+void boot_rom_done() {
+	cart_d5xx[0x00] = CART_STATUS_DONE;
+	__dmb();
+	cart_busy = 0;
+}
+
+// the DMA lookup in atari_rom_start() needs the ROM 8k aligned in SRAM,
+// move the image up to the first 8k boundary in cart_ram
+unsigned char *align_rom(int size) {
+	unsigned char *rom = (unsigned char *)(((uint32_t)&cart_ram[0] + 0x1FFF) & ~0x1FFF);
+	memmove(rom, &cart_ram[0], size);
+	return rom;
 }
 
 void __not_in_flash_func(emulate_standard_8k)() {
@@ -580,20 +1724,10 @@ void __not_in_flash_func(emulate_standard_8k)() {
 	RD4_LOW;
 	RD5_HIGH;
 
-    uint32_t pins;
-    uint16_t addr;
-	while (1)
-	{      
-		// wait for s5 low
-        while ((pins = gpio_get_all()) & S5_GPIO_MASK) ;
-        SET_DATA_MODE_OUT;
-		// while s5 low
-		while(!((pins = gpio_get_all()) & S5_GPIO_MASK)) {
-			addr = pins & ADDR_GPIO_MASK;
-			gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr]) << 13);
-		}
-        SET_DATA_MODE_IN;
-	}
+	// fixed window, served by the PIO and DMA - no overclocking needed
+	atari_bus_clock(0);
+	atari_rom_start(NULL, align_rom(0x2000));
+	while (1) __wfi();
 }
 
 void __not_in_flash_func(emulate_standard_16k)() {
@@ -601,870 +1735,383 @@ void __not_in_flash_func(emulate_standard_16k)() {
 	RD4_HIGH;
 	RD5_HIGH;
 
-    uint32_t pins;
-    uint16_t addr;
-	while (1)
-	{
-		// wait for either s4 or s5 low
-		while (((pins = gpio_get_all()) & S4_S5_GPIO_MASK) == S4_S5_GPIO_MASK) ;
-		SET_DATA_MODE_OUT;
-		if (!(pins & S4_GPIO_MASK)) {
-			// while s4 low
-			while(!((pins = gpio_get_all()) & S4_GPIO_MASK)) {
-				addr = pins & ADDR_GPIO_MASK;
-				gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr]) << 13);
-			}
-		}
-		else {
-			// while s5 low
-			while(!((pins = gpio_get_all()) & S5_GPIO_MASK)) {
-				addr = pins & ADDR_GPIO_MASK;
-				gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x2000|addr]) << 13);
-			}
-		}
-		SET_DATA_MODE_IN;
-	}
+	// fixed windows, served by the PIO and DMA - no overclocking needed
+	atari_bus_clock(0);
+	unsigned char *rom = align_rom(0x4000);
+	atari_rom_start(rom, rom + 0x2000);
+	while (1) __wfi();
 }
 
-void __not_in_flash_func(emulate_XEGS_32k)(char switchable) {
-	// 32k
-	RD4_HIGH;
-	RD5_HIGH;
+BANK_STATE bank_table[257];
+static bool bank_resume;	// some key switches the cartridge back on after it is switched off
 
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	unsigned char *bankPtr = &cart_ram[0];
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
+// nothing can switch the cartridge back on, leave the bus alone and sleep for good
+static void __not_in_flash_func(cart_off)() {
+	atari_bus_stop();
+	RD4_LOW;
+	RD5_LOW;
+	atari_bus_clock(0);
+	while (1) __wfi();
+}
 
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-		{	// s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & S5_GPIO_MASK) && rd5_high)
-		{	// s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x6000|addr]) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low 2 bits written to $D5xx
-			bankPtr = &cart_ram[0] + (8192*(data & 3));
-			if (switchable) {
-				if (data & 0x80) {
-					RD4_LOW; RD5_LOW;
-					rd4_high = rd5_high = false;
-				} else {
-					RD4_HIGH; RD5_HIGH;
-					rd4_high = rd5_high = true;
-				}
-			}
-		}
+// the bank state a CCTL access switches to, or NULL if it doesn't touch the banking.
+// on is the last state with the cartridge switched on, for BANK_RESUME
+static __force_inline const BANK_STATE *bank_switch(uint32_t cctl, uint8_t reg_mask, uint8_t reg_match,
+		uint32_t pins, uint8_t *key, const BANK_STATE **on) {
+	uint16_t addr = pins & ADDR_GPIO_MASK;
+	if (cctl & CCTL_DATA) {
+		if ((addr & reg_mask) != reg_match)
+			return NULL;
+		*key = (pins & DATA_GPIO_MASK) >> 13;
 	}
+	else
+		*key = addr & 0xFF;
+	const BANK_STATE *next = &bank_table[*key];
+	if (next->rd & BANK_KEEP)
+		return NULL;
+	if (next->rd & BANK_RESUME)
+		return *on;
+	if (next->rd)
+		*on = next;
+	return next;
 }
 
-void __not_in_flash_func(emulate_XEGS_64k)(char switchable) {
-	// 64k
-	RD4_HIGH;
-	RD5_HIGH;
-
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	unsigned char *bankPtr = &cart_ram[0];
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
-
+// generic banking engine, specialised by the CCTL decode at compile time so the
+// hot loop is left with a window lookup per read and a table lookup per bank switch.
+// with BUS_EARLY the CPU only answers the late reads
+#if BUS_EARLY
+#define bank_drive	atari_bus_drive_late
+#else
+#define bank_drive	atari_bus_drive
+#endif
+
+static __force_inline void bank_engine(uint32_t cctl, uint8_t reg_mask, uint8_t reg_match) {
+	const BANK_STATE *st = &bank_table[BANK_POWER_ON], *on = st;
+	const BANK_STATE *next;
+	unsigned char *const *win = st->win;
+	const unsigned char *p;
+	uint32_t pins, early = 0;
+	uint16_t addr;
+	uint8_t key = 0;
+
+	atari_bus_rd(RD4_GPIO_MASK|RD5_GPIO_MASK, st->rd);
+#if BUS_EARLY
+	atari_bus_start_early();
+#else
+	atari_bus_start();
+#endif
 	while (1)
 	{
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-		{	// s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & S5_GPIO_MASK) && rd5_high)
-		{	// s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0xE000|addr]) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
+#if BUS_EARLY
+		// look up both windows while phi2 is low, the PIO picks one when it rises
+		early = atari_bus_next_address();
+		p = win[early >> 12];
+		const unsigned char *p5 = win[2 | (early >> 12)];
+		atari_bus_prefetch(p ? ATARI_BUS_DATA(p[early & 0xFFF]) : 0, p5 ? ATARI_BUS_DATA(p5[early & 0xFFF]) : 0);
+		pins = atari_bus_next_early();
+#else
+		pins = atari_bus_next();
+#endif
+		addr = pins & ADDR_GPIO_MASK;
+
+		if (pins & RW_GPIO_MASK)
+		{	// atari is reading
+			if (!(pins & S4_GPIO_MASK))
+				p = win[addr >> 12];
+			else if (!(pins & S5_GPIO_MASK))
+				p = win[2 | (addr >> 12)];
+			else
+				p = NULL;
+			if (BUS_EARLY && !atari_bus_late(pins, early))
+				;	// answered by the PIO from the prefetch
+			else if (p)
+				bank_drive(p[addr & 0xFFF]);
+			else if ((cctl & CCTL_READBACK) && !(pins & CCTL_GPIO_MASK) && (addr & reg_mask) == reg_match)
+				bank_drive(key);	// read from $D5xx
+			else
+				atari_bus_float();
+			if (!(cctl & CCTL_ANY_ACCESS))
+				continue;
 		}
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low 3 bits written to $D5xx
-			bankPtr = &cart_ram[0] + (8192*(data & 7));
-			if (switchable) {
-				if (data & 0x80) {
-					RD4_LOW; RD5_LOW;
-					rd4_high = rd5_high = false;
-				} else {
-					RD4_HIGH; RD5_HIGH;
-					rd4_high = rd5_high = true;
+		if (!(pins & CCTL_GPIO_MASK))
+		{	// CCTL low
+			next = bank_switch(cctl, reg_mask, reg_match, pins, &key, &on);
+			if (!next)
+				continue;
+			if (!next->rd && !(cctl & CCTL_READBACK)) {
+				// switched off, there is nothing to answer until a CCTL access
+				// switches the cartridge back on, so sleep until one comes along
+				atari_bus_rd(RD4_GPIO_MASK|RD5_GPIO_MASK, 0);
+				if (!bank_resume)
+					cart_off();
+				atari_bus_sleep();
+				while (1) {
+					pins = atari_bus_next_cctl();
+					if ((pins & RW_GPIO_MASK) && !(cctl & CCTL_ANY_ACCESS))
+						continue;
+					next = bank_switch(cctl, reg_mask, reg_match, pins, &key, &on);
+					if (next && next->rd)
+						break;
 				}
+#if BUS_EARLY
+				atari_bus_start_early();
+#else
+				atari_bus_start();
+#endif
 			}
+			st = next;
+			win = st->win;
+			atari_bus_rd(RD4_GPIO_MASK|RD5_GPIO_MASK, st->rd);
 		}
 	}
 }
 
-void __not_in_flash_func(emulate_XEGS_128k)(char switchable) {
-	// 128k
-	RD4_HIGH;
-	RD5_HIGH;
+void __not_in_flash_func(emulate_banked_data)(uint8_t reg_mask, uint8_t reg_match) {
+	bank_engine(CCTL_DATA, reg_mask, reg_match);
+}
 
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	unsigned char *bankPtr = &cart_ram[0];
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
+void __not_in_flash_func(emulate_banked_readback)(uint8_t reg_mask, uint8_t reg_match) {
+	bank_engine(CCTL_DATA|CCTL_READBACK, reg_mask, reg_match);
+}
 
-	while (1)
-	{
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
+void __not_in_flash_func(emulate_banked_any)() {
+	bank_engine(CCTL_ANY_ACCESS, 0, 0);
+}
 
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-		{	// s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & S5_GPIO_MASK) && rd5_high)
-		{	// s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x1E000|addr]) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low 4 bits written to $D5xx
-			bankPtr = &cart_ram[0] + (8192*(data & 0xF));
-			if (switchable) {
-				if (data & 0x80) {
-					RD4_LOW; RD5_LOW;
-					rd4_high = rd5_high = false;
-				} else {
-					RD4_HIGH; RD5_HIGH;
-					rd4_high = rd5_high = true;
-				}
-			}
-		}
+void emulate_banked(const CART_DESC *desc) {
+#if BUS_EARLY
+	atari_bus_clock_early(ENGINE_CLOCKS_BANKED);	// the prefetch is about the same work
+#else
+	atari_bus_clock(ENGINE_CLOCKS_BANKED);
+#endif
+	// precompute the banking state for every CCTL key
+	for (int key = 0; key <= BANK_POWER_ON; key++) {
+		memset(&bank_table[key], 0, sizeof(BANK_STATE));
+		for (int i = 0; i < 4; i++)
+			bank_table[key].page[i] = BANK_CACHE_PAGE_NONE;
+		desc->decode(desc, key, &bank_table[key]);
 	}
+	bank_resume = false;
+	for (int key = 0; key < BANK_POWER_ON; key++)
+		if (bank_table[key].rd && !(bank_table[key].rd & BANK_KEEP))
+			bank_resume = true;
+	if (desc->size > sizeof(cart_ram)) {
+		// the image was left in flash by load_file(), cart_ram holds the cache, which
+		// has all of it (bank_cache_fits()), so the windows of every state point into
+		// it for good
+		bank_cache_start(cart_ram, sizeof(cart_ram), bank_table[BANK_POWER_ON].page, true);
+		for (int key = 0; key <= BANK_POWER_ON; key++)
+			bank_cache_map(bank_table[key].page, bank_table[key].win);
+	}
+	if (desc->cctl == (CCTL_DATA|CCTL_READBACK))
+		emulate_banked_readback(desc->reg_mask, desc->reg_match);
+	else if (desc->cctl == CCTL_DATA)
+		emulate_banked_data(desc->reg_mask, desc->reg_match);
+	else
+		emulate_banked_any();
 }
 
 void __not_in_flash_func(emulate_bounty_bob)() {
 	// 40k
+	atari_bus_clock(ENGINE_CLOCKS_BOUNTY_BOB);
 	RD4_HIGH;
 	RD5_HIGH;
 
     uint32_t pins;
     uint16_t addr;
 	unsigned char *bankPtr1 = &cart_ram[0], *bankPtr2 =  &cart_ram[0x4000];
+	atari_bus_start();
 	while (1)
 	{
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-		
+		pins = atari_bus_next();
+
         if (!(pins & S4_GPIO_MASK))
 		{	// s4 low
-			SET_DATA_MODE_OUT;
             addr = pins & ADDR_GPIO_MASK;
 			if (addr & 0x1000) {
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr2+(addr&0xFFF)))) << 13);
+				if (pins & RW_GPIO_MASK)
+					atari_bus_drive(*(bankPtr2+(addr&0xFFF)));
 				if (addr == 0x1FF6) bankPtr2 = &cart_ram[0x4000];
 				else if (addr == 0x1FF7) bankPtr2 = &cart_ram[0x5000];
 				else if (addr == 0x1FF8) bankPtr2 = &cart_ram[0x6000];
 				else if (addr == 0x1FF9) bankPtr2 = &cart_ram[0x7000];
 			}
 			else {
-				gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr1+(addr&0xFFF)))) << 13);
+				if (pins & RW_GPIO_MASK)
+					atari_bus_drive(*(bankPtr1+(addr&0xFFF)));
 				if (addr == 0x0FF6) bankPtr1 = &cart_ram[0];
 				else if (addr == 0x0FF7) bankPtr1 = &cart_ram[0x1000];
 				else if (addr == 0x0FF8) bankPtr1 = &cart_ram[0x2000];
 				else if (addr == 0x0FF9) bankPtr1 = &cart_ram[0x3000];
 			}
 		}
-		else if (!(pins & S5_GPIO_MASK))
-		{	// s5 low
-			SET_DATA_MODE_OUT;
-			addr = pins & ADDR_GPIO_MASK;
-			gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x8000|addr]) << 13);
-		}
-		// wait for phi2 low
-		while (gpio_get_all() & PHI2_GPIO_MASK) ;
-		SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_atarimax_128k)() {
-	// 128k
-	RD4_LOW;
-	RD5_HIGH;
-
-    uint32_t bank = 0;
-    unsigned char *ramPtr;
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // select the right SRAM base, based on the cartridge bank
-		ramPtr = &cart_ram[0] + (8192 * (bank & 0xF));
-
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-            if ((addr & 0xE0) == 0) {
-				bank = addr & 0xF;
-				if (addr & 0x10)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH; rd5_high = true; }
-            }
-        }
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_williams)() {
-	// williams 32k, 64k
-	RD4_LOW;
-	RD5_HIGH;
-
-    uint32_t bank = 0;
-    unsigned char *bankPtr;
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // select the right SRAM base, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (8192*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-            if ((addr & 0xF0) == 0) {
-				bank = addr & 0x07;
-				if (addr & 0x08)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH; rd5_high = true; }
-            }
-        }
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_OSS_B)() {
-	// OSS type B
-	RD5_HIGH;
-	RD4_LOW;
-    uint32_t pins;
-    uint16_t addr;
-	uint32_t bank = 1;
-	unsigned char *bankPtr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-		// select the right SRAM block, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (4096*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-			if (addr & 0x1000)
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr&0xFFF]) << 13);
-			else
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
-		}
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			int a0 = addr & 1, a3 = addr & 8;
-			if (a3 && !a0) { RD5_LOW; rd5_high = false; }
-			else {
-				RD5_HIGH;
-				rd5_high = true;
-				if (!a3 && !a0) bank = 1;
-				else if (!a3 && a0) bank = 3;
-				else if (a3 && a0) bank = 2;
+		else if (pins & RW_GPIO_MASK)
+		{
+			if (!(pins & S5_GPIO_MASK))
+			{	// s5 low
+				addr = pins & ADDR_GPIO_MASK;
+				atari_bus_drive(cart_ram[0x8000|addr]);
 			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_OSS_A)(char is034M) {
-	// OSS type A (034M, 043M)
-	RD5_HIGH;
-	RD4_LOW;
-    uint32_t pins;
-    uint16_t addr;
-	uint32_t bank = 0;
-	unsigned char *bankPtr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-		// select the right SRAM block, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (4096*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-			if (addr & 0x1000)
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr|0x2000]) << 13);	// 4k bank #3 always mapped to $Bxxx
 			else
-	            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr+addr))) << 13);
+				atari_bus_float();
 		}
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & 0xF;
-			if (addr & 0x8) { RD5_LOW; rd5_high = false; }
-			else {
-				RD5_HIGH; rd5_high = true;
-				if (addr == 0x0) bank = 0;
-				if (addr == 0x3 || addr == 0x7) bank = is034M ? 1 : 2;
-				if (addr == 0x4) bank = is034M ? 2 : 1;
-			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
 	}
 }
 
-void __not_in_flash_func(emulate_megacart)(int size) {
-	// 16k - 128k
-	RD4_HIGH;
-	RD5_HIGH;
+// the loader (see A8PicoCart.asm) sets the 256 byte page at $D500-$D5FF by writing its
+// number to $D500 (lo) and $D501 (hi), always both, and reads the file front to back.
+// Pages from XEX_TABLE_PAGE on hold the segment table instead (see parse_xex()).
+// From the bank cache, the page is looked up on the write to $D501, and the block after
+// the one being read is kept mapped so it is filled well before the loader needs it.
+// The loader then writes XEX_WAIT_PAGE's high byte to $D501 and reads $D500 until it
+// isn't 0, which is once the block of the page is filled (nothing is read from flash,
+// that is too slow to answer with), then writes the page's high byte again.
+static __force_inline void xex_engine(bool cached) {
+	atari_bus_clock(ENGINE_CLOCKS_XEX_LOADER);
+	RD4_LOW;
+	RD5_LOW;
 
-    uint32_t pins, last;
+    uint32_t pins;
     uint16_t addr;
     uint8_t data;
-	uint32_t bank_mask = 0x00;
-	if (size == 32) bank_mask = 0x1;
-	else if (size == 64) bank_mask = 0x3;
-	else if (size == 128) bank_mask = 0x7;
-
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
 
+	uint32_t bank = 0, block = 0;
 	unsigned char *ramPtr = &cart_ram[0];
-	while (1)
-	{
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-		{	// s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr+addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-        else if (!(pins & S5_GPIO_MASK) && rd5_high)
-		{	// s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr+(addr|0x2000)))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-		}
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low n bits written to $D5xx
-			int bank = data & bank_mask;
-			ramPtr = &cart_ram[0] + 16384 * (bank&0x7);
-			if (data & 0x80) {
-				RD4_LOW; RD5_LOW;
-				rd4_high = rd5_high = false;
-			} else {
-				RD4_HIGH; RD5_HIGH;
-				rd4_high = rd5_high = true;
-			}
-		}
+	unsigned char *cache_win[4];
+	uint16_t pages[4] = { 0, 1, 2, 3 };
+	uint cache_w = 0;	// of the page in cache_win
+	uint8_t ready = 1;	// what XEX_WAIT_PAGE reads as
+
+	if (cached) {
+		// nothing to preload, the loader starts at the beginning
+		bank_cache_start(cart_ram, sizeof(cart_ram), pages, false);
+		bank_cache_map(pages, cache_win);
+		ramPtr = cache_win[0];
 	}
-}
-
-void __not_in_flash_func(emulate_SIC)() {
-	// 128k
-	RD5_HIGH;
-	RD4_LOW;
-
-    uint32_t pins, last;
-    uint16_t addr;
-	uint8_t SIC_byte = 0;
-	unsigned char *ramPtr = &cart_ram[0];
-	bool rd4_high = false, rd5_high = true;	// 400/800 MMU
-
+	atari_bus_start();
 	while (1)
 	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
+		pins = atari_bus_next();
 
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-        {   // s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-        }
-        else if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
+        if (pins & RW_GPIO_MASK)
+        {   // atari is reading
             addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + (addr|0x2000)))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
+            if (pins & CCTL_GPIO_MASK)
+                atari_bus_float();
+            else if (ramPtr)
+                atari_bus_drive(ramPtr[addr&0xFF]);
+            else {
+                // XEX_WAIT_PAGE, or a page past the end of the file
+                atari_bus_drive(ready);
+                if (cached && !ready) {
+                    bank_cache_poll(cache_win);
+                    ready = bank_cache_ready(cache_w);
+#if BUS_TIMING
+                    bus_timing.cache_waits++;
+#endif
+                }
+            }
         }
         else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			if ((addr & 0xE0) == 0)
-			{
-				if (pins & RW_GPIO_MASK)
-				{   // read from $D5xx
-		            SET_DATA_MODE_OUT;
-					gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)SIC_byte) << 13);
-					// wait for phi2 low
-					while (gpio_get_all() & PHI2_GPIO_MASK) ;
-					SET_DATA_MODE_IN;
-				}
-				else
-				{	// write to $D5xx
-					last = pins;
-					// read data bus on falling edge of phi2
-					while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-						last = pins;
-					SIC_byte = (last & DATA_GPIO_MASK) >> 13;
-					// switch bank
-					ramPtr = &cart_ram[0] + 16384 * (SIC_byte&0x7);
-					if (SIC_byte & 0x40) { RD5_LOW; rd5_high = false; } else { RD5_HIGH; rd5_high = true; }
-					if (SIC_byte & 0x20) { RD4_HIGH; rd4_high = true; } else { RD4_LOW; rd4_high = false; }
+        {   // atari is writing
+            addr = pins & 0xFF;
+			data = (pins & DATA_GPIO_MASK) >> 13;
+			if (addr == 0)
+				bank = (bank&0xFF00) | data;
+			else if (addr == 1)
+				bank = (bank&0x00FF) | ((data<<8) & 0xFF00);
+			if (addr == 1 && (bank & XEX_TABLE_PAGE))
+				ramPtr = (unsigned char *)xex_table + 256 * (bank & (XEX_TABLE_PAGES - 1));
+			else if (addr == 1 && (bank & XEX_WAIT_PAGE))
+				ramPtr = NULL;
+			else if (!cached)
+				ramPtr = &cart_ram[0] + 256 * (bank & 0x01FF);
+			else if (addr == 1) {
+				if (bank >> 5 != block) {
+					// 32 pages to a block, map it and the next one
+					block = bank >> 5;
+					for (int i = 0; i < 4; i++)
+						pages[i] = block * 2 + i;
+					bank_cache_map(pages, cache_win);
 				}
+				cache_w = (bank >> 4) & 1;
+				ramPtr = cache_win[cache_w] ? cache_win[cache_w] + ((bank & 0xF) << 8) : NULL;
+				ready = ramPtr != NULL;	// or not until a poll of the wait page says so
 			}
 		}
 	}
 }
 
-void __not_in_flash_func(emulate_SDX)(int size) {
-	// 64k/128k
-	RD5_HIGH;
-	RD4_LOW;
-
-	unsigned char *ramPtr = &cart_ram[0];
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			if ((addr & 0xF0) == 0xE0) {
-				// 64k & 128k versions
-				if (size == 64) ramPtr = &cart_ram[0]; else ramPtr = &cart_ram[65536];
-				ramPtr += ((~addr) & 0x7) * 8192;
-				if (addr & 0x8)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH; rd5_high = true; }
-			}
-			if (size == 128 && (addr & 0xF0) == 0xF0) {
-				// 128k version only
-				ramPtr = &cart_ram[0] + ((~addr) & 0x7) * 8192;
-				if (addr & 0x8)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH; rd5_high = true; }
-			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_diamond_express)(uint8_t cctlAddr) {
-	// 64k
-	RD5_HIGH;
-	RD4_LOW;
-
-	unsigned char *ramPtr = &cart_ram[0];
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(ramPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			if ((addr & 0xF0) == cctlAddr) {
-				ramPtr = &cart_ram[0] + ((~addr) & 0x7) * 8192;
-				if (addr & 0x8)
-					{ RD5_LOW; rd5_high = false; }
-				else
-					{ RD5_HIGH;  rd5_high = true; }
-			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_blizzard)() {
-	//16k
-	RD4_HIGH;
-	RD5_HIGH;
-    uint32_t pins;
-    uint16_t addr;
-	bool rd4_high = true, rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S4_GPIO_MASK) && rd4_high)
-        {   // s4 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[addr]) << 13);
-		}
-        else if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)cart_ram[0x2000|addr]) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-			RD4_LOW; RD5_LOW;
-			rd4_high = rd5_high = false;
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_turbosoft)(int size) {
-	// 64k/128k
-	RD4_LOW;
-	RD5_HIGH;
-
-    uint32_t bank = 0;
-    unsigned char *bankPtr;
-    uint32_t pins;
-    uint16_t addr;
-	bool rd5_high = true;	// 400/800 MMU
-
-	uint32_t bank_mask = 0x00;
-	if (size == 64) bank_mask = 0x7;
-	else if (size == 128) bank_mask = 0xF;
-
-	while (1)
-	{
-        // select the right SRAM base, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (8192*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr + addr))) << 13);
-        }
-        else if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            addr = pins & ADDR_GPIO_MASK;
-			bank = addr & bank_mask;
-			if (addr & 0x10)
-				{ RD5_LOW; rd5_high = false; }
-			else
-				{ RD5_HIGH; rd5_high = true; }
-        }
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
-}
-
-void __not_in_flash_func(emulate_atrax)() {
-	// 128k
-	RD4_LOW;
-	RD5_HIGH;
-
-    uint32_t bank = 0;
-    unsigned char *bankPtr;
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	bool rd5_high = true;	// 400/800 MMU
-
-	while (1)
-	{
-        // select the right SRAM base, based on the cartridge bank
-		bankPtr = &cart_ram[0] + (8192*bank);
-		// wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & S5_GPIO_MASK) && rd5_high)
-        {   // s5 low
-            SET_DATA_MODE_OUT;
-            addr = pins & ADDR_GPIO_MASK;
-            gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(*(bankPtr + addr))) << 13);
-			// wait for phi2 low
-			while (gpio_get_all() & PHI2_GPIO_MASK) ;
-			SET_DATA_MODE_IN;
-        }
-		else if (!(pins & CCTL_RW_GPIO_MASK))
-		{	// CCTL low + write
-            last = pins;
-            // read data bus on falling edge of phi2
-            while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-            	last = pins;
-			data = (last & DATA_GPIO_MASK) >> 13;
-			// new bank is the low 4 bits written to $D5xx
-			bank = data & 0xF;
-			if (data & 0x80)
-				{ RD5_LOW; rd5_high = false; }
-			else
-				{ RD5_HIGH; rd5_high = true; }
-        }
-	}
-}
-
 void __not_in_flash_func(feed_XEX_loader)(void) {
-	RD4_LOW;
-	RD5_LOW;
+	xex_engine(false);
+}
 
-    uint32_t pins, last;
-    uint16_t addr;
-    uint8_t data;
-	
-	uint32_t bank = 0;
-	unsigned char *ramPtr = &cart_ram[0];
-	while (1)
-	{
-        // wait for phi2 high
-		while (!((pins = gpio_get_all()) & PHI2_GPIO_MASK)) ;
-
-        if (!(pins & CCTL_GPIO_MASK))
-        {   // CCTL low
-            if (pins & RW_GPIO_MASK)
-            {   // atari is reading
-                SET_DATA_MODE_OUT;
-                addr = pins & ADDR_GPIO_MASK;
-                gpio_put_masked(DATA_GPIO_MASK, ((uint32_t)(ramPtr[addr&0xFF])) << 13);
-            }
-			else
-            {   // atari is writing
-                addr = pins & 0xFF;
-                last = pins;
-                // read data bus on falling edge of phi2
-                while ((pins = gpio_get_all()) & PHI2_GPIO_MASK)
-                    last = pins;
-				data = (last & DATA_GPIO_MASK) >> 13;
-				if (addr == 0)
-					bank = (bank&0xFF00) | data;
-				else if (addr == 1)
-					bank = (bank&0x00FF) | ((data<<8) & 0xFF00);
-				ramPtr = &cart_ram[0] + 256 * (bank & 0x01FF);
-			}
-		}
-        // wait for phi2 low
-        while (gpio_get_all() & PHI2_GPIO_MASK) ;
-        SET_DATA_MODE_IN;
-	}
+void __not_in_flash_func(feed_XEX_cached)(void) {
+	xex_engine(true);
 }
 
 void emulate_cartridge(int cartType) {
+	const CART_DESC *desc = car_desc && car_desc->cart_type == cartType ? car_desc : find_cart_type(cartType);
+#if BUS_TRACE || BUS_TIMING
+	bus_trace_start(cartType);
+#endif
 	if (cartType == CART_TYPE_8K) emulate_standard_8k();
 	else if (cartType == CART_TYPE_16K) emulate_standard_16k();
-	else if (cartType == CART_TYPE_XEGS_32K) emulate_XEGS_32k(0);
-	else if (cartType == CART_TYPE_XEGS_64K) emulate_XEGS_64k(0);
-	else if (cartType == CART_TYPE_XEGS_128K) emulate_XEGS_128k(0);
-	else if (cartType == CART_TYPE_SW_XEGS_32K) emulate_XEGS_32k(1);
-	else if (cartType == CART_TYPE_SW_XEGS_64K) emulate_XEGS_64k(1);
-	else if (cartType == CART_TYPE_SW_XEGS_128K) emulate_XEGS_128k(1);
-	else if (cartType == CART_TYPE_BOUNTY_BOB) emulate_bounty_bob();
-	else if (cartType == CART_TYPE_ATARIMAX_1MBIT) emulate_atarimax_128k();
-	else if (cartType == CART_TYPE_WILLIAMS_64K) emulate_williams();
-	else if (cartType == CART_TYPE_OSS_16K_TYPE_B) emulate_OSS_B();
-	else if (cartType == CART_TYPE_OSS_8K) emulate_OSS_B();
-	else if (cartType == CART_TYPE_OSS_16K_034M) emulate_OSS_A(1);
-	else if (cartType == CART_TYPE_OSS_16K_043M) emulate_OSS_A(0);
-	else if (cartType == CART_TYPE_MEGACART_16K) emulate_megacart(16);
-	else if (cartType == CART_TYPE_MEGACART_32K) emulate_megacart(32);
-	else if (cartType == CART_TYPE_MEGACART_64K) emulate_megacart(64);
-	else if (cartType == CART_TYPE_MEGACART_128K) emulate_megacart(128);
-	else if (cartType == CART_TYPE_SIC_128K) emulate_SIC();
-	else if (cartType == CART_TYPE_SDX_64K) emulate_SDX(64);
-	else if (cartType == CART_TYPE_SDX_128K) emulate_SDX(128);
-	else if (cartType == CART_TYPE_DIAMOND_64K) emulate_diamond_express(0xD0);
-	else if (cartType == CART_TYPE_EXPRESS_64K) emulate_diamond_express(0x70);
-	else if (cartType == CART_TYPE_BLIZZARD_16K) emulate_blizzard();
 	else if (cartType == CART_TYPE_4K) emulate_standard_8k();	// patch in load_file()
-	else if (cartType == CART_TYPE_TURBOSOFT_64K) emulate_turbosoft(64);
-	else if (cartType == CART_TYPE_TURBOSOFT_128K) emulate_turbosoft(128);
-	else if (cartType == CART_TYPE_ATRAX_128K) emulate_atrax();
+	else if (cartType == CART_TYPE_BOUNTY_BOB) emulate_bounty_bob();
+	else if (cartType == CART_TYPE_XEX && xex_cached) feed_XEX_cached();
 	else if (cartType == CART_TYPE_XEX) feed_XEX_loader();
+	else if (desc && desc->decode) emulate_banked(desc);
 	else
-	{	// no cartridge (cartType = 0)
-		RD4_LOW;
-		RD5_LOW;
-		while (1) ;
-	}
+		cart_off();	// no cartridge (cartType = 0)
 }
 
 void __not_in_flash_func(atari_cart_main)()
 {
-    gpio_init_mask(ALL_GPIO_MASK);
-
-    gpio_set_dir_in_masked(ADDR_GPIO_MASK|DATA_GPIO_MASK|CCTL_GPIO_MASK|PHI2_GPIO_MASK|RW_GPIO_MASK|S4_GPIO_MASK|S5_GPIO_MASK);
-    gpio_set_dir(RD4_PIN, GPIO_OUT);
-    gpio_set_dir(RD5_PIN, GPIO_OUT);
+	// all access to the cartridge port goes through atari_bus.h,
+	// the data bus is driven by the PIO, see atari_bus.pio
+	atari_bus_init();
+#if BUS_TRACE || BUS_TIMING
+	bus_trace_start_menu();
+#endif
 
-	// overclocking isn't necessary for most functions - but XEGS carts weren't working without it
-	// I guess we might as well have it on all the time.
-	set_sys_clock_khz(250000, true);
+	// the clock is picked per engine, each one switches when it takes over the bus
+	atari_bus_clock(ENGINE_CLOCKS_BOOT_ROM);
 
 	int cartType = 0, atrMode = 0;
 	char curPath[256] = "";
 	char path[256];
 
+	boot_rom_start(atrMode);
     while (1) {
-        int cmd = emulate_boot_rom(atrMode);
+        int cmd = boot_rom_command();
 
-        // OPEN ITEM n
+        // OPEN ITEM n (word)
         if (cmd == CART_CMD_OPEN_ITEM) 
         {
-			int n = cart_d5xx[0x00];
-			DIR_ENTRY *entry = (DIR_ENTRY *)&cart_ram[0];
-			if (entry[n].isDir)
+			int n = cart_d5xx[0x00] | (cart_d5xx[0x01] << 8);
+			DIR_ENTRY *entry = get_dir_entry(n);
+			leave_directory(n);
+			if (!entry)
+			{
+				cart_d5xx[0x01] = 4;	// error
+				strcpy((char*)&cart_d5xx[0x02], "Can't read directory");
+			}
+			else if (entry->isDir)
 			{	// directory
 				strcat(curPath, "/");
-				strcat(curPath, entry[n].filename);
+				strcat(curPath, entry->filename);
 				cart_d5xx[0x01] = 0; // path changed
 			}
 			else
 			{	// file/search result
-				if (entry[n].full_path[0])
-					strcpy(path, entry[n].full_path);	// search result
+				if (entry->full_path[0])
+					strcpy(path, entry->full_path);	// search result
 				else
 					strcpy(path, curPath); // file in current directory
 				strcat(path, "/");
-				strcat(path, entry[n].filename);
-				if (strcasecmp(get_filename_ext(entry[n].filename), "ATR")==0)
+				strcat(path, entry->filename);
+				if (name_ext(entry->filename) == NAME_EXT('a','t','r'))
 				{	// ATR
 					cart_d5xx[0x01] = 3;	// ATR
 					cartType = CART_TYPE_ATR;
@@ -1472,8 +2119,17 @@ void __not_in_flash_func(atari_cart_main)()
 				else
 				{	// ROM,CAR or XEX
 					cartType = load_file(path);
-					if (cartType)
-						cart_d5xx[0x01] = (cartType != CART_TYPE_XEX ? 1 : 2);	// file was loaded
+					chunk_valid = false;	// cart_ram has been loaded over
+					if (cartType == CART_TYPE_XEX) {
+						cart_d5xx[0x01] = 2;	// XEX was checked
+						cart_d5xx[0x02] = xex_segments & 0xFF;
+						cart_d5xx[0x03] = xex_segments >> 8;
+						cart_d5xx[0x04] = xex_bytes & 0xFF;
+						cart_d5xx[0x05] = (xex_bytes >> 8) & 0xFF;
+						cart_d5xx[0x06] = xex_bytes >> 16;
+					}
+					else if (cartType)
+						cart_d5xx[0x01] = 1;	// file was loaded
 					else
 					{
 						cart_d5xx[0x01] = 4;	// error
@@ -1488,7 +2144,14 @@ void __not_in_flash_func(atari_cart_main)()
  			int ret = read_directory(curPath);
 			if (ret) {
 				cart_d5xx[0x01] = 0;	// ok
-				cart_d5xx[0x02] = num_dir_entries;
+				cart_d5xx[0x02] = num_dir_entries & 0xFF;
+				cart_d5xx[0x03] = num_dir_entries >> 8;
+				// the page with the cursor on it, the menu pages from 0
+				int top = dir_cursor - dir_cursor % DIR_PAGE_ROWS;
+				cart_d5xx[0x04] = top & 0xFF;
+				cart_d5xx[0x05] = top >> 8;
+				cart_d5xx[0x06] = dir_cursor & 0xFF;
+				cart_d5xx[0x07] = dir_cursor >> 8;
 			}
 			else
 			{
@@ -1496,17 +2159,24 @@ void __not_in_flash_func(atari_cart_main)()
 				strcpy((char*)&cart_d5xx[0x02], errorBuf);
 			}           
         }
-		// GET DIR ENTRY n
+		// GET DIR ENTRY n (word)
 		else if (cmd == CART_CMD_GET_DIR_ENTRY)
 		{
-			int n = cart_d5xx[0x00];
-			DIR_ENTRY *entry = (DIR_ENTRY *)&cart_ram[0];
-			cart_d5xx[0x01] = entry[n].isDir;
-			strcpy((char*)&cart_d5xx[0x02], entry[n].long_filename);
+			DIR_ENTRY *entry = get_dir_entry(cart_d5xx[0x00] | (cart_d5xx[0x01] << 8));
+			cart_d5xx[0x01] = entry ? entry->isDir : 0;
+			strcpy((char*)&cart_d5xx[0x02], entry ? entry->long_filename : "");
+		}
+		// RENDER DIR PAGE from entry n (word), cursor on entry m (word), page kind
+		else if (cmd == CART_CMD_RENDER_DIR)
+		{
+			render_dir_page(cart_d5xx[0x00] | (cart_d5xx[0x01] << 8),
+				cart_d5xx[0x02] | (cart_d5xx[0x03] << 8), cart_d5xx[0x04]);
+			boot_win[2] = &cart_ram[DIR_PAGE_OFFSET];
 		}
 		// UP A DIRECTORY LEVEL
 		else if (cmd == CART_CMD_UP_DIR)
 		{
+			leave_directory(cart_d5xx[0x00] | (cart_d5xx[0x01] << 8));
 			int len = strlen(curPath);
 			while (len && curPath[--len] != '/');
 			curPath[len] = 0;
@@ -1515,25 +2185,38 @@ void __not_in_flash_func(atari_cart_main)()
 		else if (cmd == CART_CMD_ROOT_DIR)
 			curPath[0] = 0;
 		// SEARCH str
-		else if (cmd == CART_CMD_SEARCH)
+		else if (cmd == CART_CMD_SEARCH || cmd == CART_CMD_SEARCH_PREVIEW)
 		{
 			char searchStr[32];
+			int shown = MENU_SHOW_LISTING;
 			strcpy(searchStr, (char*)&cart_d5xx[0x00]);
-			int	ret = search_directory(curPath, searchStr);
-			if (ret) {
+			if (cmd == CART_CMD_SEARCH_PREVIEW && (!searchStr[0] || !dir_index_searchable())) {
+				// walked a slice at a time, the menu calls again while $D502 is 1
+				cart_d5xx[0x01] = 2;
+				cart_d5xx[0x02] = searchStr[0] && search_preview(curPath, searchStr);
+				shown = searchStr[0] ? MENU_SHOW_PREVIEW : MENU_SHOW_NONE;
+			}
+			else if (search_directory(curPath, searchStr)) {
 				cart_d5xx[0x01] = 0;	// ok
-				cart_d5xx[0x02] = num_dir_entries;
+				cart_d5xx[0x02] = num_dir_entries & 0xFF;
+				cart_d5xx[0x03] = num_dir_entries >> 8;
+				memset(&cart_d5xx[0x04], 0, 4);	// from the top, as READ DIR would
 			}
 			else
 			{
 				cart_d5xx[0x01] = 1;	// error
 				strcpy((char*)&cart_d5xx[0x02], errorBuf);
 			}
+			if (cmd == CART_CMD_SEARCH_PREVIEW) {
+				render_search_page(searchStr, cart_d5xx[0x01] == 1 ? MENU_SHOW_NONE : shown);
+				boot_win[2] = &cart_ram[DIR_PAGE_OFFSET];
+			}
 		}
 		// LOAD PATCHED ATARI OS
 		else if (cmd == CART_CMD_LOAD_SOFT_OS)
 		{
 			int ret = load_file("UNO_OS.ROM");
+			chunk_valid = false;
 			if (!ret) {
 				for (int i=0; i<16384; i++)
 					cart_ram[i] = os_rom[i];
@@ -1569,7 +2252,7 @@ void __not_in_flash_func(atari_cart_main)()
 		else if (cmd == CART_CMD_ATR_HEADER)
 		{
 			//uint8_t device = cart_d5xx[0x00];
-			if (!&mountedATRs[0].path[0])
+			if (mountedATRs[0].path[0] == 0)
 				cart_d5xx[0x01] = 1;
 			else
 			{
@@ -1579,7 +2262,9 @@ void __not_in_flash_func(atari_cart_main)()
 		}
 		// RESET FLASH FS (when boot with joystick 0 fire pressed)
 		else if (cmd == CART_CMD_RESET_FLASH)
+		{
 			create_fatfs_disk();
+		}
 		// NO CART
 		else if (cmd == CART_CMD_NO_CART)
 			cartType = 0;
@@ -1592,9 +2277,13 @@ void __not_in_flash_func(atari_cart_main)()
 				if (ret == 0)
 					memcpy(&cart_d5xx[0x02], &mountedATRs[0].atrHeader, 16);
 				cart_d5xx[0x01] = ret;
+				RD5_LOW;	// just the $D5xx mailbox from now on
 			}
-			else
+			else {
+				boot_rom_stop();
 				emulate_cartridge(cartType);
+			}
 		}
+		boot_rom_done();
     }
 }
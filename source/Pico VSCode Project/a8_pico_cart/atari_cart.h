@@ -17,6 +17,9 @@
 
 #define ATARI_PHI2_PIN        22    // used on boot to check if we are plugged into an atari or usb
 
+extern unsigned char cart_ram[128*1024];
+
 void atari_cart_main();
+int is_valid_file(char *filename);
 
 #endif
\ No newline at end of file
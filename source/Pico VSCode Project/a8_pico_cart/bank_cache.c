@@ -0,0 +1,365 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * SRAM bank cache for .CAR and .XEX images too big for cart_ram (see bank_cache.h)
+ */
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+
+#include "flash_fs.h"
+#include "bank_cache.h"
+#include "bus_trace.h"
+
+#define CAR_HEADER_SIZE     16
+#define XEX_HEADER_SIZE     4
+#define FAT_SECTOR_SIZE     512
+// the image starts part way into the first sector, so every block spans 17 sectors
+#define FILL_SECTORS        (BANK_CACHE_BLOCK / FAT_SECTOR_SIZE + 1)
+#define SLOT_SIZE           (FILL_SECTORS * FAT_SECTOR_SIZE)
+#define MAX_SLOTS           16
+#define MAX_BLOCKS          (BANK_CACHE_MAX_IMAGE / BANK_CACHE_BLOCK)
+#define MAX_FRAGMENTS       64
+#define NO_SLOT             0xFF
+
+// XIP address of every sector of the file, in the alias that doesn't allocate
+// in the XIP cache
+static uint32_t file_sectors[MAX_BLOCKS * (FILL_SECTORS - 1) + 1];
+static uint num_blocks;
+static uint32_t image_offset;   // of the image in the first sector of file_sectors
+
+// stands in for the sector in front of an .XEX file, ending with the length the
+// loader reads first
+static uint32_t xex_header[FAT_SECTOR_SIZE / 4];
+
+// the first block of the image with the same bytes as each block, they share a
+// slot (a .CAR is often padded out to its size with copies of a bank or $FF)
+static uint16_t block_same[MAX_BLOCKS];
+static uint num_distinct;
+
+static unsigned char *slot_mem;
+static uint num_slots;
+static uint8_t block_slot[MAX_BLOCKS];
+static uint8_t slot_block[MAX_SLOTS];
+static uint32_t slot_used[MAX_SLOTS];   // for least recently used
+static uint32_t use_count;
+static uint32_t slot_ready;             // bit per slot, holds its block
+
+// slot and offset into it of each window bank_cache_map() set up
+static uint8_t win_slot[4];
+static uint16_t win_offset[4];
+
+// read addresses of the fill in progress, the 0 at the end is a null trigger
+// that stops the chain
+static uint32_t fill_list[FILL_SECTORS + 1];
+static uint32_t fill_end;
+static uint ctrl_chan, data_chan;
+static uint fill_now;                   // slot the DMA is filling, NO_SLOT if none
+static uint32_t fill_pending;           // bit per slot waiting for the DMA
+
+// find where the sectors of an open file live in flash, from file_sectors[n] on
+// for the size bytes of the image that start offset bytes into file_sectors[0].
+// Returns 0 if it can't be served from the cache.
+static int map_file(FIL *fil, uint32_t n, uint32_t offset, uint32_t size)
+{
+    FATFS *fs = fil->obj.fs;
+    DWORD clmt[2 * MAX_FRAGMENTS + 2];
+    uint32_t sectors = (offset + size + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+
+    if (size > BANK_CACHE_MAX_IMAGE)
+        return 0;
+    // cluster link map of the file: (length, first cluster) of each fragment
+    clmt[0] = sizeof(clmt) / sizeof(clmt[0]);
+    fil->cltbl = clmt;
+    FRESULT res = f_lseek(fil, CREATE_LINKMAP);
+    fil->cltbl = NULL;
+    if (res != FR_OK)
+        return 0;
+    for (DWORD *frag = &clmt[1]; frag[0] && n < sectors; frag += 2) {
+        LBA_t sect = fs->database + (LBA_t)fs->csize * (frag[1] - 2);
+        for (uint32_t i = 0; i < frag[0] * fs->csize && n < sectors; i++) {
+            uint32_t flash_offset = flash_fs_FAT_sector_offset(sect + i);
+            if (!flash_offset)
+                return 0;
+            file_sectors[n++] = XIP_NOALLOC_BASE + flash_offset;
+        }
+    }
+    if (n != sectors)
+        return 0;
+    image_offset = offset;
+    num_blocks = (size + BANK_CACHE_BLOCK - 1) / BANK_CACHE_BLOCK;
+    // a short last block is filled from whatever follows, which is never read
+    while (n < num_blocks * (FILL_SECTORS - 1) + 1)
+        file_sectors[n++] = (uint32_t)xex_header;
+    for (uint block = 0; block < num_blocks; block++)
+        block_same[block] = block;
+    num_distinct = num_blocks;
+    return 1;
+}
+
+// the part of sector i (0-16) of a block that holds the image, as start and length
+static __force_inline void block_sector(uint i, uint32_t *start, uint32_t *len)
+{
+    *start = i ? 0 : image_offset;
+    *len = i == FILL_SECTORS - 1 ? image_offset : FAT_SECTOR_SIZE - *start;
+}
+
+static uint32_t block_hash(uint block)
+{
+    uint32_t hash = 2166136261u, start, len;
+    for (uint i = 0; i < FILL_SECTORS; i++) {
+        const uint8_t *p = (const uint8_t *)file_sectors[block * (FILL_SECTORS - 1) + i];
+        block_sector(i, &start, &len);
+        for (uint32_t j = start; j < start + len; j++)
+            hash = (hash ^ p[j]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool block_equal(uint a, uint b)
+{
+    uint32_t start, len;
+    for (uint i = 0; i < FILL_SECTORS; i++) {
+        block_sector(i, &start, &len);
+        if (memcmp((const uint8_t *)file_sectors[a * (FILL_SECTORS - 1) + i] + start,
+                (const uint8_t *)file_sectors[b * (FILL_SECTORS - 1) + i] + start, len))
+            return false;
+    }
+    return true;
+}
+
+// point every block at the first one with the same bytes
+static void find_same_blocks()
+{
+    static uint32_t hash[MAX_BLOCKS];
+    num_distinct = 0;
+    for (uint block = 0; block < num_blocks; block++) {
+        hash[block] = block_hash(block);
+        for (uint b = 0; b < block && block_same[block] == block; b++)
+            if (block_same[b] == b && hash[b] == hash[block] && block_equal(b, block))
+                block_same[block] = b;
+        if (block_same[block] == block)
+            num_distinct++;
+    }
+}
+
+// an open .CAR file, with size bytes of image after the header
+int bank_cache_open(FIL *fil, uint32_t size)
+{
+    if (size % BANK_CACHE_BLOCK || !map_file(fil, 0, CAR_HEADER_SIZE, size))
+        return 0;
+    find_same_blocks();
+    return 1;
+}
+
+// true if the image open has no more different blocks than mem_size holds slots, so
+// bank_cache_start() with preload leaves all of it resident
+bool bank_cache_fits(uint32_t mem_size)
+{
+    uint slots = mem_size / SLOT_SIZE;
+    return num_distinct <= (slots < MAX_SLOTS ? slots : MAX_SLOTS);
+}
+
+// an open .XEX file, the image is the file behind its length (4 bytes, little
+// endian) as feed_XEX_loader() serves it
+int bank_cache_open_xex(FIL *fil)
+{
+    uint32_t size = f_size(fil);
+
+    memset(xex_header, 0, sizeof(xex_header));
+    xex_header[FAT_SECTOR_SIZE / 4 - 1] = size;
+    file_sectors[0] = (uint32_t)xex_header;
+    return map_file(fil, 1, FAT_SECTOR_SIZE - XEX_HEADER_SIZE, XEX_HEADER_SIZE + size);
+}
+
+static __force_inline bool fill_busy() {
+    return dma_hw->ch[data_chan].write_addr != fill_end;
+}
+
+// copy the block of the image a slot holds into it, the CPU carries on while the
+// DMA works through the sectors
+static void __not_in_flash_func(start_fill)(uint slot)
+{
+    memcpy(fill_list, &file_sectors[slot_block[slot] * (FILL_SECTORS - 1)], FILL_SECTORS * sizeof(uint32_t));
+    unsigned char *dst = slot_mem + slot * SLOT_SIZE;
+    fill_end = (uint32_t)dst + SLOT_SIZE;
+    fill_now = slot;
+    dma_channel_set_write_addr(data_chan, dst, false);
+    dma_channel_set_read_addr(ctrl_chan, fill_list, true);
+}
+
+// hand a slot over to block and queue its fill. If the DMA is still filling the
+// slot with the block it held, that fill no longer makes it ready.
+static void __not_in_flash_func(queue_fill)(uint slot, uint block)
+{
+    if (slot_block[slot] != NO_SLOT)
+        block_slot[slot_block[slot]] = NO_SLOT;
+    slot_block[slot] = block;
+    block_slot[block] = slot;
+    slot_ready &= ~(1u << slot);
+    fill_pending |= 1u << slot;
+}
+
+// retire the fill the DMA has finished and start the next one, those of the
+// windows first, never waits
+static void __not_in_flash_func(fill_poll)()
+{
+    if (fill_now != NO_SLOT) {
+        if (fill_busy())
+            return;
+        if (!(fill_pending & (1u << fill_now)))
+            slot_ready |= 1u << fill_now;
+        fill_now = NO_SLOT;
+    }
+    if (fill_pending) {
+        uint slot = NO_SLOT;
+        for (int i = 0; i < 4 && slot == NO_SLOT; i++)
+            if (win_slot[i] != NO_SLOT && (fill_pending & (1u << win_slot[i])))
+                slot = win_slot[i];
+        for (uint s = 0; slot == NO_SLOT; s++)
+            if (fill_pending & (1u << s))
+                slot = s;
+        fill_pending &= ~(1u << slot);
+        start_fill(slot);
+    }
+}
+
+static uint __not_in_flash_func(lru_slot)(uint32_t pinned)
+{
+    uint lru = 0;
+    uint32_t oldest = 0xFFFFFFFF;
+    for (uint slot = 0; slot < num_slots; slot++) {
+        if (!(pinned & (1u << slot)) && slot_used[slot] <= oldest) {
+            lru = slot;
+            oldest = slot_used[slot];
+        }
+    }
+    return lru;
+}
+
+// point the four 4k windows at the cached pages of the image (BANK_CACHE_PAGE_NONE,
+// or past the end, for NULL), queueing fills for the blocks that aren't resident.
+// The windows of slots that aren't filled yet are left NULL, see bank_cache_ready().
+void __not_in_flash_func(bank_cache_map)(const uint16_t *pages, unsigned char **win)
+{
+    uint32_t pinned = 0;
+    for (int i = 0; i < 4; i++) {
+        if (pages[i] == BANK_CACHE_PAGE_NONE || pages[i] >> 1 >= num_blocks) {
+            win[i] = NULL;
+            win_slot[i] = NO_SLOT;
+            continue;
+        }
+        uint block = block_same[pages[i] >> 1];
+        uint slot = block_slot[block];
+        if (slot == NO_SLOT) {
+            slot = lru_slot(pinned);
+            queue_fill(slot, block);
+#if BUS_TIMING
+            bus_timing.cache_misses++;
+#endif
+        }
+        slot_used[slot] = ++use_count;
+        pinned |= 1u << slot;
+        win_slot[i] = slot;
+        win_offset[i] = image_offset + ((pages[i] & 1) << 12);
+        win[i] = slot_ready & (1u << slot) ? slot_mem + slot * SLOT_SIZE + win_offset[i] : NULL;
+    }
+    fill_poll();
+}
+
+// false while window i waits for its slot to be filled, true once it can be read
+// (or if it isn't mapped, which reads as NULL for good)
+bool __not_in_flash_func(bank_cache_ready)(uint i)
+{
+    uint slot = win_slot[i];
+    return slot == NO_SLOT || (slot_ready & (1u << slot));
+}
+
+// move the fills on and point the windows whose slots are filled by now at them
+void __not_in_flash_func(bank_cache_poll)(unsigned char **win)
+{
+    fill_poll();
+    for (int i = 0; i < 4; i++) {
+        uint slot = win_slot[i];
+        if (!win[i] && slot != NO_SLOT && (slot_ready & (1u << slot)))
+            win[i] = slot_mem + slot * SLOT_SIZE + win_offset[i];
+    }
+}
+
+// the fills queued so far, outside the engines
+static void fill_wait()
+{
+    while (fill_now != NO_SLOT || fill_pending)
+        fill_poll();
+}
+
+// set up the slots in mem and load the power on pages, then if preload, load as
+// many other blocks as there are free slots (all of them if bank_cache_fits())
+void bank_cache_start(unsigned char *mem, uint32_t mem_size, const uint16_t *pages, bool preload)
+{
+    unsigned char *win[4];
+
+    slot_mem = mem;
+    num_slots = mem_size / SLOT_SIZE;
+    if (num_slots > MAX_SLOTS)
+        num_slots = MAX_SLOTS;
+    memset(block_slot, NO_SLOT, sizeof(block_slot));
+    memset(slot_block, NO_SLOT, sizeof(slot_block));
+    memset(slot_used, 0, sizeof(slot_used));
+    use_count = 0;
+    slot_ready = 0;
+    fill_now = NO_SLOT;
+    fill_pending = 0;
+    fill_list[FILL_SECTORS] = 0;
+
+    // the data channel copies a sector and hands over to the control channel,
+    // which loads the next read address from fill_list and so retriggers it
+    ctrl_chan = dma_claim_unused_channel(true);
+    data_chan = dma_claim_unused_channel(true);
+
+    dma_channel_config c = dma_channel_get_default_config(data_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_chain_to(&c, ctrl_chan);
+    dma_channel_configure(data_chan, &c, mem, NULL, FAT_SECTOR_SIZE / 4, false);
+
+    c = dma_channel_get_default_config(ctrl_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    dma_channel_configure(ctrl_chan, &c, &dma_hw->ch[data_chan].al3_read_addr_trig, fill_list, 1, false);
+    fill_end = (uint32_t)mem;
+
+    bank_cache_map(pages, win);
+    fill_wait();
+#if BUS_TIMING
+    uint32_t start = time_us_32();
+#endif
+    uint n = 0;
+    for (uint block = 0, slot = 0; preload && block < num_blocks; block++) {
+        if (block_slot[block] != NO_SLOT || block_same[block] != block)
+            continue;
+        while (slot < num_slots && slot_block[slot] != NO_SLOT)
+            slot++;
+        if (slot == num_slots)
+            break;
+        queue_fill(slot, block);
+        n++;
+    }
+    fill_wait();
+#if BUS_TIMING
+    if (n)
+        bus_timing.cache_fill_us = (time_us_32() - start) / n;
+#endif
+}
@@ -0,0 +1,55 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * SRAM bank cache for .CAR and .XEX images too big for cart_ram
+ *
+ * The image stays in the flash drive and is served from 8k slots in SRAM,
+ * which are filled by DMA straight from XIP. A fill takes about 8k / (flash
+ * read rate), a few hundred bus cycles (see BUSTIME.TXT in a BUS_TIMING=1
+ * build), and a byte read from flash takes longer than the engines have to
+ * answer a read, so nothing is ever read from flash while the Atari waits.
+ * The cartridge slot has no RDY line to hold the 6502 with either, so a bank
+ * has to be in its slot before the Atari can get to it:
+ *
+ * A .CAR is served only if bank_cache_fits(): its blocks, counting those with
+ * the same bytes once, fit in the slots. bank_cache_start() then preloads all
+ * of it and every window points into SRAM from the start, so a cart can jump
+ * into a bank straight after switching to it. Anything bigger stays too big.
+ *
+ * An .XEX is read front to back by the loader, which waits for each page it
+ * sets until the cart says its block is filled (see xex_engine()), while the
+ * block after the one being read is kept mapped so the wait is rarely more
+ * than a poll. bank_cache_map() doesn't wait for a fill: it leaves the windows
+ * of a slot that isn't filled yet NULL, bank_cache_ready() is false for them
+ * until the DMA is done, and bank_cache_poll() moves the fills on and points
+ * the windows at their slots. Only one fill is on the DMA at a time, the
+ * others queue behind it, and the least recently mapped slot is reused.
+ */
+
+#ifndef __BANK_CACHE_H__
+#define __BANK_CACHE_H__
+
+#include "pico/stdlib.h"
+#include "ff.h"
+
+#define BANK_CACHE_BLOCK        8192            // cache line, 8k of the image
+#define BANK_CACHE_MAX_IMAGE    (1024*1024)
+#define BANK_CACHE_PAGE_NONE    0xFFFF          // window not mapped
+
+int bank_cache_open(FIL *fil, uint32_t size);
+int bank_cache_open_xex(FIL *fil);
+bool bank_cache_fits(uint32_t mem_size);
+void bank_cache_start(unsigned char *mem, uint32_t mem_size, const uint16_t *pages, bool preload);
+void bank_cache_map(const uint16_t *pages, unsigned char **win);
+bool bank_cache_ready(uint i);
+void bank_cache_poll(unsigned char **win);
+
+#endif
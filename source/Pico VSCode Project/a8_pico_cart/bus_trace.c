@@ -0,0 +1,182 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Cartridge bus trace capture (build with BUS_TRACE=1)
+ */
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/clocks.h"
+#include "hardware/watchdog.h"
+
+#include "ff.h"
+#include "fatfs_disk.h"
+#include "atari_cart.h"
+#include "atari_bus.h"
+
+#if BUS_TRACE || BUS_TIMING
+
+#if BUS_TRACE
+BUS_TRACE_BUFFER __uninitialized_ram(bus_trace);
+#endif
+#if BUS_TIMING
+BUS_TIMING_STATS __uninitialized_ram(bus_timing);
+#endif
+
+// waits for the next phi2 edge, reboots into USB mode if none comes within 100ms
+// (the Atari was switched off)
+void bus_trace_watch()
+{
+    uint32_t start = time_us_32();
+    bool phi2 = gpio_get(ATARI_PHI2_PIN);
+    while (gpio_get(ATARI_PHI2_PIN) == phi2) {
+        if (time_us_32() - start > 100000)
+            watchdog_reboot(0, 0, 0);
+    }
+}
+
+// runs on core1 while a cartridge is traced
+static void bus_trace_monitor()
+{
+    while (1)
+        bus_trace_watch();
+}
+
+static void bus_trace_reset(int cart_type)
+{
+#if BUS_TRACE
+    bus_trace.header.magic = 0;
+    bus_trace.header.cart_type = cart_type;
+    bus_trace.head = 0;
+    bus_trace.header.magic = BUS_TRACE_MAGIC;
+#endif
+#if BUS_TIMING
+    memset(&bus_timing, 0, sizeof(bus_timing));
+    bus_timing.cart_type = cart_type;
+    bus_timing.sys_khz = clock_get_hz(clk_sys) / 1000;   // updated by atari_bus_clock()
+    bus_timing.region = BUS_TIMING_NONE;
+    bus_timing.magic = BUS_TIMING_MAGIC;
+#endif
+}
+
+// a cartridge on core0, with the monitor on core1
+void bus_trace_start(int cart_type)
+{
+    bus_trace_reset(cart_type);
+#if BUS_TIMING
+    bus_timing_systick();
+#endif
+    multicore_launch_core1(bus_trace_monitor);
+}
+
+// the menu, which is on the bus from core1 (emulate_boot_rom() sets up its own
+// SysTick) while core0 calls bus_trace_watch() between commands
+void bus_trace_start_menu()
+{
+    bus_trace_reset(0);
+}
+
+#if BUS_TRACE
+static void export_trace()
+{
+    if (bus_trace.header.magic != BUS_TRACE_MAGIC)
+        return;
+    bus_trace.header.magic = 0;
+
+    FIL fil;
+    UINT bw;
+    uint32_t head = bus_trace.head, first = 0;
+    if (head > BUS_TRACE_ENTRIES)
+        first = head - BUS_TRACE_ENTRIES;
+    bus_trace.header.count = head - first;
+
+    if (f_open(&fil, "BUSTRACE.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK) {
+        BUS_TRACE_HEADER hdr = bus_trace.header;
+        hdr.magic = BUS_TRACE_MAGIC;
+        f_write(&fil, &hdr, sizeof(hdr), &bw);
+        // oldest entry first, in (up to) two pieces
+        uint32_t start = first & (BUS_TRACE_ENTRIES - 1);
+        uint32_t n = bus_trace.header.count;
+        uint32_t n1 = (start + n > BUS_TRACE_ENTRIES) ? BUS_TRACE_ENTRIES - start : n;
+        f_write(&fil, &bus_trace.entry[start], n1 * sizeof(BUS_TRACE_ENTRY), &bw);
+        f_write(&fil, &bus_trace.entry[0], (n - n1) * sizeof(BUS_TRACE_ENTRY), &bw);
+        f_close(&fil);
+    }
+}
+#endif
+
+#if BUS_TIMING
+static void export_timing()
+{
+    static const char *region_name[BUS_TIMING_REGIONS] = { "S4", "S5", "CCTL read", "CCTL write" };
+
+    if (bus_timing.magic != BUS_TIMING_MAGIC)
+        return;
+    bus_timing.magic = 0;
+
+    FIL fil;
+    if (f_open(&fil, "BUSTIME.TXT", FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+        return;
+    f_printf(&fil, "cart type %u at %u kHz\r\n", bus_timing.cart_type, bus_timing.sys_khz);
+    f_printf(&fil, "missed cycles (RX FIFO full): %u\r\n", bus_timing.missed);
+    f_printf(&fil, "dropped answers (after phi2 fell): %u\r\n", bus_timing.dropped);
+    if (bus_timing.cache_fill_us)
+        f_printf(&fil, "bank cache: %u misses, %u us (~%u bus cycles) per fill\r\n", bus_timing.cache_misses,
+            bus_timing.cache_fill_us, bus_timing.cache_fill_us * 179 / 100);
+    if (bus_timing.cache_waits)
+        f_printf(&fil, "bank cache: the XEX loader polled %u times for a fill\r\n", bus_timing.cache_waits);
+    if (bus_timing.answer_ns)
+        f_printf(&fil, "ENGINE_CLOCKS %u: answered in %u ns, budget %u ns%s\r\n", bus_timing.engine_clocks,
+            bus_timing.answer_ns, bus_timing.budget_ns, bus_timing.answer_ns > bus_timing.budget_ns ? " - MISSED" : "");
+    // the top of the highest bucket any read got to
+    int worst = -1;
+    for (int r = BUS_TIMING_S4; r <= BUS_TIMING_CCTL_RD; r++)
+        for (int b = worst + 1; b < BUS_TIMING_BUCKETS; b++)
+            if (bus_timing.hist[r][b])
+                worst = b;
+    if (worst == BUS_TIMING_BUCKETS - 1)
+        f_printf(&fil, "engine clocks measured: over %u\r\n", worst << BUS_TIMING_SHIFT);
+    else if (worst >= 0)
+        f_printf(&fil, "engine clocks measured: up to %u%s\r\n", ((worst + 1) << BUS_TIMING_SHIFT) - 1,
+            ((worst + 1) << BUS_TIMING_SHIFT) - 1 > bus_timing.engine_clocks ? ", over ENGINE_CLOCKS" : "");
+    f_printf(&fil, "phi2 rising to data driven = clocks below + %u\r\n", ATARI_BUS_READ_CLOCKS);
+    for (int r = 0; r < BUS_TIMING_REGIONS; r++) {
+        f_printf(&fil, "\r\n%s, late %u\r\n", region_name[r], bus_timing.late[r]);
+        for (int b = 0; b < BUS_TIMING_BUCKETS; b++) {
+            if (!bus_timing.hist[r][b])
+                continue;
+            if (b == BUS_TIMING_BUCKETS - 1)
+                f_printf(&fil, "  %3u+    clocks: %u\r\n", b << BUS_TIMING_SHIFT, bus_timing.hist[r][b]);
+            else
+                f_printf(&fil, "  %3u-%3u clocks: %u\r\n", b << BUS_TIMING_SHIFT,
+                    ((b + 1) << BUS_TIMING_SHIFT) - 1, bus_timing.hist[r][b]);
+        }
+    }
+    f_close(&fil);
+}
+#endif
+
+// write what the last cartridge session left behind to the flash drive
+void bus_trace_export()
+{
+    if (!mount_fatfs_volume())
+        return;
+#if BUS_TRACE
+    export_trace();
+#endif
+#if BUS_TIMING
+    export_timing();
+#endif
+}
+
+#endif
@@ -0,0 +1,160 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Cartridge bus trace capture (build with BUS_TRACE=1)
+ * and timing histograms (build with BUS_TIMING=1)
+ *
+ * Every cycle the cartridge takes part in (S4, S5 or CCTL low) is recorded by
+ * atari_bus_next() into a ring buffer in uninitialised SRAM, which survives a
+ * reset of the Pico as long as it stays powered. If the cart is also powered
+ * over USB, switching the Atari off reboots the Pico into USB mode, where the
+ * trace is written to BUSTRACE.BIN in the root of the flash drive.
+ *
+ * BUSTRACE.BIN is a BUS_TRACE_HEADER followed by the entries, oldest first.
+ *
+ * The timing histograms count, per region (S4, S5, CCTL read, CCTL write), the
+ * system clocks from atari_bus_next() returning a cycle to the read being
+ * answered, or to the write having been handled. Cycles that were already
+ * waiting in the RX FIFO are counted as late, cycles lost to a full FIFO as
+ * missed, and reads answered after phi2 fell (which the PIO drops, so the
+ * Atari reads a floating bus) as dropped. They are written to BUSTIME.TXT in
+ * the same way as the trace, along with the misses and fill time of the bank
+ * cache (see bank_cache.h), whether the clock picked keeps the engine within
+ * its budget, and the engine clocks the histograms of reads come to, for
+ * ENGINE_CLOCKS_* in atari_cart.c.
+ */
+
+#ifndef __BUS_TRACE_H__
+#define __BUS_TRACE_H__
+
+#include "pico/stdlib.h"
+#include "hardware/timer.h"
+#include "hardware/structs/systick.h"
+
+#ifndef BUS_TRACE
+#define BUS_TRACE           0
+#endif
+#ifndef BUS_TIMING
+#define BUS_TIMING          0
+#endif
+
+#define BUS_TRACE_ENTRIES   2048        // power of 2
+#define BUS_TRACE_MAGIC     0x54423841  // "A8BT"
+
+#define BUS_TRACE_SEL_MASK  0x03200000  // CCTL, S4, S5
+#define BUS_TRACE_DRIVEN    0x00400000  // in place of phi2, the cart drove the data bus
+#define BUS_TRACE_DATA_MASK 0x001FE000
+
+typedef struct {
+    uint32_t pins;      // gpio_get_all() layout, data is what the cart drove on reads
+    uint32_t time_us;   // cycle stamp, 1MHz timer
+} BUS_TRACE_ENTRY;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t cart_type;
+    uint32_t count;     // number of entries that follow
+    uint32_t reserved;
+} BUS_TRACE_HEADER;
+
+typedef struct {
+    BUS_TRACE_HEADER header;
+    uint32_t head;      // entries recorded since bus_trace_start()
+    BUS_TRACE_ENTRY entry[BUS_TRACE_ENTRIES];
+} BUS_TRACE_BUFFER;
+
+extern BUS_TRACE_BUFFER bus_trace;
+
+#define BUS_TIMING_MAGIC    0x54543841  // "A8TT"
+#define BUS_TIMING_BUCKETS  32
+#define BUS_TIMING_SHIFT    2           // 4 system clocks per bucket
+
+#define BUS_TIMING_S4       0
+#define BUS_TIMING_S5       1
+#define BUS_TIMING_CCTL_RD  2
+#define BUS_TIMING_CCTL_WR  3
+#define BUS_TIMING_REGIONS  4
+#define BUS_TIMING_NONE     BUS_TIMING_REGIONS
+
+typedef struct {
+    uint32_t magic;
+    uint32_t cart_type;
+    uint32_t sys_khz;
+    uint32_t hist[BUS_TIMING_REGIONS][BUS_TIMING_BUCKETS];
+    uint32_t late[BUS_TIMING_REGIONS];
+    uint32_t missed;
+    uint32_t dropped;
+    uint32_t cache_misses;
+    uint32_t cache_fill_us;     // per 8k bank
+    uint32_t cache_waits;       // XEX wait page reads answered 0, the block still being filled
+    // set by atari_bus_clock(): the engine's ENGINE_CLOCKS_*, and what the clock picked
+    // makes of it (phi2 rising to data driven)
+    uint32_t engine_clocks;
+    uint32_t answer_ns;
+    uint32_t budget_ns;
+    // cycle being timed
+    uint32_t region;
+    uint32_t start;
+} BUS_TIMING_STATS;
+
+extern BUS_TIMING_STATS bus_timing;
+
+void bus_trace_start(int cart_type);
+void bus_trace_start_menu();
+void bus_trace_watch();
+void bus_trace_export();
+
+// free running 24 bit SysTick at the system clock, for the timing. Each core has
+// its own, so it is set up on the core that serves the bus.
+static __force_inline void bus_timing_systick() {
+    systick_hw->rvr = 0xFFFFFF;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0x5;
+}
+
+// a cycle was returned by atari_bus_next(), now is the SysTick count (counts down)
+static __force_inline void bus_timing_begin(uint32_t pins, uint32_t now, bool late) {
+    uint32_t region = BUS_TIMING_NONE;
+    if (!(pins & 0x01000000)) region = BUS_TIMING_S4;
+    else if (!(pins & 0x02000000)) region = BUS_TIMING_S5;
+    else if (!(pins & 0x00200000)) region = (pins & 0x00800000) ? BUS_TIMING_CCTL_RD : BUS_TIMING_CCTL_WR;
+    if (late && region != BUS_TIMING_NONE)
+        bus_timing.late[region]++;
+    bus_timing.region = region;
+    bus_timing.start = now;
+}
+
+// the cycle has been answered (read) or handled (write)
+static __force_inline void bus_timing_end(uint32_t now) {
+    if (bus_timing.region < BUS_TIMING_REGIONS) {   // also guards against the uninitialised state before bus_trace_start()
+        uint32_t bucket = ((bus_timing.start - now) & 0xFFFFFF) >> BUS_TIMING_SHIFT;
+        if (bucket >= BUS_TIMING_BUCKETS)
+            bucket = BUS_TIMING_BUCKETS - 1;
+        bus_timing.hist[bus_timing.region][bucket]++;
+        bus_timing.region = BUS_TIMING_NONE;
+    }
+}
+
+static __force_inline void bus_trace_record(uint32_t pins) {
+    if ((pins & BUS_TRACE_SEL_MASK) != BUS_TRACE_SEL_MASK) {
+        BUS_TRACE_ENTRY *e = &bus_trace.entry[bus_trace.head++ & (BUS_TRACE_ENTRIES - 1)];
+        e->pins = pins & ~BUS_TRACE_DRIVEN;
+        e->time_us = timer_hw->timerawl;
+    }
+}
+
+// the cart only ever drives the bus on a cycle it takes part in, the last one recorded
+static __force_inline void bus_trace_driven(uint8_t data) {
+    BUS_TRACE_ENTRY *e = &bus_trace.entry[(bus_trace.head - 1) & (BUS_TRACE_ENTRIES - 1)];
+    e->pins = (e->pins & ~BUS_TRACE_DATA_MASK) | ((uint32_t)data << 13) | BUS_TRACE_DRIVEN;
+}
+
+#endif
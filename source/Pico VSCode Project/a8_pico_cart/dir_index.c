@@ -0,0 +1,502 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Sorted index of every directory on the flash drive (see dir_index.h)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#if !PICO_NO_HARDWARE
+#include "tusb.h"
+#endif
+
+#include "ff.h"
+#include "fatfs_disk.h"
+#include "atari_cart.h"
+#include "dir_index.h"
+#include "name_match.h"
+
+// the top of the firmware's half of flash, the drive starts at 1MB (see flash_fs.c)
+#define INDEX_FLASH_OFFSET  (512 * 1024)
+#define INDEX_FLASH_SIZE    (512 * 1024)
+#define INDEX_MAGIC         0x32444941  // "AID2"
+#define DIR_MAGIC           0x52494441  // "ADIR"
+// every file a search of the drive would find is in the index
+#define INDEX_SEARCHABLE    0x01
+// the header has the first flash sector to itself, it is written last so a build
+// that doesn't finish leaves no index behind
+#define FIRST_DIR_OFFSET    FLASH_SECTOR_SIZE
+#define PATH_QUEUE_SIZE     (16 * 1024)
+#define MAX_PATH            256
+// the search doesn't go into folders with paths this long (see scan_files() in atari_cart.c)
+#define SEARCH_MAX_PATH     210
+#define MAX_SEARCH          32
+// files numbered through the whole index that the last search can remember
+#define SEARCH_MAX_FILES    16384
+
+typedef struct {
+    uint32_t magic;
+    uint32_t stamp;         // flash_fs_stamp() of the drive it was built from
+    uint32_t size;          // bytes of DIR_INDEX_DIRs from FIRST_DIR_OFFSET
+    uint32_t dirs;
+    uint32_t flags;
+} INDEX_HEADER;
+
+// an entry of the directory being read by the build, and the case-folded rest of
+// its long filename if that doesn't fit in DIR_INDEX_ENTRY
+typedef struct {
+    DIR_INDEX_ENTRY e;
+    uint32_t key;           // name_key() of the name, for the sort
+    uint32_t tail;          // in the work area, 0 for none
+} READ_ENTRY;
+
+extern char __flash_binary_end;
+
+static const INDEX_HEADER *header = (const INDEX_HEADER *)(XIP_BASE + INDEX_FLASH_OFFSET);
+
+static FILINFO fno;
+
+// the flash sector being filled by the build
+static struct {
+    uint8_t *buf;
+    uint32_t offset;
+    uint32_t used;
+} out;
+
+// the directory being read by the build: its entries as they were read, with
+// their sorted order after them, and the tails kept from the top of the work
+// area down
+static struct {
+    uint8_t *area;
+    READ_ENTRY *entries;
+    uint16_t *order;
+} rd;
+
+static bool build_pending = false;
+static absolute_time_t build_at;
+static uint32_t build_generation;      // of the drive the build is reading
+
+// the files the last search found, a search for text that holds the last one
+// (the next key typed) only has to look at those again
+static struct {
+    bool valid;
+    char path[MAX_PATH];
+    char text[MAX_SEARCH];
+    uint32_t found[SEARCH_MAX_FILES / 32];
+} last;
+static NAME_PATTERN pattern;
+
+static uint32_t checked_generation = 0;
+static bool index_valid = false;
+
+static bool index_fits()
+{
+    return (uint32_t)&__flash_binary_end - XIP_BASE <= INDEX_FLASH_OFFSET;
+}
+
+static void program_sector(uint32_t offset, const uint8_t *data)
+{
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+    if (data) {
+        ints = save_and_disable_interrupts();
+        flash_range_program(offset, data, FLASH_SECTOR_SIZE);
+        restore_interrupts(ints);
+    }
+}
+
+// between the flash sectors and directories of a build, so the USB host isn't kept
+// waiting for all of it. False once the host has written to the drive, which ends
+// the build (the write schedules another).
+static bool build_poll()
+{
+#if !PICO_NO_HARDWARE
+    tud_task();
+#endif
+    return fatfs_disk_generation() == build_generation;
+}
+
+static bool flush_out()
+{
+    if (!out.used)
+        return true;
+    if (out.offset >= INDEX_FLASH_OFFSET + INDEX_FLASH_SIZE)
+        return false;
+    memset(out.buf + out.used, 0xFF, FLASH_SECTOR_SIZE - out.used);
+    program_sector(out.offset, out.buf);
+    out.offset += FLASH_SECTOR_SIZE;
+    out.used = 0;
+    return build_poll();
+}
+
+static bool write_out(const void *data, uint32_t len)
+{
+    const uint8_t *src = data;
+    while (len) {
+        uint32_t n = FLASH_SECTOR_SIZE - out.used;
+        if (n > len)
+            n = len;
+        if (src)
+            memcpy(out.buf + out.used, src, n);
+        else
+            memset(out.buf + out.used, 0, n);   // padding
+        out.used += n;
+        len -= n;
+        if (src)
+            src += n;
+        if (out.used == FLASH_SECTOR_SIZE && !flush_out())
+            return false;
+    }
+    return true;
+}
+
+// the same order as key_compare() in atari_cart.c
+static int index_compare(const void *p1, const void *p2)
+{
+    const READ_ENTRY *r1 = &rd.entries[*(const uint16_t *)p1];
+    const READ_ENTRY *r2 = &rd.entries[*(const uint16_t *)p2];
+    const DIR_INDEX_ENTRY *e1 = &r1->e, *e2 = &r2->e;
+    if ((e1->flags & DIR_INDEX_IS_DIR) != (e2->flags & DIR_INDEX_IS_DIR))
+        return (e1->flags & DIR_INDEX_IS_DIR) ? -1 : 1;
+    if (r1->key != r2->key)
+        return r1->key < r2->key ? -1 : 1;
+    int ret = name_compare(e1->name, e2->name);
+    if (!ret)
+        ret = strncmp(e1->altname, e2->altname, sizeof(e1->altname));
+    return ret;
+}
+
+// the pairs of adjacent characters in a case-folded name, each hashed to one of
+// 64 bits. A name can only hold the text searched for if it has all of its bits.
+static void name_pairs(const char *name, uint32_t *pairs)
+{
+    pairs[0] = pairs[1] = 0;
+    for (; name[0] && name[1]; name++) {
+        uint bit = ((uint8_t)name[0] * 31 + (uint8_t)name[1]) & 63;
+        pairs[bit >> 5] |= 1u << (bit & 31);
+    }
+}
+
+// the whole long filename of an entry read by read_dir(), case-folded
+static void folded_name(const READ_ENTRY *r, char *name)
+{
+    name_fold(name, r->e.name, sizeof(r->e.name));
+    if (r->tail)
+        strcpy(name + strlen(name), (const char *)rd.area + r->tail);
+}
+
+// the entries of path the menu would list into the size bytes of area, and
+// their sorted order, or -1 if it can't be read or they don't fit
+static int read_dir(const char *path, uint8_t *area, uint32_t size)
+{
+    DIR dir;
+    int n = 0;
+    uint8_t *tails = area + size;
+
+    rd.area = area;
+    rd.entries = (READ_ENTRY *)area;
+    if (f_opendir(&dir, path) != FR_OK)
+        return -1;
+    for (;;) {
+        if (f_readdir(&dir, &fno) != FR_OK || fno.fname[0] == 0)
+            break;
+        if (fno.fattrib & (AM_HID | AM_SYS))
+            continue;
+        if (!(fno.fattrib & AM_DIR) && !is_valid_file(fno.fname))
+            continue;
+        READ_ENTRY *r = &rd.entries[n];
+        uint32_t len = strlen(fno.fname);
+        uint32_t tail = len >= sizeof(r->e.name) ? len - sizeof(r->e.name) + 2 : 0;
+        // the entry, its place in the order and its tail
+        if (n == 0xFFFF || (uint8_t *)(r + 1) + (n + 1) * sizeof(uint16_t) + tail > tails) {
+            n = -1;
+            break;
+        }
+        n++;
+        r->e.flags = (fno.fattrib & AM_DIR) ? DIR_INDEX_IS_DIR : 0;
+        r->e.size[0] = fno.fsize & 0xFF;
+        r->e.size[1] = (fno.fsize >> 8) & 0xFF;
+        r->e.size[2] = (fno.fsize >> 16) & 0xFF;
+        // no altname when lfn is 8.3
+        strncpy(r->e.altname, fno.altname[0] ? fno.altname : fno.fname, sizeof(r->e.altname));
+        strncpy(r->e.name, fno.fname, sizeof(r->e.name) - 1);
+        r->e.name[sizeof(r->e.name) - 1] = 0;
+        r->key = name_key(r->e.name);
+        r->tail = 0;
+        if (tail) {
+            tails -= tail;
+            name_fold((char *)tails, fno.fname + sizeof(r->e.name) - 1, tail);
+            r->tail = tails - area;
+        }
+    }
+    f_closedir(&dir);
+    if (n > 0) {
+        rd.order = (uint16_t *)&rd.entries[n];
+        for (int i = 0; i < n; i++)
+            rd.order[i] = i;
+        qsort(rd.order, n, sizeof(uint16_t), index_compare);
+    }
+    return n;
+}
+
+// the DIR_INDEX_FILEs and names of the files of the directory read, which come
+// after its folders
+static bool write_files(int n, int files, uint32_t names_size)
+{
+    char name[FF_LFN_BUF + 1];
+    DIR_INDEX_FILE f;
+    uint32_t at = 0;
+
+    for (int i = n - files; i < n; i++) {
+        folded_name(&rd.entries[rd.order[i]], name);
+        name_pairs(name, f.pairs);
+        f.entry = i;
+        f.name = at;
+        at += strlen(name) + 1;
+        if (!write_out(&f, sizeof(f)))
+            return false;
+    }
+    for (int i = n - files; i < n; i++) {
+        folded_name(&rd.entries[rd.order[i]], name);
+        if (!write_out(name, strlen(name) + 1))
+            return false;
+    }
+    return write_out(NULL, names_size - at);
+}
+
+// walk the drive breadth first from the root and write every directory to the
+// index, using work for a flash sector, the queue of directories still to visit
+// and the entries of the one being read. USB is served between directories and
+// flash sectors. Gives up (leaving no index) if anything doesn't fit, or the drive
+// is written to while it runs. A directory too big to read is left out, and the
+// index can't answer searches then.
+void dir_index_build(unsigned char *work, uint32_t work_size)
+{
+    char path[MAX_PATH];
+    uint32_t dirs = 0;
+    uint32_t flags = INDEX_SEARCHABLE;
+    bool ok = true;
+
+    if (!index_fits() || work_size < FLASH_SECTOR_SIZE + PATH_QUEUE_SIZE + sizeof(READ_ENTRY) + sizeof(uint16_t))
+        return;
+    uint32_t stamp = flash_fs_stamp();
+    if (!mount_fatfs_volume())
+        return;
+    build_generation = fatfs_disk_generation();
+    // drop the old index before anything else is written
+    program_sector(INDEX_FLASH_OFFSET, NULL);
+    checked_generation = 0;
+    last.valid = false;
+
+    out.buf = work;
+    out.offset = INDEX_FLASH_OFFSET + FIRST_DIR_OFFSET;
+    out.used = 0;
+    char *queue = (char *)work + FLASH_SECTOR_SIZE;
+    uint8_t *area = (uint8_t *)queue + PATH_QUEUE_SIZE;
+    uint32_t area_size = work_size - FLASH_SECTOR_SIZE - PATH_QUEUE_SIZE;
+    uint32_t head = 0, tail = 1;
+    queue[0] = 0;   // the root
+
+    while (ok && head < tail) {
+        ok = build_poll();
+        if (!ok)
+            break;
+        strcpy(path, queue + head);
+        head += strlen(path) + 1;
+        // a directory that doesn't fit is left out, with everything below it,
+        // and the menu walks those itself
+        int n = read_dir(path, area, area_size);
+        if (n < 0) {
+            flags &= ~INDEX_SEARCHABLE;
+            continue;
+        }
+        uint32_t len = strlen(path);
+        int files = 0;
+        uint32_t names_size = 0;
+        for (int i = 0; len < SEARCH_MAX_PATH && i < n; i++) {
+            const READ_ENTRY *r = &rd.entries[rd.order[i]];
+            if (r->e.flags & DIR_INDEX_IS_DIR)
+                continue;
+            files++;
+            names_size += strlen(r->e.name) + 1;
+            if (r->tail)
+                names_size += strlen((const char *)rd.area + r->tail);
+        }
+        names_size = (names_size + 3) & ~3;
+        if (names_size > 0xFFFF) {
+            files = 0;
+            names_size = 0;
+            flags &= ~INDEX_SEARCHABLE;
+        }
+        DIR_INDEX_DIR dir = { DIR_MAGIC, n, (len + 4) & ~3, files, names_size };
+        ok = write_out(&dir, sizeof(dir)) && write_out(path, len)
+            && write_out(NULL, dir.path_size - len);
+        for (int i = 0; ok && i < n; i++)
+            ok = write_out(&rd.entries[rd.order[i]].e, sizeof(DIR_INDEX_ENTRY));
+        ok = ok && write_files(n, files, names_size);
+        dirs++;
+        for (int i = 0; ok && i < n; i++) {
+            const DIR_INDEX_ENTRY *e = &rd.entries[rd.order[i]].e;
+            if (!(e->flags & DIR_INDEX_IS_DIR))
+                continue;
+            uint32_t child = len + 1 + strnlen(e->altname, sizeof(e->altname));
+            // too deep for the menu's path, the menu reads it itself
+            if (child >= MAX_PATH)
+                continue;
+            if (tail + child + 1 > PATH_QUEUE_SIZE) {
+                ok = false;
+                break;
+            }
+            char *dst = queue + tail;
+            memcpy(dst, path, len);
+            dst[len] = '/';
+            memcpy(dst + len + 1, e->altname, child - len - 1);
+            dst[child] = 0;
+            tail += child + 1;
+        }
+    }
+    if (ok) {
+        uint32_t size = out.offset + out.used - INDEX_FLASH_OFFSET - FIRST_DIR_OFFSET;
+        ok = flush_out();
+        if (ok && flash_fs_stamp() == stamp) {
+            INDEX_HEADER *h = (INDEX_HEADER *)work;
+            memset(work, 0xFF, FLASH_SECTOR_SIZE);
+            h->magic = INDEX_MAGIC;
+            h->stamp = stamp;
+            h->size = size;
+            h->dirs = dirs;
+            h->flags = flags;
+            program_sector(INDEX_FLASH_OFFSET, work);
+        }
+    }
+    checked_generation = 0;
+}
+
+// build the index once delay_ms have passed without another call
+void dir_index_schedule(uint32_t delay_ms)
+{
+    build_at = make_timeout_time_ms(delay_ms);
+    build_pending = true;
+}
+
+// from the USB mode main loop
+void dir_index_task(unsigned char *work, uint32_t work_size)
+{
+    if (build_pending && time_reached(build_at)) {
+        build_pending = false;
+        if (!dir_index_valid())
+            dir_index_build(work, work_size);
+    }
+}
+
+// the stamp is only worked out again after the drive has been written to (or
+// mounted again)
+bool dir_index_valid()
+{
+    uint32_t generation = fatfs_disk_generation();
+    if (generation != checked_generation) {
+        index_valid = fatfs_is_mounted() && index_fits() && header->magic == INDEX_MAGIC
+            && header->stamp == flash_fs_stamp();
+        checked_generation = generation;
+    }
+    return index_valid;
+}
+
+static const DIR_INDEX_DIR *next_dir(const DIR_INDEX_DIR *dir)
+{
+    return (const DIR_INDEX_DIR *)(dir_index_names(dir) + dir->names_size);
+}
+
+// the index of the directory at path (as the menu builds it), or NULL if there
+// is no valid index or the directory isn't in it
+const DIR_INDEX_DIR *dir_index_find(const char *path)
+{
+    if (!dir_index_valid())
+        return NULL;
+    const DIR_INDEX_DIR *dir = (const DIR_INDEX_DIR *)((const uint8_t *)header + FIRST_DIR_OFFSET);
+    const DIR_INDEX_DIR *end = (const DIR_INDEX_DIR *)((const uint8_t *)dir + header->size);
+    for (uint32_t i = 0; i < header->dirs && dir < end; i++, dir = next_dir(dir)) {
+        if (dir->magic != DIR_MAGIC)
+            return NULL;
+        if (name_compare(dir->path, path) == 0)
+            return dir;
+    }
+    return NULL;
+}
+
+// whether dir_index_search() can answer searches, without walking the drive
+bool dir_index_searchable()
+{
+    return dir_index_valid() && (header->flags & INDEX_SEARCHABLE);
+}
+
+// pass every file in or below path whose long filename holds search (ignoring
+// case) to found(), with whether the name starts with it, the way scan_files()
+// in atari_cart.c finds them. Returns false without finding anything if there
+// is no valid index, or some of the files aren't in it.
+bool dir_index_search(const char *path, const char *search, dir_index_found_fn found)
+{
+    char text[MAX_SEARCH];
+    uint32_t pairs[2];
+
+    if (!dir_index_searchable())
+        return false;
+    name_fold(text, search, sizeof(text));
+    name_pairs(text, pairs);
+    name_pattern(&pattern, text);
+    bool refine = last.valid && strcmp(last.path, path) == 0 && strstr(text, last.text);
+    if (!refine) {
+        strncpy(last.path, path, sizeof(last.path) - 1);
+        memset(last.found, 0, sizeof(last.found));
+    }
+    last.valid = strlen(path) < sizeof(last.path);
+    strcpy(last.text, text);
+
+    uint32_t len = strlen(path);
+    uint32_t file = 0;      // numbered through the index
+    const DIR_INDEX_DIR *dir = (const DIR_INDEX_DIR *)((const uint8_t *)header + FIRST_DIR_OFFSET);
+    const DIR_INDEX_DIR *end = (const DIR_INDEX_DIR *)((const uint8_t *)dir + header->size);
+    for (uint32_t i = 0; i < header->dirs && dir < end; i++, file += dir->files, dir = next_dir(dir)) {
+        if (dir->magic != DIR_MAGIC) {
+            last.valid = false;
+            return false;
+        }
+        if (!dir->files || strncasecmp(dir->path, path, len) || (dir->path[len] && dir->path[len] != '/'))
+            continue;
+        if (file + dir->files > SEARCH_MAX_FILES)
+            last.valid = false;     // too many to remember, the next search looks at them all
+        const DIR_INDEX_FILE *f = dir_index_files(dir);
+        const char *names = dir_index_names(dir);
+        for (uint32_t j = 0, n = file; j < dir->files; j++, n++, f++) {
+            uint32_t bit = 1u << (n & 31);
+            if (refine) {
+                if (!(last.found[n >> 5] & bit))
+                    continue;
+                last.found[n >> 5] &= ~bit;
+            }
+            if ((f->pairs[0] & pairs[0]) != pairs[0] || (f->pairs[1] & pairs[1]) != pairs[1])
+                continue;
+            const char *name = names + f->name;
+            const char *match = name_match(&pattern, name);
+            if (match) {
+                if (n < SEARCH_MAX_FILES)
+                    last.found[n >> 5] |= bit;
+                found(dir, dir_index_entries(dir) + f->entry, match == name);
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,81 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Sorted index of every directory on the flash drive
+ *
+ * Built in USB mode once the host has ejected the drive, or has stopped writing
+ * to it for a while, into flash the firmware doesn't use. Each directory is a
+ * DIR_INDEX_DIR followed by its entries, filtered and sorted the way the menu
+ * lists them, so in Atari mode a directory is read straight from XIP without
+ * walking or sorting anything. The index carries flash_fs_stamp() of the drive
+ * it was built from, and any write to the drive since (from USB, or an ATR
+ * being written to) makes it stale until the next build. The menu falls back
+ * to reading the directory itself until then.
+ *
+ * The files of each directory are followed by what a search needs: their whole
+ * long filenames case-folded, and a mask of the pairs of characters in each,
+ * so a search only compares the names that can hold the text it looks for and
+ * never opens a directory.
+ */
+
+#ifndef __DIR_INDEX_H__
+#define __DIR_INDEX_H__
+
+#include "pico/stdlib.h"
+
+#define DIR_INDEX_IS_DIR        0x01
+
+typedef struct {
+    uint8_t flags;              // DIR_INDEX_IS_DIR
+    uint8_t size[3];            // file size, little endian
+    char altname[12];           // 8.3 name, only terminated if shorter
+    char name[32];              // long filename, truncated to 31 characters
+} DIR_INDEX_ENTRY;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t count;             // entries after the path
+    uint16_t path_size;         // bytes of path, terminator and padding
+    uint16_t files;             // DIR_INDEX_FILEs after the entries
+    uint16_t names_size;        // bytes of their names after them, padding included
+    char path[];                // as atari_cart.c builds it from 8.3 names, "" for the root
+} DIR_INDEX_DIR;
+
+// a file of the directory as the search sees it
+typedef struct {
+    uint32_t pairs[2];          // bit per pair of characters in the name (see dir_index.c)
+    uint16_t entry;             // in the directory's entries
+    uint16_t name;              // case-folded long filename, from the start of the names
+} DIR_INDEX_FILE;
+
+typedef void (*dir_index_found_fn)(const DIR_INDEX_DIR *dir, const DIR_INDEX_ENTRY *entry, bool prefix);
+
+void dir_index_build(unsigned char *work, uint32_t work_size);
+void dir_index_schedule(uint32_t delay_ms);
+void dir_index_task(unsigned char *work, uint32_t work_size);
+bool dir_index_valid();
+const DIR_INDEX_DIR *dir_index_find(const char *path);
+bool dir_index_searchable();
+bool dir_index_search(const char *path, const char *search, dir_index_found_fn found);
+
+static inline const DIR_INDEX_ENTRY *dir_index_entries(const DIR_INDEX_DIR *dir) {
+    return (const DIR_INDEX_ENTRY *)(dir->path + dir->path_size);
+}
+
+static inline const DIR_INDEX_FILE *dir_index_files(const DIR_INDEX_DIR *dir) {
+    return (const DIR_INDEX_FILE *)(dir_index_entries(dir) + dir->count);
+}
+
+static inline const char *dir_index_names(const DIR_INDEX_DIR *dir) {
+    return (const char *)(dir_index_files(dir) + dir->files);
+}
+
+#endif
@@ -25,9 +25,6 @@ DSTATUS disk_status (
 	BYTE pdrv		/* Physical drive nmuber to identify the drive */
 )
 {
-	DSTATUS stat;
-	int result;
-
 	if (pdrv == 0)
 		return 0;
 
@@ -44,9 +41,6 @@ DSTATUS disk_initialize (
 	BYTE pdrv				/* Physical drive nmuber to identify the drive */
 )
 {
-	DSTATUS stat;
-	int result;
-
 	if (pdrv == 0)
 	{
 		return 0;
@@ -68,7 +62,6 @@ DRESULT disk_read (
 )
 {
 	DRESULT res;
-	int result;
 
 	if (pdrv == 0)
 	{
@@ -95,7 +88,6 @@ DRESULT disk_write (
 )
 {
 	DRESULT res;
-	int result;
 
 	if (pdrv == 0)
 	{
@@ -119,9 +111,6 @@ DRESULT disk_ioctl (
 	void *buff		/* Buffer to send/receive control data */
 )
 {
-	DRESULT res;
-	int result;
-
 	if (pdrv == 0)
 	{
 		switch(cmd) {
@@ -17,16 +17,65 @@
 #include "fatfs_disk.h"
 
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "hardware/flash.h"
 
 bool flashfs_is_mounted = false;
+// bumped on every mount and write, so anything derived from the drive's contents
+// can tell cheaply whether it needs checking again
+static uint32_t disk_generation = 1;
+
+// FatFs reads the FAT and directories a sector at a time through its window, the
+// last few of those are kept here so walking the same directories again doesn't go
+// back to flash. File data is read in runs straight into the caller's buffer and
+// isn't kept.
+#define SECTOR_CACHE_SIZE   16
+
+static struct {
+    uint16_t sector;
+    uint32_t used;      // 0 if empty, else for least recently used
+    uint8_t data[SECTOR_SIZE];
+} sector_cache[SECTOR_CACHE_SIZE];
+static uint32_t cache_use_count = 0;
+
+static void invalidate_sector_cache()
+{
+    for (int i=0; i<SECTOR_CACHE_SIZE; i++)
+        sector_cache[i].used = 0;
+}
+
+// the entry holding sector, or NULL
+static uint8_t *cached_sector(uint32_t sector)
+{
+    for (int i=0; i<SECTOR_CACHE_SIZE; i++) {
+        if (sector_cache[i].used && sector_cache[i].sector == sector) {
+            sector_cache[i].used = ++cache_use_count;
+            return sector_cache[i].data;
+        }
+    }
+    return NULL;
+}
+
+static uint8_t *cache_sector(uint32_t sector)
+{
+    int lru = 0;
+    for (int i=1; i<SECTOR_CACHE_SIZE; i++)
+        if (sector_cache[i].used < sector_cache[lru].used)
+            lru = i;
+    sector_cache[lru].sector = sector;
+    sector_cache[lru].used = ++cache_use_count;
+    flash_fs_read_FAT_sector(sector, sector_cache[lru].data);
+    return sector_cache[lru].data;
+}
 
 bool mount_fatfs_disk()
 {
     int err = flash_fs_mount();
     if (err)
         return false;
+    invalidate_sector_cache();
+    disk_generation++;
         
     flashfs_is_mounted = true;
     return true;
@@ -34,24 +83,48 @@ bool mount_fatfs_disk()
 
 bool fatfs_is_mounted() { return flashfs_is_mounted; }
 
+// the FatFs volume everything shares (the menu commands, the mounted ATR, the
+// directory index, BUSTIME.TXT), mounted on first use and kept from then on, so
+// FatFs keeps its window (and the sector cache above its sectors) from one use to
+// the next instead of reading the boot sector and FAT again each time. A format, or
+// the USB host writing to the drive behind FatFs's back, has it mounted again.
+static FATFS volume;
+static bool volume_mounted = false;
+
+bool mount_fatfs_volume()
+{
+    if (!volume_mounted) {
+        if (!flashfs_is_mounted && !mount_fatfs_disk())
+            return false;
+        volume_mounted = (f_mount(&volume, "", 1) == FR_OK);
+    }
+    return volume_mounted;
+}
+
+void fatfs_volume_changed() { volume_mounted = false; }
+
+uint32_t fatfs_disk_generation() { return disk_generation; }
+
 void create_fatfs_disk()
 {
     flash_fs_create();
     flashfs_is_mounted = true;
+    volume_mounted = false;     // the f_mount() below takes its place
+    invalidate_sector_cache();
+    disk_generation++;
 
     // now create a fatfs on the flash_fs filesystem :-)
 
     FATFS fs;           /* Filesystem object */
     FIL fil;            /* File object */
-    FRESULT res;        /* API result code */
     BYTE work[FF_MAX_SS]; /* Work area (larger is better for processing time) */
 
     /* Format the default drive with default parameters */
     printf("making fatfs\n");
-    res = f_mkfs("", 0, work, sizeof work);
+    f_mkfs("", 0, work, sizeof work);
     f_mount(&fs, "", 0);
     f_setlabel("A8-PICOCART");
-    res = f_open(&fil, "WELCOME.TXT", FA_CREATE_NEW | FA_WRITE);
+    f_open(&fil, "WELCOME.TXT", FA_CREATE_NEW | FA_WRITE);
     f_puts("Atari 8-bit PicoCart\r\n(c)2023 Electrotrains\r\nDrag ROM,CAR & XEX files in here!\r\n", &fil);
     f_close(&fil);
     f_mount(0, "", 0);
@@ -61,11 +134,18 @@ uint32_t fatfs_disk_read(uint8_t* buff, uint32_t sector, uint32_t count)
 {	
 //	printf("fatfs_disk_read sector=%d, count=%d\n", sector, count);
     if (!flashfs_is_mounted) return RES_ERROR;
-    if (sector < 0 || sector >= SECTOR_NUM)
+    if (sector >= SECTOR_NUM)
 			return RES_PARERR;
 
+    if (count == 1) {
+        uint8_t *data = cached_sector(sector);
+        if (!data)
+            data = cache_sector(sector);
+        memcpy(buff, data, SECTOR_SIZE);
+        return RES_OK;
+    }
     /* copy data to buffer */
-    for (int i=0; i<count; i++)
+    for (uint32_t i=0; i<count; i++)
         flash_fs_read_FAT_sector(sector + i, buff + (i*SECTOR_SIZE));
     return RES_OK;
 }
@@ -74,15 +154,20 @@ uint32_t fatfs_disk_write(const uint8_t* buff, uint32_t sector, uint32_t count)
 {
 // 	printf("fatfs_disk_write sector=%d, count=%d\n", sector, count);
     if (!flashfs_is_mounted) return RES_ERROR;
-    if (sector < 0 || sector >= SECTOR_NUM)
+    if (sector >= SECTOR_NUM)
         return RES_PARERR;
 
+    disk_generation++;
     /* copy data to buffer */
-    for (int i=0; i<count; i++) {
+    for (uint32_t i=0; i<count; i++) {
+        uint8_t *data = cached_sector(sector + i);
+        if (data)
+            memcpy(data, buff + (i*SECTOR_SIZE), SECTOR_SIZE);
         flash_fs_write_FAT_sector(sector + i, buff + (i*SECTOR_SIZE));
         // verify
         if (!flash_fs_verify_FAT_sector(sector + i, buff + (i*SECTOR_SIZE))) {
             printf("VERIFY ERROR!");
+            invalidate_sector_cache();
             return RES_ERROR;
         }
     }
@@ -23,6 +23,9 @@
 void create_fatfs_disk();
 bool mount_fatfs_disk();
 bool fatfs_is_mounted();
+bool mount_fatfs_volume();
+void fatfs_volume_changed();
+uint32_t fatfs_disk_generation();
 uint32_t fatfs_disk_read(uint8_t* buff, uint32_t sector, uint32_t count);
 uint32_t fatfs_disk_write(const uint8_t* buff, uint32_t sector, uint32_t count);
 void fatfs_disk_sync();
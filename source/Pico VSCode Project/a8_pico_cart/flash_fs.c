@@ -158,7 +158,7 @@ void flash_fs_create()
 {
     printf("flash_fs_create()\n");
     memset(&fs_map, 0, sizeof(fs_map));
-    strcpy(fs_map.header, MAGIC_8_BYTES);
+    strcpy((char *)fs_map.header, MAGIC_8_BYTES);
     for (int i=0; i<15; i++)
         fs_map_needs_written[i] = true;
     write_fs_map();
@@ -170,6 +170,16 @@ void flash_fs_sync()
     write_fs_map();
 }
 
+// changes whenever any FAT sector is written, as every write moves the sector
+// somewhere else in flash (FNV-1a over the map)
+uint32_t flash_fs_stamp()
+{
+    uint32_t hash = 2166136261u;
+    for (int i=0; i<NUM_FAT_SECTORS; i++)
+        hash = (hash ^ fs_map.sectors[i]) * 16777619u;
+    return hash;
+}
+
 void flash_fs_read_FAT_sector(uint16_t fat_sector, void *buffer)
 {
     int mapEntry = fs_map.sectors[fat_sector];
@@ -180,6 +190,15 @@ void flash_fs_read_FAT_sector(uint16_t fat_sector, void *buffer)
     return;
 }
 
+// offset in flash of a FAT sector, to read it straight from XIP (0 if it was never written)
+uint32_t flash_fs_FAT_sector_offset(uint16_t fat_sector)
+{
+    int mapEntry = fs_map.sectors[fat_sector];
+    if (!mapEntry)
+        return 0;
+    return HW_FLASH_STORAGE_BASE + (getMapSector(mapEntry) * FLASH_SECTOR_SIZE) + (getMapOffset(mapEntry) * 512);
+}
+
 void flash_fs_write_FAT_sector(uint16_t fat_sector, const void *buffer)
 {
     uint16_t mapEntry = fs_map.sectors[fat_sector];
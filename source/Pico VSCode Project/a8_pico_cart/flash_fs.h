@@ -20,7 +20,9 @@
 int flash_fs_mount();
 void flash_fs_create();
 void flash_fs_sync();
+uint32_t flash_fs_stamp();
 void flash_fs_read_FAT_sector(uint16_t fat_sector, void *buffer);
+uint32_t flash_fs_FAT_sector_offset(uint16_t fat_sector);
 void flash_fs_write_FAT_sector(uint16_t fat_sector, const void *buffer);
 bool flash_fs_verify_FAT_sector(uint16_t fat_sector, const void *buffer);
 
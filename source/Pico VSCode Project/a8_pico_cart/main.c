@@ -24,6 +24,8 @@
 
 #include "atari_cart.h"
 #include "fatfs_disk.h"
+#include "dir_index.h"
+#include "bus_trace.h"
 
 void cdc_task(void);
 
@@ -53,6 +55,8 @@ int main(void)
     tud_task(); // tinyusb device task
 
     cdc_task();
+
+    dir_index_task(cart_ram, sizeof(cart_ram));
   }
 
   return 0;
@@ -68,6 +72,13 @@ void tud_mount_cb(void)
   printf("Device mounted\n"); 
   if (!mount_fatfs_disk())
     create_fatfs_disk();
+#if BUS_TRACE || BUS_TIMING
+  bus_trace_export();
+#endif
+  // index a drive that was written to last time without being ejected, or just
+  // now by the export
+  if (!dir_index_valid())
+    dir_index_schedule(2000);
 }
 
 // Invoked when device is unmounted
@@ -14,6 +14,7 @@
 
 #include "tusb.h"
 #include "fatfs_disk.h"
+#include "dir_index.h"
 
 // whether host does safe-eject
 static bool ejected = false;
@@ -77,6 +78,8 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
     {
       // unload disk storage
       ejected = true;
+      // the host is done with the drive, index it for the menu
+      dir_index_schedule(0);
     }
   }
 
@@ -119,11 +122,14 @@ int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t*
   if(bufsize != SECTOR_SIZE) return -1;	
 
   uint32_t status = fatfs_disk_write(buffer, lba, 1);
+  fatfs_volume_changed();
 
   // we need to sync the flash but only do it when activity dies down :-)
   if(alarm_id >= 0)
       cancel_alarm(alarm_id);
   alarm_id = add_alarm_in_ms(250, sync_callback, NULL, false);
+  // and index the directories once the host has been quiet for a while longer
+  dir_index_schedule(2000);
 
   if(status != 0) return -1;
   return (int32_t) bufsize;
@@ -0,0 +1,103 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Case-insensitive filename matching (see name_match.h)
+ */
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "name_match.h"
+
+// copy name to dst folded, at most size bytes with the terminator
+void name_fold(char *dst, const char *name, uint32_t size)
+{
+    while (--size && *name)
+        *dst++ = name_fold_char(*name++);
+    *dst = 0;
+}
+
+// the first 4 characters of name folded, big endian so that keys compare the
+// way the names do. Sorting by key first leaves few pairs of names to compare.
+uint32_t name_key(const char *name)
+{
+    const uint8_t *s = (const uint8_t *)name;
+    uint32_t key = 0;
+    for (int i = 0; i < 4; i++) {
+        key <<= 8;
+        if (*s)
+            key |= name_fold_char(*s++);
+    }
+    return key;
+}
+
+// strcasecmp()
+int name_compare(const char *name1, const char *name2)
+{
+    const uint8_t *s1 = (const uint8_t *)name1, *s2 = (const uint8_t *)name2;
+    uint8_t c1, c2;
+    do {
+        c1 = name_fold_char(*s1++);
+        c2 = name_fold_char(*s2++);
+    } while (c1 == c2 && c1);
+    return c1 - c2;
+}
+
+// the extension of name (after the last '.', unless that starts the name) folded
+// and packed like NAME_EXT(), 0 for none or one longer than 4 characters. One
+// compare tells the file types apart.
+uint32_t name_ext(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    uint32_t ext = 0;
+    if (!dot || dot == name)
+        return 0;
+    for (int i = 1; dot[i]; i++) {
+        if (i > 4)
+            return 0;
+        ext = (ext << 8) | name_fold_char(dot[i]);
+    }
+    return ext;
+}
+
+// prepare text (up to NAME_PATTERN_MAX characters of it) for name_match()
+void name_pattern(NAME_PATTERN *p, const char *text)
+{
+    const uint8_t *s = (const uint8_t *)text;
+    uint32_t i;
+    memset(p->masks, 0, sizeof(p->masks));
+    for (i = 0; i < NAME_PATTERN_MAX && s[i]; i++) {
+        uint8_t c = name_fold_char(s[i]);
+        p->masks[c] |= 1u << i;
+        if (c >= 'a' && c <= 'z')
+            p->masks[c - ('a' - 'A')] |= 1u << i;
+    }
+    p->len = i;
+    p->last = i ? 1u << (i - 1) : 0;
+}
+
+// the first place in name that holds the text of p (ignoring case), or NULL.
+// Bit i of state is set while the last i+1 characters matched the start of the
+// text, so every character moves all the partial matches on at once.
+const char *name_match(const NAME_PATTERN *p, const char *name)
+{
+    const uint8_t *s = (const uint8_t *)name;
+    uint32_t state = 0;
+    if (!p->last)
+        return name;
+    for (; *s; s++) {
+        state = ((state << 1) | 1) & p->masks[*s];
+        if (state & p->last)
+            return (const char *)s - p->len + 1;
+    }
+    return NULL;
+}
@@ -0,0 +1,51 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Case-insensitive filename matching for the directory listing, the search and
+ * the directory index
+ *
+ * Names are folded to lower case the way strcasecmp() does in the C locale, so
+ * only A-Z are changed. A search text is prepared once as a NAME_PATTERN, a
+ * table of which of its characters each byte matches in either case, and
+ * name_match() then runs the whole pattern over a name in one pass, a shift
+ * and a mask per character (shift-and), without folding or copying the name.
+ * Nothing here uses the heap.
+ */
+
+#ifndef __NAME_MATCH_H__
+#define __NAME_MATCH_H__
+
+#include "pico/stdlib.h"
+
+// characters of search text a NAME_PATTERN holds, one bit each
+#define NAME_PATTERN_MAX    32
+
+// a folded extension as name_ext() returns it
+#define NAME_EXT(a, b, c)   (((uint32_t)(a) << 16) | ((uint32_t)(b) << 8) | (uint32_t)(c))
+
+typedef struct {
+    uint32_t masks[256];    // bit i set for the bytes that match character i of the text
+    uint32_t last;          // the bit of its last character, 0 for no text
+    uint32_t len;
+} NAME_PATTERN;
+
+static inline uint8_t name_fold_char(uint8_t c) {
+    return (uint8_t)(c - 'A') < 26 ? c + ('a' - 'A') : c;
+}
+
+void name_fold(char *dst, const char *name, uint32_t size);
+uint32_t name_key(const char *name);
+int name_compare(const char *name1, const char *name2);
+uint32_t name_ext(const char *name);
+void name_pattern(NAME_PATTERN *p, const char *text);
+const char *name_match(const NAME_PATTERN *p, const char *name);
+
+#endif
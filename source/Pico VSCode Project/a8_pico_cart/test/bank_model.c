@@ -0,0 +1,295 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Reference model of the banking of every cartridge type (see bank_model.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bank_model.h"
+
+#define WIN_NONE    -1      // nothing there
+#define WIN_FF      -2      // $FF
+
+const MODEL_CART model_carts[] = {
+    { 0, "no cartridge", 0, 0 },
+    { 26, "4k", 58, 4096 },
+    { 1, "8k", 1, 8192 },
+    { 2, "16k", 2, 16384 },
+    { 3, "XEGS 32k", 12, 32768 },
+    { 4, "XEGS 64k", 13, 65536 },
+    { 5, "XEGS 128k", 14, 131072 },
+    { 30, "XEGS 256k", 23, 262144 },
+    { 31, "XEGS 512k", 24, 524288 },
+    { 32, "XEGS 1M", 25, 1048576 },
+    { 6, "Switchable XEGS 32k", 33, 32768 },
+    { 7, "Switchable XEGS 64k", 34, 65536 },
+    { 8, "Switchable XEGS 128k", 35, 131072 },
+    { 33, "Switchable XEGS 256k", 36, 262144 },
+    { 34, "Switchable XEGS 512k", 37, 524288 },
+    { 35, "Switchable XEGS 1M", 38, 1048576 },
+    { 9, "MegaCart 16k", 26, 16384 },
+    { 10, "MegaCart 32k", 27, 32768 },
+    { 11, "MegaCart 64k", 28, 65536 },
+    { 12, "MegaCart 128k", 29, 131072 },
+    { 36, "MegaCart 256k", 30, 262144 },
+    { 37, "MegaCart 512k", 31, 524288 },
+    { 38, "MegaCart 1M", 32, 1048576 },
+    { 13, "Bounty Bob", 18, 40960 },
+    { 14, "Atarimax 1Mbit", 41, 131072 },
+    { 39, "Atarimax 8Mbit", 42, 1048576 },
+    { 15, "Williams 32k", 22, 32768 },
+    { 15, "Williams 64k", 8, 65536 },
+    { 16, "OSS 16k type B", 15, 16384 },
+    { 17, "OSS 8k", 44, 8192 },
+    { 18, "OSS 16k 034M", 3, 16384 },
+    { 19, "OSS 16k 043M", 45, 16384 },
+    { 20, "SIC! 128k", 54, 131072 },
+    { 40, "SIC! 256k", 55, 262144 },
+    { 41, "SIC! 512k", 56, 524288 },
+    { 21, "SDX 64k", 11, 65536 },
+    { 22, "SDX 128k", 43, 131072 },
+    { 23, "Diamond 64k", 10, 65536 },
+    { 24, "Express 64k", 9, 65536 },
+    { 25, "Blizzard 16k", 40, 16384 },
+    { 27, "Turbosoft 64k", 50, 65536 },
+    { 28, "Turbosoft 128k", 51, 131072 },
+    { 29, "Atrax 128k", 17, 131072 },
+    { 255, "XEX", -1, 0 },
+};
+
+const int num_model_carts = sizeof(model_carts) / sizeof(model_carts[0]);
+
+static void map_8k(MODEL *m, int win, int offset)
+{
+    m->win[win] = offset;
+    m->win[win + 1] = offset + 0x1000;
+}
+
+// the windows and RD4/RD5 for the state of the registers
+static void select(MODEL *m)
+{
+    const MODEL_CART *cart = m->cart;
+    int banks8k = cart->size / 8192, banks16k = cart->size / 16384;
+
+    for (int i = 0; i < 4; i++)
+        m->win[i] = WIN_NONE;
+    m->rd = 0;
+    if (!m->on)
+        return;
+    switch (cart->car_type) {
+    case 58:    // 4k at $B000, $A000-$AFFF reads $FF
+        m->win[2] = WIN_FF;
+        m->win[3] = 0;
+        m->rd = SIM_RD5_MASK;
+        break;
+    case 1:
+        map_8k(m, 2, 0);
+        m->rd = SIM_RD5_MASK;
+        break;
+    case 2: case 40:
+        map_8k(m, 0, 0);
+        map_8k(m, 2, 0x2000);
+        m->rd = SIM_RD4_MASK | SIM_RD5_MASK;
+        break;
+    case 12: case 13: case 14: case 23: case 24: case 25:   // XEGS, 8k bank at $8000, last 8k at $A000
+    case 33: case 34: case 35: case 36: case 37: case 38:
+        map_8k(m, 0, (m->bank & (banks8k - 1)) * 8192);
+        map_8k(m, 2, cart->size - 8192);
+        m->rd = SIM_RD4_MASK | SIM_RD5_MASK;
+        break;
+    case 26: case 27: case 28: case 29: case 30: case 31: case 32:  // MegaCart, 16k banks
+        map_8k(m, 0, (m->bank & (banks16k - 1)) * 16384);
+        map_8k(m, 2, (m->bank & (banks16k - 1)) * 16384 + 8192);
+        m->rd = SIM_RD4_MASK | SIM_RD5_MASK;
+        break;
+    case 18:    // Bounty Bob: two 4k windows banked from the first and second 16k, the last 8k fixed
+        m->win[0] = m->bank * 4096;
+        m->win[1] = 0x4000 + m->bank2 * 4096;
+        map_8k(m, 2, 0x8000);
+        m->rd = SIM_RD4_MASK | SIM_RD5_MASK;
+        break;
+    case 3: case 45:    // OSS, 4k bank at $A000, the last 4k at $B000
+        m->win[2] = m->bank * 4096;
+        m->win[3] = 0x3000;
+        m->rd = SIM_RD5_MASK;
+        break;
+    case 15: case 44:   // OSS, 4k bank at $A000, the first 4k at $B000
+        m->win[2] = m->bank * 4096;
+        m->win[3] = 0;
+        m->rd = SIM_RD5_MASK;
+        break;
+    case 54: case 55: case 56:  // SIC!, 16k banks with each half switched on its own
+        if (m->reg & 0x20) {
+            map_8k(m, 0, (m->bank & (banks16k - 1)) * 16384);
+            m->rd |= SIM_RD4_MASK;
+        }
+        if (!(m->reg & 0x40)) {
+            map_8k(m, 2, (m->bank & (banks16k - 1)) * 16384 + 8192);
+            m->rd |= SIM_RD5_MASK;
+        }
+        break;
+    default:    // 8k banks at $A000
+        map_8k(m, 2, (m->bank & (banks8k - 1)) * 8192);
+        m->rd = SIM_RD5_MASK;
+        break;
+    }
+}
+
+void model_reset(MODEL *m, const MODEL_CART *cart, const uint8_t *image, uint32_t size)
+{
+    memset(m, 0, sizeof(*m));
+    m->cart = cart;
+    m->image = image;
+    m->size = size;
+    m->on = cart->car_type > 0;
+    if (cart->car_type == 42)   // the original 8Mbit Atarimax starts from the last bank
+        m->bank = 127;
+    else if (cart->car_type == 15 || cart->car_type == 44)
+        m->bank = 1;
+    select(m);
+}
+
+// an access to $D5xx
+static void cctl(MODEL *m, uint8_t a, bool write, uint8_t data)
+{
+    switch (m->cart->car_type) {
+    case 12: case 13: case 14: case 23: case 24: case 25:   // XEGS, the byte written
+        if (write)
+            m->bank = data;
+        break;
+    case 33: case 34: case 35: case 36: case 37: case 38:   // and bit 7 switches off
+    case 26: case 27: case 28: case 29: case 30: case 31: case 32:
+    case 17:
+        if (write) {
+            m->on = !(data & 0x80);
+            m->bank = data & 0x7F;
+        }
+        break;
+    case 22: case 8:    // Williams, $D500-$D50F, bit 3 switches off
+        if (a < 0x10) {
+            m->on = !(a & 0x08);
+            m->bank = a & 0x07;
+        }
+        break;
+    case 9: case 10: case 11:   // Express $D570, Diamond $D5D0, SDX $D5E0, the other way round
+        if ((a & 0xF0) == (m->cart->car_type == 9 ? 0x70 : m->cart->car_type == 10 ? 0xD0 : 0xE0)) {
+            m->on = !(a & 0x08);
+            m->bank = ~a & 0x07;
+        }
+        break;
+    case 43:    // SDX 128k, $D5E0 for the second 64k and $D5F0 for the first
+        if ((a & 0xE0) == 0xE0) {
+            m->on = !(a & 0x08);
+            m->bank = (~a & 0x07) | (a & 0x10 ? 0 : 8);
+        }
+        break;
+    case 3: case 45:    // OSS 034M/043M, $D5x0-$D5x7 pick a bank or switch back on
+        a &= 0x0F;
+        if (a & 0x08)
+            m->on = false;
+        else {
+            m->on = true;
+            if (a == 0x00)
+                m->bank = 0;
+            else if (a == 0x03 || a == 0x07)
+                m->bank = m->cart->car_type == 3 ? 1 : 2;
+            else if (a == 0x04)
+                m->bank = m->cart->car_type == 3 ? 2 : 1;
+        }
+        break;
+    case 15: case 44:   // OSS type B/8k, A0 and A3
+        m->on = (a & 0x09) != 0x08;
+        if (m->on)
+            m->bank = (a & 0x09) == 0x00 ? 1 : (a & 0x09) == 0x01 ? 3 : 2;
+        break;
+    case 41:    // Atarimax 1Mbit, $D500-$D51F, bit 4 switches off
+        if (a < 0x20) {
+            m->on = !(a & 0x10);
+            m->bank = a & 0x0F;
+        }
+        break;
+    case 42:    // Atarimax 8Mbit, bit 7 switches off
+        m->on = !(a & 0x80);
+        m->bank = a & 0x7F;
+        break;
+    case 50: case 51:   // Turbosoft, bit 4 switches off
+        m->on = !(a & 0x10);
+        m->bank = a & 0x0F;
+        break;
+    case 54: case 55: case 56:  // SIC!, written to $D500-$D51F
+        if (write && a < 0x20) {
+            m->reg = data;
+            m->bank = data & 0x1F;
+        }
+        break;
+    case 40:    // Blizzard, switched off for good
+        m->on = false;
+        break;
+    case -1:    // XEX loader, the page is written to $D500-$D501
+        if (write && a == 0)
+            m->page = (m->page & 0xFF00) | data;
+        else if (write && a == 1)
+            m->page = (m->page & 0x00FF) | (data << 8);
+        break;
+    }
+    select(m);
+}
+
+// a read of the image at offset in window win
+static int image_byte(const MODEL *m, int win, uint16_t addr)
+{
+    int offset = m->win[win];
+    if (offset == WIN_NONE)
+        return SIM_FLOAT;
+    if (offset == WIN_FF)
+        return 0xFF;
+    return m->image[(offset + (addr & 0x0FFF)) % m->cart->size];
+}
+
+int model_cycle(MODEL *m, const SIM_CYCLE *c)
+{
+    int answer = c->write ? SIM_NONE : SIM_FLOAT;
+    uint16_t addr = c->addr;
+
+    if ((addr & 0xFF00) == 0xD500) {
+        uint8_t a = addr & 0xFF;
+        if (!c->write && m->cart->car_type == -1) {
+            // the stream the loader reads, behind the file's length, the segment table
+            // from page $8000 on is checked elsewhere, and the wait page ($4000) by the
+            // reads of the page after it
+            uint32_t pos = m->page * 256 + a;
+            if (m->page & 0xC000 || pos >= m->size + 4)
+                answer = MODEL_ANY;
+            else
+                answer = pos < 4 ? (m->size >> (8 * pos)) & 0xFF : m->image[pos - 4];
+        }
+        else if (!c->write && m->cart->car_type >= 54 && m->cart->car_type <= 56 && a < 0x20)
+            answer = m->reg;
+        cctl(m, a, c->write, c->data);
+    }
+    else if (addr >= 0x8000 && addr < 0xC000) {
+        int win = (addr - 0x8000) >> 12;
+        bool selected = m->rd & (win < 2 ? SIM_RD4_MASK : SIM_RD5_MASK);
+        if (selected && !c->write)
+            answer = image_byte(m, win, addr);
+        if (selected && m->cart->car_type == 18 && (addr & 0x0FFF) >= 0x0FF6 && (addr & 0x0FFF) <= 0x0FF9) {
+            // Bounty Bob, any access to the last four bytes of a 4k window
+            if (win == 0)
+                m->bank = (addr & 0x0FFF) - 0x0FF6;
+            else if (win == 1)
+                m->bank2 = (addr & 0x0FFF) - 0x0FF6;
+            select(m);
+        }
+    }
+    return answer;
+}
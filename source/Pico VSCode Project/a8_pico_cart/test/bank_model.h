@@ -0,0 +1,60 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Reference model of the banking of every cartridge type, for the tests
+ *
+ * Written from the .CAR type descriptions rather than from atari_cart.c, so
+ * the two can be held against each other: given the same 6502 bus cycles, the
+ * model says what each read of the cartridge should return and where RD4/RD5
+ * should be. Images smaller than their banking repeat, as a ROM with address
+ * lines left unconnected would.
+ */
+
+#ifndef __BANK_MODEL_H__
+#define __BANK_MODEL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cart_sim.h"
+
+#define MODEL_ANY           -3      // any answer will do (past the end of an XEX)
+
+typedef struct {
+    int cart_type;          // CART_TYPE_* of atari_cart.c
+    const char *name;
+    int car_type;           // .CAR type, 0 for no cartridge, -1 for an XEX
+    uint32_t size;
+} MODEL_CART;
+
+extern const MODEL_CART model_carts[];
+extern const int num_model_carts;
+
+typedef struct {
+    const MODEL_CART *cart;
+    const uint8_t *image;
+    uint32_t size;          // of image, the .XEX file for an XEX
+    // banking registers
+    bool on;
+    int bank, bank2;
+    uint8_t reg;
+    uint16_t page;          // XEX loader
+    // what they select
+    int win[4];             // image offset at $8000,$9000,$A000,$B000, or WIN_*
+    uint32_t rd;
+} MODEL;
+
+void model_reset(MODEL *m, const MODEL_CART *cart, const uint8_t *image, uint32_t size);
+// what the cartridge answers cycle c with (SIM_FLOAT, SIM_NONE for writes, MODEL_ANY
+// or a byte), and whatever the cycle does to the banking
+int model_cycle(MODEL *m, const SIM_CYCLE *c);
+
+#endif
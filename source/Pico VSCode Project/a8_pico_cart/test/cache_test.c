@@ -0,0 +1,216 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * bank_cache.c on the simulated flash
+ *
+ * A 256k image is written to the flash drive 8k at a time between the clusters
+ * of another file, so it is fragmented (as much as bank_cache_open() takes,
+ * with the fragments out of step with the blocks), and served through a cache
+ * of a few slots, with the DMA moving on a random number of words between
+ * reads. Random sets of pages are mapped, far more than fit, so slots are
+ * taken over while their fills are queued or still running. Every byte read
+ * through a window is checked against the image, and a window left NULL is
+ * read the way the XEX loader does, once bank_cache_ready() says its slot is
+ * filled. bank_cache_map() mustn't wait for a fill, so a window it leaves NULL
+ * has to have one running and mustn't be ready, and once the DMA has had the
+ * time for the fills bank_cache_poll() has to have pointed every mapped window
+ * at its slot.
+ *
+ * A 256k image made of as many different 8k banks as there are slots, the
+ * others copies of them, fits (bank_cache_fits()), the random one doesn't.
+ * Once it is preloaded, a jump into any bank straight after switching to it
+ * has to find it in SRAM, with no fill running.
+ *
+ * usage: cache_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ff.h"
+#include "fatfs_disk.h"
+#include "hardware/dma.h"
+#include "bank_cache.h"
+
+#define CAR_HEADER_SIZE     16
+#define IMAGE_SIZE          (256 * 1024)
+#define PAGES               (IMAGE_SIZE / 4096)
+#define SLOT_SIZE           (17 * 512)          // of bank_cache.c
+#define SLOTS               5
+#define MAPS                3000
+#define READS               40                  // after each map
+
+static uint32_t seed = 1;
+
+static uint32_t rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static int errors;
+
+#define FAIL(...)   do { if (errors++ < 10) { printf("  "); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint8_t file[CAR_HEADER_SIZE + IMAGE_SIZE];
+static uint8_t same[CAR_HEADER_SIZE + IMAGE_SIZE];
+static unsigned char mem[SLOTS * SLOT_SIZE];
+
+// the image is written 8k at a time between the clusters of another file
+static bool write_drive(FATFS *fs)
+{
+    FIL fil, pad;
+    UINT bw;
+
+    create_fatfs_disk();
+    if (f_mount(fs, "", 1) != FR_OK)
+        return false;
+    uint32_t cluster = fs->csize * FF_MIN_SS, chunk = 8192;
+    bool ok = f_open(&fil, "/BIG.CAR", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK &&
+        f_open(&pad, "/PAD.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK;
+    for (uint32_t pos = 0; ok && pos < sizeof(file); pos += chunk) {
+        uint32_t len = sizeof(file) - pos < chunk ? sizeof(file) - pos : chunk;
+        ok = f_write(&fil, file + pos, len, &bw) == FR_OK && bw == len &&
+            f_write(&pad, file, cluster, &bw) == FR_OK && bw == cluster;
+    }
+    ok = ok && f_close(&fil) == FR_OK && f_close(&pad) == FR_OK;
+    return ok && f_open(&fil, "/SAME.CAR", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK &&
+        f_write(&fil, same, sizeof(same), &bw) == FR_OK && bw == sizeof(same) && f_close(&fil) == FR_OK;
+}
+
+static int image_byte(const uint8_t *image, uint16_t page, uint offset)
+{
+    return page == BANK_CACHE_PAGE_NONE || page >= PAGES ? -1 : image[CAR_HEADER_SIZE + page * 4096 + offset];
+}
+
+static void random_pages(uint16_t *pages)
+{
+    for (int i = 0; i < 4; i++) {
+        uint32_t r = rnd();
+        pages[i] = r % 8 == 0 ? BANK_CACHE_PAGE_NONE : r % 16 == 1 ? PAGES + 1 : (r >> 4) % PAGES;
+    }
+}
+
+// the image made of SLOTS different banks, preloaded, jumped about in
+static void test_same()
+{
+    FIL fil;
+    uint16_t pages[4] = { 0, 1, 2, 3 };
+    unsigned char *win[4];
+
+    if (f_open(&fil, "/SAME.CAR", FA_READ) != FR_OK || !bank_cache_open(&fil, IMAGE_SIZE)) {
+        FAIL("bank_cache_open() turned the image of copies down");
+        return;
+    }
+    if (!bank_cache_fits(sizeof(mem)))
+        FAIL("the image of copies doesn't fit");
+    if (bank_cache_fits(sizeof(mem) - SLOT_SIZE))
+        FAIL("the image of copies fits a slot short");
+    host_dma_reset();
+    bank_cache_start(mem, sizeof(mem), pages, true);
+    host_dma_run(1);    // the null trigger at the end of the last fill
+    for (int m = 0; m < MAPS; m++) {
+        random_pages(pages);
+        bank_cache_map(pages, win);
+        if (host_dma_busy())
+            FAIL("jump %d: a fill is running", m);
+        for (int i = 0; i < 4; i++) {
+            if ((image_byte(same, pages[i], 0) >= 0) != (win[i] != NULL)) {
+                FAIL("jump %d: window %d of page $%X is %s", m, i, pages[i], win[i] ? "mapped" : "NULL");
+                continue;
+            }
+            for (int r = 0; r < READS / 4 && win[i]; r++) {
+                uint offset = rnd() % 4096;
+                if (win[i][offset] != image_byte(same, pages[i], offset))
+                    FAIL("jump %d: page $%X offset $%03X read as %d instead of %d", m, pages[i], offset,
+                        win[i][offset], image_byte(same, pages[i], offset));
+            }
+        }
+    }
+}
+
+int main()
+{
+    FATFS fs;
+    FIL fil;
+    uint16_t pages[4] = { 0, 1, BANK_CACHE_PAGE_NONE, BANK_CACHE_PAGE_NONE };
+    unsigned char *win[4];
+    int jumps = 0, waits = 0;
+
+    for (uint32_t i = 0; i < sizeof(file); i++)
+        file[i] = rnd();
+    for (uint32_t block = 0; block < IMAGE_SIZE / 8192; block++) {
+        uint32_t from = block < SLOTS ? block : rnd() % SLOTS;
+        for (uint32_t i = 0; i < 8192; i++)
+            same[CAR_HEADER_SIZE + block * 8192 + i] = block < SLOTS ? rnd() : same[CAR_HEADER_SIZE + from * 8192 + i];
+    }
+    if (!write_drive(&fs) || f_open(&fil, "/BIG.CAR", FA_READ) != FR_OK) {
+        printf("can't write the test drive\n");
+        return 1;
+    }
+    if (!bank_cache_open(&fil, IMAGE_SIZE)) {
+        printf("bank_cache_open() turned the image down\n");
+        return 1;
+    }
+    if (bank_cache_fits(sizeof(mem)))
+        FAIL("the random image fits");
+    bank_cache_start(mem, sizeof(mem), pages, false);
+
+    for (int m = 0; m < MAPS; m++) {
+        random_pages(pages);
+        bank_cache_map(pages, win);
+        for (int i = 0; i < 4; i++) {
+            if (image_byte(file, pages[i], 0) < 0 && (win[i] || !bank_cache_ready(i)))
+                FAIL("map %d: window %d of page $%X isn't NULL and ready", m, i, pages[i]);
+            else if (image_byte(file, pages[i], 0) >= 0 && !win[i] && (!host_dma_busy() || bank_cache_ready(i)))
+                FAIL("map %d: window %d of page $%X is NULL with no fill running for it", m, i, pages[i]);
+        }
+
+        for (int r = 0; r < READS; r++) {
+            int i = rnd() % 4;
+            uint offset = rnd() % 4096;
+            int want = image_byte(file, pages[i], offset);
+            if (!win[i] && want >= 0) {
+                // a jump into a bank still being filled, wait for it as the loader does
+                jumps++;
+                for (int n = 0; !bank_cache_ready(i) && n < SLOTS * SLOT_SIZE / 4; n += 16) {
+                    host_dma_run(16);
+                    bank_cache_poll(win);
+                }
+                if (!win[i]) {
+                    FAIL("map %d: window %d of page $%X not ready after every fill", m, i, pages[i]);
+                    continue;
+                }
+            }
+            int got = win[i] ? win[i][offset] : -1;
+            if (got != want)
+                FAIL("map %d: page $%X offset $%03X read as %d instead of %d", m, pages[i], offset, got, want);
+            host_dma_run(rnd() % 64);
+        }
+
+        // now and then give the DMA time for every fill there is
+        if (m % 16 == 15) {
+            for (int n = 0; n < SLOTS * SLOT_SIZE / 4; n += 256) {
+                host_dma_run(256);
+                bank_cache_poll(win);
+            }
+            for (int i = 0; i < 4; i++)
+                if (image_byte(file, pages[i], 0) >= 0 && !win[i])
+                    FAIL("map %d: window %d of page $%X still NULL", m, i, pages[i]);
+            waits++;
+        }
+    }
+    printf("%d maps, %d jumps into a bank still being filled, %d waits for the fills\n", MAPS, jumps, waits);
+    test_same();
+    printf("%s\n", errors ? "FAILED" : "passed");
+    return errors != 0;
+}
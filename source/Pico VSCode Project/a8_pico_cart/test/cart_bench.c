@@ -0,0 +1,381 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * atari_cart.c on the simulated bus, for every cartridge type
+ *
+ * Each type's image is written to the simulated flash drive and loaded with
+ * load_file(), as the menu would, then emulate_cartridge() runs against a
+ * pseudo random trace of 6502 bus cycles (see cart_sim.h): runs of reads
+ * through $8000-$BFFF, bank switches by $D5xx reads and writes, RAM accesses
+ * the cartridge isn't selected for, and S4/S5 coming and going with RD4/RD5.
+ *
+ * Every answer and every RD4/RD5 change is checked against the reference
+ * model of the banking (see bank_model.h), and for each type the benchmark
+ * reports the accesses simulated a second, the host time and instructions
+ * (from the CPU's counters, where the kernel allows) per access, with the
+ * simulator on its own as the first line to take off, and the worst case from a read being
+ * handed over to the engine to its answer, and from a write to the engine
+ * being ready for the next cycle. The worst cases are the least seen over a
+ * few runs, which keeps the host's interrupts out of them. They are host
+ * times, an engine change that doubles them doubles its part of the
+ * phi2-to-data time on the Pico (see ENGINE_CLOCKS_* in atari_cart.c).
+ *
+ * Types over 128k are served from the bank cache (see bank_cache.h), which
+ * has to hold all of an image, so theirs are 12 different banks padded out
+ * with copies of them. The XEX loader reads the file front to back and waits
+ * for each page as A8PicoCart.asm does, a few polls of the wait page, or the
+ * time for every fill when it goes back to the start. XEX files also report
+ * the reads that came while a bank was being filled, which are checked like
+ * any other.
+ *
+ * usage: cart_bench [cycles]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "ff.h"
+#include "fatfs_disk.h"
+#include "atari_cart.h"
+#include "atari_bus.h"
+#include "cart_sim.h"
+#include "bank_model.h"
+
+// atari_cart.c, for the tests only
+int load_file(char *filename);
+void emulate_cartridge(int cartType);
+extern char errorBuf[40];
+
+#define DEFAULT_CYCLES  100000
+#define RUNS            3
+#define XEX_SIZE        300000
+
+static uint32_t seed = 1;
+
+static uint32_t rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static uint8_t *images[64];
+static uint32_t image_size[64];
+static char file_name[64][16];
+
+static void make_xex(uint8_t *x, uint32_t size)
+{
+    uint32_t pos = 0;
+    uint16_t addr = 0x2000;
+    while (pos < size) {
+        uint32_t len = 1 + rnd() % 4096;
+        if (pos == 0)
+            x[pos++] = 0xFF, x[pos++] = 0xFF;
+        if (pos + 4 + len > size) {
+            // pad the last segment to the size, at least a byte of data
+            if (pos + 5 > size)
+                pos = size - 5;
+            len = size - pos - 4;
+        }
+        if (rnd() % 16 == 0 && len >= 2) {
+            addr = 0x02E2;  // INITAD
+            len = 2;
+        }
+        else if (addr == 0x02E2 || addr + len > 0xC000)
+            addr = 0x2000;
+        uint16_t end = addr + len - 1;
+        x[pos++] = addr & 0xFF;
+        x[pos++] = addr >> 8;
+        x[pos++] = end & 0xFF;
+        x[pos++] = end >> 8;
+        for (uint32_t i = 0; i < len; i++)
+            x[pos++] = rnd();
+        addr += len;
+    }
+}
+
+// every image written to the drive, before atari_cart.c mounts it
+static bool write_images()
+{
+    FATFS fs;
+    create_fatfs_disk();
+    if (f_mount(&fs, "", 1) != FR_OK)
+        return false;
+    for (int c = 0; c < num_model_carts; c++) {
+        const MODEL_CART *cart = &model_carts[c];
+        uint8_t header[16] = { 'C', 'A', 'R', 'T' };
+        uint32_t size = cart->car_type < 0 ? XEX_SIZE : cart->size;
+        images[c] = malloc(size ? size : 1);
+        image_size[c] = size;
+        if (cart->car_type < 0)
+            make_xex(images[c], size);
+        else
+            for (uint32_t i = 0; i < size; i++)
+                images[c][i] = size <= 128 * 1024 || i < 12 * 8192 ? rnd() :
+                    images[c][i % 8192 + 8192 * ((i / 8192) % 12)];
+        if (cart->car_type == 0)
+            continue;
+        sprintf(file_name[c], cart->car_type < 0 ? "/T%02d.XEX" : "/T%02d.CAR", c);
+        FIL fil;
+        UINT bw;
+        if (f_open(&fil, file_name[c], FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+            return false;
+        header[7] = cart->car_type;
+        if ((cart->car_type > 0 && (f_write(&fil, header, 16, &bw) != FR_OK || bw != 16)) ||
+                f_write(&fil, images[c], size, &bw) != FR_OK || bw != size)
+            return false;
+        f_close(&fil);
+    }
+    f_mount(0, "", 0);
+    return true;
+}
+
+// what the Atari does with a cartridge in, the XEX loader's page reads in place of
+// bank switches for an XEX
+static void make_trace(SIM_CYCLE *t, int n, bool loader, uint32_t pages)
+{
+    int i = 0;
+    uint32_t next_page = 0;
+#define CYCLE(a, w, d)  do { if (i < n) t[i++] = (SIM_CYCLE){ (a), (d), (w) }; } while (0)
+    while (i < n) {
+        uint32_t r = rnd() % 100;
+        if (r < 55) {
+            // code running from the cartridge
+            uint16_t addr = 0x8000 + rnd() % 0x4000;
+            for (int len = 4 + rnd() % 60; len; len--, addr = 0x8000 | ((addr + 1) & 0x3FFF))
+                CYCLE(addr, false, 0);
+        }
+        else if (r < 70) {
+            // RAM and the rest of the hardware
+            uint16_t addr = rnd();
+            while ((addr >= 0x8000 && addr < 0xC000) || (addr & 0xFF00) == 0xD500)
+                addr = rnd();
+            CYCLE(addr, rnd() & 1, rnd());
+        }
+        else if (r < 80) {
+            if (loader) {
+                uint16_t page = rnd() % 8 ? next_page++ % pages : 0x8000 | (rnd() % 32);
+                CYCLE(0xD500, true, page & 0xFF);
+                CYCLE(0xD501, true, page >> 8);
+                CYCLE(0xD501, true, 0x40);      // the wait page
+                for (int len = page ? 4 : 4000; len; len--)
+                    CYCLE(0xD500, false, 0);
+                CYCLE(0xD501, true, page >> 8);
+            }
+            else
+                CYCLE(0xD500 | (rnd() & 0xFF), true, rnd());
+        }
+        else if (r < 90) {
+            if (loader) {
+                uint16_t addr = rnd() & 0xFF;
+                for (int len = 16 + rnd() % 240; len; len--, addr = (addr + 1) & 0xFF)
+                    CYCLE(0xD500 | addr, false, 0);
+            }
+            else
+                CYCLE(0xD500 | (rnd() & 0xFF), false, 0);
+        }
+        else if (r < 95) {
+            // the Bounty Bob bank switches at the top of each 4k of $8000-$9FFF
+            CYCLE((rnd() & 1 ? 0x8FF6 : 0x9FF6) + rnd() % 4, rnd() % 4 == 0, rnd());
+        }
+        else
+            CYCLE(0x8000 + rnd() % 0x4000, true, rnd());
+    }
+#undef CYCLE
+}
+
+static const MODEL_CART *bench_cart;
+static int bench_file;
+static int load_errors;
+
+// load_file() again for every run, the engines move the image about in cart_ram
+static void load_cartridge()
+{
+    if (bench_cart->car_type && load_file(file_name[bench_file]) != bench_cart->cart_type) {
+        if (load_errors++ < 1)
+            printf("  load_file(\"%s\") failed: %s\n", file_name[bench_file], errorBuf);
+    }
+}
+
+static void run_cartridge()
+{
+    emulate_cartridge(bench_cart->cart_type);
+}
+
+// the simulator on its own: every cycle taken and every read floated
+static void null_engine()
+{
+    atari_bus_start();
+    while (1)
+        if (atari_bus_next() & SIM_RW_MASK)
+            atari_bus_float();
+}
+
+static int perf_open()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+typedef struct {
+    double ns;              // the best run
+    uint64_t instructions;  // 0 if there are no counters
+    int errors;
+} RUN_STATS;
+
+static int perf_fd = -1;
+
+static void timed_run(void (*engine)(void), void (*prepare)(void), const SIM_CYCLE *trace, int n,
+    SIM_RESULT *res, uint32_t *worst, RUN_STATS *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < n; i++)
+        worst[i] = 0xFFFFFFFF;
+    for (int run = 0; run < RUNS; run++) {
+        if (prepare)
+            prepare();
+        if (perf_fd >= 0) {
+            ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        uint64_t start = sim_clock();
+        int errors = sim_run(engine, trace, n, res);
+        double ns = (sim_clock() - start) * sim_clock_ns();
+        if (perf_fd >= 0) {
+            uint64_t count = 0;
+            ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(perf_fd, &count, sizeof(count)) == sizeof(count) &&
+                    (!stats->instructions || count < stats->instructions))
+                stats->instructions = count;
+        }
+        if (!run || ns < stats->ns)
+            stats->ns = ns;
+        stats->errors += errors;
+        for (int i = 0; i < n; i++)
+            if (res[i].engine && res[i].clocks < worst[i])
+                worst[i] = res[i].clocks;
+    }
+}
+
+// the last run against the model, returns the number of differences
+static int check(const MODEL_CART *cart, const uint8_t *image, uint32_t size, const SIM_CYCLE *trace, int n,
+    const SIM_RESULT *res, int *filling)
+{
+    MODEL m;
+    int wrong = 0;
+    bool cached = cart->car_type < 0 || cart->size > 128 * 1024;
+
+    *filling = 0;
+    model_reset(&m, cart, image, size);
+    for (int i = 0; i < n; i++) {
+        uint32_t rd = m.rd;
+        int want = model_cycle(&m, &trace[i]);
+        if (res[i].rd != rd) {
+            if (wrong++ < 5)
+                printf("  cycle %d ($%04X): RD4/RD5 %d%d instead of %d%d\n", i, trace[i].addr,
+                    !!(res[i].rd & SIM_RD4_MASK), !!(res[i].rd & SIM_RD5_MASK),
+                    !!(rd & SIM_RD4_MASK), !!(rd & SIM_RD5_MASK));
+        }
+        else if (want != MODEL_ANY && res[i].answer != want) {
+            if (wrong++ < 5)
+                printf("  cycle %d: %s $%04X answered with %d instead of %d%s\n", i,
+                    trace[i].write ? "write" : "read", trace[i].addr, res[i].answer, want,
+                    res[i].filling ? " while filling" : "");
+        }
+        if (cached && res[i].filling && !trace[i].write && want >= 0)
+            (*filling)++;
+    }
+    return wrong;
+}
+
+static void print_stats(const char *name, int n, const RUN_STATS *stats, uint32_t worst_read,
+    uint32_t worst_write, const char *result)
+{
+    char ins[16] = "-";
+    if (stats->instructions)
+        snprintf(ins, sizeof(ins), "%.1f", (double)stats->instructions / n);
+    printf("%-22s %11.0f %9.1f %9s %8.0fns %8.0fns  %s\n", name, n / stats->ns * 1e9, stats->ns / n, ins,
+        worst_read * sim_clock_ns(), worst_write * sim_clock_ns(), result);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : DEFAULT_CYCLES;
+    SIM_CYCLE *trace = malloc(n * sizeof(SIM_CYCLE));
+    SIM_RESULT *res = malloc(n * sizeof(SIM_RESULT));
+    uint32_t *worst = malloc(n * sizeof(uint32_t));
+    RUN_STATS stats;
+    int failed = 0;
+
+    if (n <= 0 || !trace || !res || !worst) {
+        fprintf(stderr, "usage: %s [cycles]\n", argv[0]);
+        return 2;
+    }
+    if (!write_images()) {
+        printf("can't write the images to the flash drive\n");
+        return 1;
+    }
+    perf_fd = perf_open();
+    printf("%d cycles a type, BUS_EARLY=%d, %s\n", n, BUS_EARLY,
+        perf_fd >= 0 ? "instructions from the CPU's counters" : "no instruction counters");
+    printf("%-22s %11s %9s %9s %10s %10s  %s\n", "", "accesses/s", "ns/access", "ins/access",
+        "worst read", "worst write", "against the model");
+
+    make_trace(trace, n, false, 0);
+    timed_run(null_engine, NULL, trace, n, res, worst, &stats);
+    print_stats("(the simulator alone)", n, &stats, 0, 0, "");
+
+    for (int c = 0; c < num_model_carts; c++) {
+        const MODEL_CART *cart = &model_carts[c];
+
+        make_trace(trace, n, cart->car_type < 0, (image_size[c] + 4 + 255) / 256);
+        bench_cart = cart;
+        bench_file = c;
+        load_errors = 0;
+        timed_run(run_cartridge, load_cartridge, trace, n, res, worst, &stats);
+
+        int filling;
+        int wrong = check(cart, images[c], image_size[c], trace, n, res, &filling);
+        uint32_t worst_read = 0, worst_write = 0;
+        for (int i = 0; i < n; i++) {
+            if (worst[i] == 0xFFFFFFFF)
+                continue;
+            if (trace[i].write && worst[i] > worst_write)
+                worst_write = worst[i];
+            else if (!trace[i].write && worst[i] > worst_read)
+                worst_read = worst[i];
+        }
+        char result[48];
+        int errors = wrong + stats.errors + load_errors;
+        if (errors)
+            snprintf(result, sizeof(result), "%d wrong", errors);
+        else
+            strcpy(result, "ok");
+        if (filling)
+            snprintf(result + strlen(result), sizeof(result) - strlen(result), ", %d read while filling", filling);
+        print_stats(cart->name, n, &stats, worst_read, worst_write, result);
+        if (errors)
+            failed++;
+    }
+    printf("%s\n", failed ? "FAILED" : "passed");
+    return failed != 0;
+}
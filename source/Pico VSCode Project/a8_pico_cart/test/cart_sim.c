@@ -0,0 +1,318 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Simulated cartridge port for running atari_cart.c on the host (see cart_sim.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+
+#include "atari_bus.h"
+#include "hardware/dma.h"
+#include "hardware/sync.h"
+#include "cart_sim.h"
+
+uint32_t sim_rd;
+unsigned sim_cpu_clocks;
+// a 32 bit read from the XIP alias that doesn't allocate is a QSPI command of its
+// own, about 20 flash clocks at sys/2: 2 words a 6502 cycle at 150MHz
+unsigned sim_dma_words = 2;
+
+typedef enum {
+    BUS_STOPPED,    // nothing answers
+    BUS_RUNNING,    // the engine answers every cycle
+    BUS_SLEEPING,   // the engine waits in atari_bus_next_cctl()
+    BUS_ROM,        // the PIO and DMA answer from the ROM windows
+} BUS_MODE;
+
+static struct {
+    const SIM_CYCLE *trace;
+    SIM_RESULT *res;
+    int n;
+    int next;           // cycle to hand over next
+    int pending;        // read waiting for its answer, -1 for none
+    int handled;        // write being handled, -1 for none
+    int early;          // BUS_EARLY cycle whose address was handed over, -1 for none
+    uint32_t early_addr;
+    uint64_t since;     // sim_clock() the cycle was handed over at
+    BUS_MODE mode;
+    bool start_early;
+    const uint8_t *rom[2];
+    int errors;
+    jmp_buf end;
+} sim;
+
+#define FAIL(...)   do { if (sim.errors++ < 10) { printf("  cycle %d: ", sim.next - 1); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+uint64_t sim_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+double sim_clock_ns()
+{
+    static double ns;
+    if (!ns) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        uint64_t c0 = sim_clock();
+        do
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+        while ((t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec < 20000000);
+        uint64_t c1 = sim_clock();
+        ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + t1.tv_nsec - t0.tv_nsec) / (c1 - c0);
+    }
+    return ns;
+}
+
+// the pins of a cycle, with S4/S5 only for the windows RD4/RD5 are high for
+static uint32_t cycle_pins(const SIM_CYCLE *c)
+{
+    uint32_t pins = (c->addr & SIM_ADDR_MASK) | SIM_CCTL_MASK | SIM_S4_MASK | SIM_S5_MASK;
+    if (c->write)
+        pins |= (uint32_t)c->data << 13;
+    else
+        pins |= SIM_RW_MASK | SIM_PHI2_MASK;
+    if ((c->addr & 0xFF00) == 0xD500)
+        pins &= ~SIM_CCTL_MASK;
+    else if ((c->addr & 0xE000) == 0x8000 && (sim_rd & SIM_RD4_MASK))
+        pins &= ~SIM_S4_MASK;
+    else if ((c->addr & 0xE000) == 0xA000 && (sim_rd & SIM_RD5_MASK))
+        pins &= ~SIM_S5_MASK;
+    return pins;
+}
+
+// the next cycle of the trace, ends the run once there are no more
+static int take_cycle(bool engine)
+{
+    if (sim.pending >= 0) {
+        FAIL("read of $%04X not answered", sim.trace[sim.pending].addr);
+        sim.res[sim.pending].answer = SIM_FLOAT;
+        sim.pending = -1;
+    }
+    if (sim.handled >= 0) {
+        sim.res[sim.handled].clocks = sim_clock() - sim.since;
+        sim.handled = -1;
+    }
+    if (sim.next == sim.n)
+        longjmp(sim.end, 1);
+    host_dma_run(sim_dma_words);
+    int i = sim.next++;
+    SIM_RESULT *r = &sim.res[i];
+    r->pins = cycle_pins(&sim.trace[i]);
+    r->rd = sim_rd;
+    r->engine = engine;
+    r->filling = host_dma_busy();
+    r->answer = sim.trace[i].write ? SIM_NONE : SIM_FLOAT;
+    if (engine) {
+        if (sim.trace[i].write)
+            sim.handled = i;
+        else
+            sim.pending = i;
+    }
+    return i;
+}
+
+// a cycle the engine doesn't see
+static void pass_cycle()
+{
+    int i = take_cycle(false);
+    uint32_t pins = sim.res[i].pins;
+    if (sim.mode == BUS_ROM && (pins & SIM_RW_MASK)) {
+        const uint8_t *rom = !(pins & SIM_S4_MASK) ? sim.rom[0] : !(pins & SIM_S5_MASK) ? sim.rom[1] : NULL;
+        if (rom)
+            sim.res[i].answer = rom[pins & SIM_ADDR_MASK];
+    }
+}
+
+static void answer(int data)
+{
+    if (sim.pending < 0) {
+        FAIL("answered with no read to answer");
+        return;
+    }
+    sim.res[sim.pending].answer = data;
+    sim.res[sim.pending].clocks = sim_clock() - sim.since;
+    sim.pending = -1;
+}
+
+int sim_run(void (*engine)(void), const SIM_CYCLE *trace, int n, SIM_RESULT *res)
+{
+    memset(&sim, 0, sizeof(sim));
+    memset(res, 0, n * sizeof(SIM_RESULT));
+    sim.trace = trace;
+    sim.res = res;
+    sim.n = n;
+    sim.pending = sim.handled = sim.early = -1;
+    sim.mode = BUS_STOPPED;
+    host_dma_reset();
+    if (!setjmp(sim.end)) {
+        engine();
+        FAIL("engine returned");
+    }
+    return sim.errors;
+}
+
+/* atari_bus.h */
+
+void atari_bus_init()
+{
+}
+
+void atari_bus_clock(uint cpu_clocks)
+{
+    sim_cpu_clocks = cpu_clocks;
+}
+
+void atari_bus_clock_early(uint cpu_clocks)
+{
+    sim_cpu_clocks = cpu_clocks;
+}
+
+void atari_bus_start()
+{
+    sim.mode = BUS_RUNNING;
+    sim.start_early = false;
+}
+
+void atari_bus_start_early()
+{
+    sim.mode = BUS_RUNNING;
+    sim.start_early = true;
+}
+
+void atari_bus_stop()
+{
+    sim.mode = BUS_STOPPED;
+}
+
+void atari_bus_sleep()
+{
+    sim.mode = BUS_SLEEPING;
+}
+
+uint32_t atari_bus_next_cctl()
+{
+    if (sim.mode != BUS_SLEEPING)
+        FAIL("atari_bus_next_cctl() without atari_bus_sleep()");
+    while (1) {
+        // the $D5xx watch only passes the cycle on, it doesn't answer reads
+        int i = take_cycle(false);
+        if (!(sim.res[i].pins & SIM_CCTL_MASK)) {
+            sim.res[i].engine = true;
+            sim.since = sim_clock();
+            sim.handled = i;
+            return sim.res[i].pins;
+        }
+    }
+}
+
+void atari_rom_start(const uint8_t *s4_window, const uint8_t *s5_window)
+{
+    sim.mode = BUS_ROM;
+    sim.rom[0] = s4_window;
+    sim.rom[1] = s5_window;
+}
+
+uint32_t atari_bus_next()
+{
+    if (sim.mode != BUS_RUNNING || sim.start_early)
+        FAIL("atari_bus_next() without atari_bus_start()");
+    int i = take_cycle(true);
+    sim.since = sim_clock();
+    return sim.res[i].pins;
+}
+
+void atari_bus_drive(uint8_t data)
+{
+    answer(data);
+}
+
+void atari_bus_float()
+{
+    answer(SIM_FLOAT);
+}
+
+void atari_bus_drive_late(uint8_t data)
+{
+    answer(data);
+}
+
+uint32_t atari_bus_next_address()
+{
+    if (sim.mode != BUS_RUNNING || !sim.start_early)
+        FAIL("atari_bus_next_address() without atari_bus_start_early()");
+    sim.early = take_cycle(false);
+    sim.early_addr = sim.trace[sim.early].addr & SIM_ADDR_MASK;
+    sim.since = sim_clock();
+    return sim.early_addr;
+}
+
+void atari_bus_prefetch(uint32_t s4, uint32_t s5)
+{
+    if (sim.early < 0) {
+        FAIL("atari_bus_prefetch() without an address");
+        return;
+    }
+    SIM_RESULT *r = &sim.res[sim.early];
+    if ((r->pins & SIM_RW_MASK) && !atari_bus_late(r->pins, sim.early_addr)) {
+        uint32_t d = !(r->pins & SIM_S4_MASK) ? s4 : s5;
+        r->answer = d & 1 ? (int)((d >> 1) & 0xFF) : SIM_FLOAT;
+        r->clocks = sim_clock() - sim.since;
+    }
+}
+
+uint32_t atari_bus_next_early()
+{
+    if (sim.early < 0) {
+        FAIL("atari_bus_next_early() without atari_bus_next_address()");
+        return 0;
+    }
+    int i = sim.early;
+    SIM_RESULT *r = &sim.res[i];
+    sim.early = -1;
+    r->engine = true;
+    if (sim.trace[i].write)
+        sim.handled = i;
+    else if (atari_bus_late(r->pins, sim.early_addr))
+        sim.pending = i;
+    sim.since = sim_clock();
+    return r->pins;
+}
+
+void atari_bus_rd(uint32_t mask, uint32_t levels)
+{
+    sim_rd = (sim_rd & ~mask) | (levels & mask);
+}
+
+/* hardware/sync.h */
+
+// nothing left for the CPU to do, the rest of the trace goes by without it
+void __wfi(void)
+{
+    if (sim.mode == BUS_RUNNING)
+        FAIL("waiting with the bus running");
+    while (1)
+        pass_cycle();
+}
+
+void __wfe(void)
+{
+    __wfi();
+}
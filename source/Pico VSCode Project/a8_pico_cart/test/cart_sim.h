@@ -0,0 +1,76 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Simulated cartridge port for running atari_cart.c on the host
+ *
+ * Host builds of the firmware (PICO_NO_HARDWARE, see test/host) get the calls
+ * of atari_bus.h from here instead of from the PIO. A trace of 6502 bus cycles
+ * is handed to the engine a cycle at a time, with S4 and S5 decoded from the
+ * address and the RD4/RD5 levels the engine has set, as the MMU would, and
+ * every answer is recorded against its cycle along with how long it took.
+ * Reads the PIO and DMA answer by themselves (atari_rom_start(), and the
+ * prefetch of BUS_EARLY) are answered here, and once the engine sleeps or
+ * stops, the rest of the trace goes by without it. The run ends when the trace
+ * does, wherever the engine is.
+ *
+ * The flash DMA of the bank cache moves on sim_dma_words transfers a cycle.
+ */
+
+#ifndef __CART_SIM_H__
+#define __CART_SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIM_ADDR_MASK       0x00001FFF
+#define SIM_DATA_MASK       0x001FE000
+#define SIM_CCTL_MASK       0x00200000
+#define SIM_PHI2_MASK       0x00400000
+#define SIM_RW_MASK         0x00800000
+#define SIM_S4_MASK         0x01000000
+#define SIM_S5_MASK         0x02000000
+#define SIM_RD4_MASK        0x04000000
+#define SIM_RD5_MASK        0x08000000
+
+#define SIM_FLOAT           -1      // the data bus was left alone
+#define SIM_NONE            -2      // no answer, for writes
+
+typedef struct {
+    uint16_t addr;
+    uint8_t data;           // written
+    bool write;
+} SIM_CYCLE;
+
+typedef struct {
+    uint32_t pins;          // as the PIO would sample them
+    uint32_t rd;            // RD4/RD5 levels during the cycle
+    int answer;             // byte driven, SIM_FLOAT or SIM_NONE
+    bool engine;            // handed to the engine, rather than gone by while it slept
+    bool filling;           // the DMA was busy, a bank cache fill was in progress
+    uint32_t clocks;        // sim_clock() from handing the cycle over to its answer, or
+                            // for a write to the next cycle being asked for
+} SIM_RESULT;
+
+// RD4/RD5 as the engine left them, they stay set from one run to the next
+extern uint32_t sim_rd;
+// the clock the engine last asked for with atari_bus_clock(), in CPU clocks
+extern unsigned sim_cpu_clocks;
+extern unsigned sim_dma_words;
+
+// run engine against the n cycles of trace, until they run out. Returns the number
+// of times the engine broke the rules of atari_bus.h (with the first few printed)
+int sim_run(void (*engine)(void), const SIM_CYCLE *trace, int n, SIM_RESULT *res);
+
+// fine grained host time, and its length in ns
+uint64_t sim_clock();
+double sim_clock_ns();
+
+#endif
@@ -0,0 +1,332 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * The chunked directory listing of atari_cart.c against a plain sort
+ *
+ * A folder of a few thousand entries is made on the simulated flash drive
+ * (see host/host_sdk.c), far more than one chunk holds: long names that only
+ * differ after the 31 characters kept, names that share their first four
+ * characters, 8.3 names, folders, and files the menu doesn't list. Every
+ * entry of read_directory() and search_directory() is checked against the
+ * same listing read with FatFs and sorted with qsort() and strcasecmp(),
+ * paging forwards, backwards and jumping about, so each chunk is picked from
+ * either side. A small folder is read again to check the copy kept of it
+ * (recent_keep()), and again after a file is added to it. The preview shown
+ * as a search is typed (search_preview()) is walked to the end, its results
+ * in order and matches at every slice, and has to end up with the top of the
+ * same search, also when the text changes part way through the walk.
+ *
+ * usage: dir_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "ff.h"
+#include "fatfs_disk.h"
+
+// atari_cart.c, for the tests only
+typedef struct {
+    char isDir;
+    char filename[13];
+    char long_filename[32];
+    char full_path[210];
+} DIR_ENTRY;
+int read_directory(char *path);
+int search_directory(char *path, char *search);
+DIR_ENTRY *get_dir_entry(int n);
+int search_preview(char *path, char *search);
+DIR_ENTRY *get_preview_entry(int n);
+extern int num_dir_entries;
+
+#define BIG_FILES       5000
+#define BIG_DIRS        40
+#define SMALL_FILES     30
+#define MAX_ENTRIES     (BIG_FILES + BIG_DIRS + SMALL_FILES + 100)
+#define JUMPS           60
+#define PREVIEW_RESULTS 10
+
+static uint32_t seed = 1;
+
+static uint32_t rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static DIR_ENTRY ref[MAX_ENTRIES];
+static int ref_count, errors;
+
+#define FAIL(...)   do { if (errors++ < 10) { printf("  "); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static bool make_file(const char *path)
+{
+    FIL fil;
+    if (f_open(&fil, path, FA_CREATE_NEW | FA_WRITE) != FR_OK)
+        return false;
+    f_close(&fil);
+    return true;
+}
+
+static bool make_drive()
+{
+    static const char *const ext[] = { "xex", "CAR", "rom", "Atr", "txt", "bin" };
+    FATFS fs;
+    char path[128];
+    bool ok = true;
+
+    create_fatfs_disk();
+    if (f_mount(&fs, "", 1) != FR_OK)
+        return false;
+    ok &= f_mkdir("/BIG") == FR_OK && f_mkdir("/SMALL") == FR_OK;
+    for (int i = 0; i < BIG_DIRS && ok; i++) {
+        sprintf(path, "/BIG/Folder %d of the games", i);
+        ok &= f_mkdir(path) == FR_OK;
+        for (int j = 0; j < 3 && ok; j++) {
+            sprintf(path, "/BIG/Folder %d of the games/Game %d.xex", i, j);
+            ok &= make_file(path);
+        }
+    }
+    for (int i = 0; i < BIG_FILES && ok; i++) {
+        const char *e = ext[rnd() % 6];
+        switch (rnd() % 4) {
+        case 0:     // told apart after the 31 characters kept, by the 8.3 name
+            sprintf(path, "/BIG/Games of the year collection %05u.%s", rnd() % 100000, e);
+            break;
+        case 1:
+            sprintf(path, "/BIG/G%u.%s", rnd() % 1000000, e);
+            break;
+        case 2:
+            sprintf(path, "/BIG/game %u %c.%s", rnd() % 10000, 'a' + rnd() % 26, e);
+            break;
+        default:
+            sprintf(path, "/BIG/%c%c%c %u.%s", 'A' + rnd() % 26, 'a' + rnd() % 3, 'A' + rnd() % 3, rnd() % 1000, e);
+            break;
+        }
+        FRESULT res = f_stat(path, NULL);
+        if (res == FR_NO_FILE)
+            ok &= make_file(path);
+    }
+    for (int i = 0; i < SMALL_FILES && ok; i++) {
+        sprintf(path, "/SMALL/Small game %d.car", i);
+        ok &= make_file(path);
+    }
+    f_mount(0, "", 0);
+    return ok;
+}
+
+static int ref_compare(const void *p1, const void *p2)
+{
+    const DIR_ENTRY *e1 = p1, *e2 = p2;
+    if (e1->isDir != e2->isDir)
+        return e2->isDir - e1->isDir;
+    int ret = strcasecmp(e1->long_filename, e2->long_filename);
+    if (!ret)
+        ret = strcmp(e1->full_path, e2->full_path);
+    if (!ret)
+        ret = strcmp(e1->filename, e2->filename);
+    return ret;
+}
+
+static bool listed(const FILINFO *fno)
+{
+    const char *dot = strrchr(fno->fname, '.');
+    if (fno->fattrib & AM_DIR)
+        return true;
+    return dot && (!strcasecmp(dot, ".car") || !strcasecmp(dot, ".rom") ||
+        !strcasecmp(dot, ".xex") || !strcasecmp(dot, ".atr"));
+}
+
+static void ref_add(const FILINFO *fno, int isDir, const char *path)
+{
+    DIR_ENTRY *e = &ref[ref_count++];
+    e->isDir = isDir;
+    snprintf(e->long_filename, sizeof(e->long_filename), "%.31s", fno->fname);
+    snprintf(e->filename, sizeof(e->filename), "%.12s", fno->altname[0] ? fno->altname : fno->fname);
+    snprintf(e->full_path, sizeof(e->full_path), "%s", path);
+}
+
+// the folder at path as the menu lists it
+static void ref_directory(const char *path)
+{
+    DIR dir;
+    FILINFO fno;
+    ref_count = 0;
+    if (f_opendir(&dir, path) != FR_OK)
+        return;
+    while (f_readdir(&dir, &fno) == FR_OK && fno.fname[0])
+        if (listed(&fno))
+            ref_add(&fno, fno.fattrib & AM_DIR ? 1 : 0, "");
+    f_closedir(&dir);
+    qsort(ref, ref_count, sizeof(DIR_ENTRY), ref_compare);
+}
+
+// the files under path holding text, the ones that start with it first
+static void ref_search(char *path, const char *text)
+{
+    DIR dir;
+    FILINFO fno;
+    if (f_opendir(&dir, path) != FR_OK)
+        return;
+    while (f_readdir(&dir, &fno) == FR_OK && fno.fname[0]) {
+        if (fno.fattrib & AM_DIR) {
+            size_t len = strlen(path);
+            sprintf(path + len, "/%s", fno.altname[0] ? fno.altname : fno.fname);
+            ref_search(path, text);
+            path[len] = 0;
+        }
+        else if (listed(&fno)) {
+            for (const char *s = fno.fname; *s; s++)
+                if (!strncasecmp(s, text, strlen(text))) {
+                    ref_add(&fno, s == fno.fname, path);
+                    break;
+                }
+        }
+    }
+    f_closedir(&dir);
+}
+
+static void check_entry(const char *what, int n, bool search)
+{
+    DIR_ENTRY *e = get_dir_entry(n);
+    const DIR_ENTRY *r = &ref[n];
+    if (!e)
+        FAIL("%s: entry %d missing", what, n);
+    else if (e->isDir != (search ? 0 : r->isDir) || strcmp(e->long_filename, r->long_filename) ||
+            strcmp(e->filename, r->filename) || strcmp(e->full_path, r->full_path))
+        FAIL("%s: entry %d is %d \"%s\" (%s) in \"%s\" instead of %d \"%s\" (%s) in \"%s\"", what, n,
+            e->isDir, e->long_filename, e->filename, e->full_path,
+            r->isDir, r->long_filename, r->filename, r->full_path);
+}
+
+static void check_listing(const char *what, bool search, bool jump)
+{
+    if (num_dir_entries != ref_count) {
+        FAIL("%s: %d entries instead of %d", what, num_dir_entries, ref_count);
+        return;
+    }
+    for (int n = 0; n < ref_count; n++)
+        check_entry(what, n, search);
+    if (!jump)
+        return;
+    for (int n = ref_count - 1; n >= 0; n--)
+        check_entry(what, n, search);
+    for (int i = 0; i < JUMPS; i++) {
+        int n = rnd() % ref_count;
+        for (int page = 0; page < 15 && n + page < ref_count; page++)
+            check_entry(what, n + page, search);
+    }
+    if (get_dir_entry(ref_count))
+        FAIL("%s: an entry past the end", what);
+}
+
+// the results of the whole search for text, as ref_search() and the search listing have them
+static void ref_sorted(const char *text)
+{
+    char path[256] = "";
+    ref_count = 0;
+    ref_search(path, text);
+    qsort(ref, ref_count, sizeof(DIR_ENTRY), ref_compare);
+}
+
+static bool ref_has(const DIR_ENTRY *e)
+{
+    for (int n = 0; n < ref_count; n++)
+        if (!ref_compare(e, &ref[n]) && e->isDir == ref[n].isDir)
+            return true;
+    return false;
+}
+
+// walk the preview for text to the end, after half the walk for first
+static void check_preview(const char *first, const char *text)
+{
+    char path[256] = "";
+    int slices = 0;
+
+    for (int i = 0; first && i < 2500 && search_preview(path, (char *)first); i++)
+        ;
+    ref_sorted(text);
+    for (int more = 1; more; slices++) {
+        more = search_preview(path, (char *)text);
+        for (int n = 0; get_preview_entry(n); n++) {
+            const DIR_ENTRY *e = get_preview_entry(n);
+            if (slices % 64 == 0 && !ref_has(e))
+                FAIL("preview \"%s\": \"%s\" in \"%s\" isn't a result", text, e->long_filename, e->full_path);
+            else if (n && ref_compare(get_preview_entry(n - 1), e) >= 0)
+                FAIL("preview \"%s\": result %d out of order", text, n);
+        }
+    }
+    int shown = ref_count < PREVIEW_RESULTS ? ref_count : PREVIEW_RESULTS;
+    printf("preview \"%s\"%s%s%s: %d slices\n", text, first ? " after \"" : "", first ? first : "",
+        first ? "\"" : "", slices);
+    for (int n = 0; n < shown; n++) {
+        const DIR_ENTRY *e = get_preview_entry(n), *r = &ref[n];
+        if (!e || e->isDir != r->isDir || strcmp(e->long_filename, r->long_filename) ||
+                strcmp(e->filename, r->filename) || strcmp(e->full_path, r->full_path))
+            FAIL("preview \"%s\": result %d is \"%s\" in \"%s\" instead of \"%s\" in \"%s\"", text, n,
+                e ? e->long_filename : "", e ? e->full_path : "", r->long_filename, r->full_path);
+    }
+    if (get_preview_entry(shown))
+        FAIL("preview \"%s\": a result past the end", text);
+}
+
+int main()
+{
+    char path[256];
+
+    if (!make_drive()) {
+        printf("can't make the test drive\n");
+        return 1;
+    }
+
+    strcpy(path, "/BIG");
+    if (!read_directory(path))
+        FAIL("read_directory(\"/BIG\") failed");
+    ref_directory("/BIG");
+    printf("/BIG: %d entries\n", ref_count);
+    check_listing("/BIG", false, true);
+
+    const char *texts[] = { "game", "of the year", "1", "zzzz" };
+    for (int i = 0; i < 4; i++) {
+        strcpy(path, "");
+        ref_count = 0;
+        ref_search(path, texts[i]);
+        qsort(ref, ref_count, sizeof(DIR_ENTRY), ref_compare);
+        strcpy(path, "");
+        if (!search_directory(path, (char *)texts[i]))
+            FAIL("search_directory(\"%s\") failed", texts[i]);
+        printf("search \"%s\": %d entries\n", texts[i], ref_count);
+        check_listing(texts[i], true, ref_count > 0);
+    }
+
+    check_preview(NULL, "game");
+    check_preview("game", "game 1");
+    check_preview("Small", "of the year");
+    check_preview(NULL, "zzzz");
+
+    // read, kept, read from the copy kept, then read again for the new file
+    for (int pass = 0; pass < 3; pass++) {
+        if (pass == 2 && !make_file("/SMALL/Another game.xex"))
+            FAIL("can't add to /SMALL");
+        strcpy(path, "/SMALL");
+        if (!read_directory(path))
+            FAIL("read_directory(\"/SMALL\") failed");
+        ref_directory("/SMALL");
+        check_listing(pass == 0 ? "/SMALL" : pass == 1 ? "/SMALL again" : "/SMALL added to", false, false);
+        strcpy(path, "/BIG");
+        read_directory(path);
+    }
+
+    printf("%s\n", errors ? "FAILED" : "passed");
+    return errors != 0;
+}
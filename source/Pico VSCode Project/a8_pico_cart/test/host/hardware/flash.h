@@ -0,0 +1,13 @@
+// host stand-in for the Pico SDK header of the same name, see host_sdk.c
+#ifndef _HARDWARE_FLASH_H
+#define _HARDWARE_FLASH_H
+
+#include "pico/stdlib.h"
+
+#define FLASH_PAGE_SIZE     256u
+#define FLASH_SECTOR_SIZE   4096u
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+#endif
@@ -0,0 +1,10 @@
+// host stand-in for the Pico SDK header of the same name, nothing in the host
+// build touches the PIO (see the PICO_NO_HARDWARE side of atari_bus.h)
+#ifndef _HARDWARE_PIO_H
+#define _HARDWARE_PIO_H
+
+#include "pico/stdlib.h"
+
+#define PIO1_IRQ_0          9
+
+#endif
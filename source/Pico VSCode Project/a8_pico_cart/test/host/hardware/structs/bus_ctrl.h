@@ -0,0 +1,16 @@
+// host stand-in for the Pico SDK header of the same name, see host_sdk.c
+#ifndef _HARDWARE_STRUCTS_BUS_CTRL_H
+#define _HARDWARE_STRUCTS_BUS_CTRL_H
+
+#include "pico/stdlib.h"
+
+#define BUSCTRL_BUS_PRIORITY_PROC1_BITS 0x00000010
+
+typedef struct {
+    volatile uint32_t priority, priority_ack;
+} bus_ctrl_hw_t;
+
+extern bus_ctrl_hw_t host_bus_ctrl_hw;
+#define bus_ctrl_hw (&host_bus_ctrl_hw)
+
+#endif
@@ -0,0 +1,14 @@
+// host stand-in for the Pico SDK header of the same name, see host_sdk.c
+#ifndef _HARDWARE_STRUCTS_SYSTICK_H
+#define _HARDWARE_STRUCTS_SYSTICK_H
+
+#include "pico/stdlib.h"
+
+typedef struct {
+    volatile uint32_t csr, rvr, cvr, calib;
+} systick_hw_t;
+
+extern systick_hw_t host_systick_hw;
+#define systick_hw  (&host_systick_hw)
+
+#endif
@@ -0,0 +1,16 @@
+// host stand-in for the Pico SDK header of the same name, see host_sdk.c
+#ifndef _HARDWARE_SYNC_H
+#define _HARDWARE_SYNC_H
+
+#include "pico/stdlib.h"
+
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+
+// waiting for an event or interrupt hands over to the simulated bus (see cart_sim.c)
+void __wfi(void);
+void __wfe(void);
+static inline void __sev(void) {}
+static inline void __dmb(void) { __sync_synchronize(); }
+
+#endif
@@ -0,0 +1,16 @@
+// host stand-in for the Pico SDK header of the same name, see host_sdk.c
+#ifndef _HARDWARE_TIMER_H
+#define _HARDWARE_TIMER_H
+
+#include "pico/stdlib.h"
+
+typedef struct {
+    volatile uint32_t timehw, timelw, timehr, timelr;
+    volatile uint32_t alarm[4];
+    volatile uint32_t armed, timerawh, timerawl;
+} timer_hw_t;
+
+extern timer_hw_t host_timer_hw;
+#define timer_hw    (&host_timer_hw)
+
+#endif
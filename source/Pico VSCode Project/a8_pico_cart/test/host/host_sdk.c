@@ -0,0 +1,314 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Host stand-ins for the parts of the Pico SDK the firmware uses (see the
+ * headers next to this file), for the tests in test/
+ *
+ * The flash is 16MB of memory mapped at XIP_BASE and its other XIP aliases,
+ * the same addresses as on the chip, so the firmware's XIP pointers work as they
+ * are. Erasing sets bits and programming can only clear them, as on the chip.
+ * The DMA channels copy a transfer at a time as the simulated time goes by,
+ * chaining and triggering each other through their registers.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include "hardware/flash.h"
+#include "hardware/dma.h"
+#include "hardware/timer.h"
+#include "hardware/structs/systick.h"
+#include "hardware/structs/bus_ctrl.h"
+
+#undef dma_hw
+
+timer_hw_t host_timer_hw;
+systick_hw_t host_systick_hw;
+bus_ctrl_hw_t host_bus_ctrl_hw;
+
+/* FLASH */
+
+__attribute__((constructor)) static void flash_map()
+{
+    static const uint32_t alias[] = { XIP_BASE, XIP_NOALLOC_BASE, XIP_NOCACHE_BASE, XIP_NOCACHE_NOALLOC_BASE };
+    int fd = memfd_create("flash", 0);
+    if (fd < 0 || ftruncate(fd, PICO_FLASH_SIZE_BYTES) != 0) {
+        perror("flash");
+        exit(2);
+    }
+    for (int i = 0; i < 4; i++) {
+        void *p = mmap((void *)(uintptr_t)alias[i], PICO_FLASH_SIZE_BYTES, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+        if (p != (void *)(uintptr_t)alias[i]) {
+            fprintf(stderr, "can't map the flash at %08X\n", alias[i]);
+            exit(2);
+        }
+    }
+    memset((void *)(uintptr_t)XIP_BASE, 0xFF, PICO_FLASH_SIZE_BYTES);
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count)
+{
+    if (flash_offs % FLASH_SECTOR_SIZE || count % FLASH_SECTOR_SIZE || flash_offs + count > PICO_FLASH_SIZE_BYTES) {
+        fprintf(stderr, "flash_range_erase(%08X, %zu) isn't whole sectors\n", flash_offs, count);
+        abort();
+    }
+    memset((void *)(uintptr_t)(XIP_BASE + flash_offs), 0xFF, count);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count)
+{
+    if (flash_offs % FLASH_PAGE_SIZE || count % FLASH_PAGE_SIZE || flash_offs + count > PICO_FLASH_SIZE_BYTES) {
+        fprintf(stderr, "flash_range_program(%08X, %zu) isn't whole pages\n", flash_offs, count);
+        abort();
+    }
+    uint8_t *flash = (uint8_t *)(uintptr_t)(XIP_BASE + flash_offs);
+    for (size_t i = 0; i < count; i++)
+        flash[i] &= data[i];
+}
+
+uint32_t save_and_disable_interrupts(void)
+{
+    return 0;
+}
+
+void restore_interrupts(uint32_t status)
+{
+    (void)status;
+}
+
+/* TIME */
+
+uint64_t time_us_64(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t time_us_32(void)
+{
+    return time_us_64();
+}
+
+absolute_time_t get_absolute_time(void)
+{
+    return time_us_64();
+}
+
+absolute_time_t make_timeout_time_ms(uint32_t ms)
+{
+    return time_us_64() + (uint64_t)ms * 1000;
+}
+
+bool time_reached(absolute_time_t t)
+{
+    return time_us_64() >= t;
+}
+
+void sleep_ms(uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+/* MULTICORE */
+
+void (*host_core1_entry)(void);
+
+void multicore_launch_core1(void (*entry)(void))
+{
+    host_core1_entry = entry;
+}
+
+void multicore_reset_core1(void)
+{
+    host_core1_entry = NULL;
+}
+
+/* DMA */
+
+#define DMA_CTRL_EN             0x00000001
+#define DMA_CTRL_DATA_SIZE_LSB  2
+#define DMA_CTRL_INCR_READ      0x00000010
+#define DMA_CTRL_INCR_WRITE     0x00000020
+#define DMA_CTRL_CHAIN_TO_LSB   11
+#define DMA_CTRL_CHAIN_TO_BITS  0x00007800
+
+static dma_hw_t dma;
+static struct {
+    uint32_t reload;        // TRANS_COUNT as written, the count restarts from it on a trigger
+    bool busy;
+} chan[NUM_DMA_CHANNELS];
+static uint claimed;
+
+static void dma_trigger(uint ch)
+{
+    if (dma.ch[ch].ctrl_trig & DMA_CTRL_EN) {
+        dma.ch[ch].transfer_count = chan[ch].reload;
+        chan[ch].busy = chan[ch].reload != 0;
+    }
+}
+
+// a write to one of the registers of channel ch, as the DMA itself would make it
+static void dma_register_write(uint ch, uint32_t offset, uint32_t value)
+{
+    volatile uint32_t *reg = (volatile uint32_t *)((uint8_t *)&dma.ch[ch] + offset);
+    *reg = value;
+    switch (offset / 4) {
+    case 0: case 5: case 10: case 15:   // READ_ADDR and its aliases
+        dma.ch[ch].read_addr = value;
+        break;
+    case 1: case 6: case 11: case 13:   // WRITE_ADDR
+        dma.ch[ch].write_addr = value;
+        break;
+    case 2: case 7: case 9: case 14:    // TRANS_COUNT
+        chan[ch].reload = value;
+        break;
+    case 3: case 4: case 8: case 12:    // CTRL
+        dma.ch[ch].ctrl_trig = value;
+        break;
+    }
+    // the last register of each alias triggers the channel, unless it's written with 0
+    if (offset / 4 % 4 == 3 && value)
+        dma_trigger(ch);
+}
+
+// one transfer of the lowest numbered busy channel
+static void dma_step()
+{
+    for (uint ch = 0; ch < NUM_DMA_CHANNELS; ch++) {
+        if (!chan[ch].busy)
+            continue;
+        dma_channel_hw_t *c = &dma.ch[ch];
+        uint32_t ctrl = c->ctrl_trig, size = 1u << ((ctrl >> DMA_CTRL_DATA_SIZE_LSB) & 3);
+        uint32_t value = 0;
+        memcpy(&value, (const void *)(uintptr_t)c->read_addr, size);
+        uintptr_t regs = (uintptr_t)&dma.ch[0];
+        if (c->write_addr >= regs && c->write_addr < regs + sizeof(dma.ch))
+            dma_register_write((c->write_addr - regs) / sizeof(dma_channel_hw_t),
+                (c->write_addr - regs) % sizeof(dma_channel_hw_t), value);
+        else
+            memcpy((void *)(uintptr_t)c->write_addr, &value, size);
+        if (ctrl & DMA_CTRL_INCR_READ)
+            c->read_addr += size;
+        if (ctrl & DMA_CTRL_INCR_WRITE)
+            c->write_addr += size;
+        if (--c->transfer_count == 0) {
+            chan[ch].busy = false;
+            uint chain = (ctrl & DMA_CTRL_CHAIN_TO_BITS) >> DMA_CTRL_CHAIN_TO_LSB;
+            if (chain != ch)
+                dma_trigger(chain);
+        }
+        return;
+    }
+}
+
+dma_hw_t *host_dma_hw(void)
+{
+    dma_step();
+    return &dma;
+}
+
+void host_dma_run(uint words)
+{
+    while (words--)
+        dma_step();
+}
+
+bool host_dma_busy(void)
+{
+    for (uint ch = 0; ch < NUM_DMA_CHANNELS; ch++)
+        if (chan[ch].busy)
+            return true;
+    return false;
+}
+
+void host_dma_reset(void)
+{
+    memset(&dma, 0, sizeof(dma));
+    memset(chan, 0, sizeof(chan));
+    claimed = 0;
+}
+
+int dma_claim_unused_channel(bool required)
+{
+    for (uint ch = 0; ch < NUM_DMA_CHANNELS; ch++) {
+        if (!(claimed & (1u << ch))) {
+            claimed |= 1u << ch;
+            return ch;
+        }
+    }
+    if (required) {
+        fprintf(stderr, "no DMA channels left\n");
+        abort();
+    }
+    return -1;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel)
+{
+    dma_channel_config c = { DMA_CTRL_EN | DMA_CTRL_INCR_READ | (DMA_SIZE_32 << DMA_CTRL_DATA_SIZE_LSB) |
+        (channel << DMA_CTRL_CHAIN_TO_LSB) };
+    return c;
+}
+
+void channel_config_set_read_increment(dma_channel_config *c, bool incr)
+{
+    c->ctrl = incr ? c->ctrl | DMA_CTRL_INCR_READ : c->ctrl & ~DMA_CTRL_INCR_READ;
+}
+
+void channel_config_set_write_increment(dma_channel_config *c, bool incr)
+{
+    c->ctrl = incr ? c->ctrl | DMA_CTRL_INCR_WRITE : c->ctrl & ~DMA_CTRL_INCR_WRITE;
+}
+
+void channel_config_set_chain_to(dma_channel_config *c, uint chain_to)
+{
+    c->ctrl = (c->ctrl & ~DMA_CTRL_CHAIN_TO_BITS) | (chain_to << DMA_CTRL_CHAIN_TO_LSB);
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size)
+{
+    c->ctrl = (c->ctrl & ~(3u << DMA_CTRL_DATA_SIZE_LSB)) | (size << DMA_CTRL_DATA_SIZE_LSB);
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+    const volatile void *read_addr, uint transfer_count, bool trigger)
+{
+    dma.ch[channel].read_addr = (uintptr_t)read_addr;
+    dma.ch[channel].write_addr = (uintptr_t)write_addr;
+    chan[channel].reload = transfer_count;
+    dma.ch[channel].ctrl_trig = config->ctrl;
+    if (trigger)
+        dma_trigger(channel);
+}
+
+void dma_channel_set_read_addr(uint channel, const volatile void *read_addr, bool trigger)
+{
+    dma.ch[channel].read_addr = (uintptr_t)read_addr;
+    if (trigger)
+        dma_trigger(channel);
+}
+
+void dma_channel_set_write_addr(uint channel, volatile void *write_addr, bool trigger)
+{
+    dma.ch[channel].write_addr = (uintptr_t)write_addr;
+    if (trigger)
+        dma_trigger(channel);
+}
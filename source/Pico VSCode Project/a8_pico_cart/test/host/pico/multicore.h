@@ -0,0 +1,14 @@
+// host stand-in for the Pico SDK header of the same name, see host_sdk.c
+#ifndef _PICO_MULTICORE_H
+#define _PICO_MULTICORE_H
+
+#include "pico/stdlib.h"
+
+// core1 doesn't run by itself, host_core1_entry is what was launched on it for the
+// test to run (see cart_sim.h)
+extern void (*host_core1_entry)(void);
+
+void multicore_launch_core1(void (*entry)(void));
+void multicore_reset_core1(void);
+
+#endif
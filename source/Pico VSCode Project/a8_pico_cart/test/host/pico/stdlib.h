@@ -0,0 +1,38 @@
+// host stand-in for the Pico SDK header of the same name, see host_sdk.c
+#ifndef _PICO_STDLIB_H
+#define _PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef PICO_NO_HARDWARE
+#define PICO_NO_HARDWARE    1
+#endif
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+// the flash is mapped at the same addresses as on the chip (see host_sdk.c),
+// which needs the tests linked with -no-pie for the 32 bit pointers
+#define XIP_BASE            0x10000000u
+#define XIP_NOALLOC_BASE    0x11000000u
+#define XIP_NOCACHE_BASE    0x12000000u
+#define XIP_NOCACHE_NOALLOC_BASE 0x13000000u
+#define PICO_FLASH_SIZE_BYTES (16 * 1024 * 1024)
+
+#define __not_in_flash_func(f)  f
+#define __time_critical_func(f) f
+#define __uninitialized_ram(v)  v
+#define __force_inline          inline __attribute__((always_inline))
+
+static inline void tight_loop_contents(void) {}
+
+void sleep_ms(uint32_t ms);
+uint32_t time_us_32(void);
+uint64_t time_us_64(void);
+absolute_time_t get_absolute_time(void);
+absolute_time_t make_timeout_time_ms(uint32_t ms);
+bool time_reached(absolute_time_t t);
+
+#endif
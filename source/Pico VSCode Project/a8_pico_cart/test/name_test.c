@@ -0,0 +1,135 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * name_match.c against plain C versions of the same
+ *
+ * Runs name_compare(), name_key(), name_ext() and the shift-and search of
+ * name_match() over pseudo random names, with both cases of the letters, the
+ * characters either side of A-Z and bytes over $7F in them, and checks each
+ * against the obvious character at a time code: strcasecmp() in the C locale
+ * for the compare, and a search that tries every position for the match.
+ * Patterns run up to NAME_PATTERN_MAX characters and past it.
+ *
+ * usage: name_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <locale.h>
+
+#include "name_match.h"
+
+#define NUM_NAMES   20000
+
+static uint32_t seed = 1;
+
+static uint32_t rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static int errors;
+
+#define FAIL(...)   do { if (errors++ < 10) { printf("  "); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+// a name from a small alphabet, so that searches find something
+static void make_name(char *s, int len)
+{
+    static const char chars[] = "aAbBzZ@[`{.. 9\xC1\xE1";
+    for (int i = 0; i < len; i++)
+        s[i] = chars[rnd() % (sizeof(chars) - 1)];
+    s[len] = 0;
+}
+
+static int fold(int c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+static const char *ref_match(const char *text, const char *name)
+{
+    size_t len = strlen(text);
+    if (len > NAME_PATTERN_MAX)
+        len = NAME_PATTERN_MAX;
+    for (const char *s = name; ; s++) {
+        size_t i = 0;
+        while (i < len && s[i] && fold((uint8_t)s[i]) == fold((uint8_t)text[i]))
+            i++;
+        if (i == len)
+            return s;
+        if (!*s)
+            return NULL;
+    }
+}
+
+static uint32_t ref_ext(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    if (!dot || dot == name || strlen(dot + 1) > 4)
+        return 0;
+    uint32_t ext = 0;
+    for (dot++; *dot; dot++)
+        ext = (ext << 8) | fold((uint8_t)*dot);
+    return ext;
+}
+
+static int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+int main()
+{
+    static NAME_PATTERN pattern;
+    char name[64], other[64], text[48], folded[64];
+
+    setlocale(LC_ALL, "C");
+    for (int n = 0; n < NUM_NAMES; n++) {
+        make_name(name, rnd() % 40);
+        make_name(other, rnd() % 40);
+        if (rnd() % 4 == 0)
+            strcpy(other, name);
+
+        if (sign(name_compare(name, other)) != sign(strcasecmp(name, other)))
+            FAIL("name_compare(\"%s\", \"%s\") is %d", name, other, name_compare(name, other));
+        uint32_t k1 = name_key(name), k2 = name_key(other);
+        if (k1 != k2 && sign(k1 < k2 ? -1 : 1) != sign(strcasecmp(name, other)))
+            FAIL("name_key() puts \"%s\" and \"%s\" the wrong way round", name, other);
+        if (name_ext(name) != ref_ext(name))
+            FAIL("name_ext(\"%s\") is %06X", name, name_ext(name));
+
+        uint32_t size = 1 + rnd() % 48;
+        name_fold(folded, name, size);
+        if (strlen(folded) != (strlen(name) < size ? strlen(name) : size - 1) ||
+                strncasecmp(folded, name, strlen(folded)))
+            FAIL("name_fold(\"%s\", %u) is \"%s\"", name, size, folded);
+
+        // a slice of the name, changed now and then, or a new text
+        int len = rnd() % (NAME_PATTERN_MAX + 8);
+        if (rnd() % 2 && strlen(name)) {
+            int start = rnd() % strlen(name);
+            snprintf(text, sizeof(text), "%.*s", len, name + start);
+            if (rnd() % 4 == 0 && text[0])
+                text[rnd() % strlen(text)] ^= 0x20;
+        }
+        else
+            make_name(text, len);
+        name_pattern(&pattern, text);
+        if (name_match(&pattern, name) != ref_match(text, name))
+            FAIL("name_match(\"%s\", \"%s\") at %ld", text, name,
+                name_match(&pattern, name) ? (long)(name_match(&pattern, name) - name) : -1L);
+    }
+    printf("%d names\n%s\n", NUM_NAMES, errors ? "FAILED" : "passed");
+    return errors != 0;
+}
@@ -0,0 +1,522 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Host model of an RP2040 PIO state machine, for the tests (see pio_sim.h)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "pio_sim.h"
+
+enum { PIO_SIM_JMP, PIO_SIM_WAIT, PIO_SIM_IN, PIO_SIM_OUT, PIO_SIM_PUSH, PIO_SIM_PULL, PIO_SIM_MOV, PIO_SIM_IRQ, PIO_SIM_SET };
+
+// jmp conditions
+enum { COND_ALWAYS, COND_NOT_X, COND_X_DEC, COND_NOT_Y, COND_Y_DEC, COND_X_NE_Y, COND_PIN, COND_NOT_OSRE };
+// wait sources
+enum { WAIT_GPIO, WAIT_PIN, WAIT_IRQ };
+// in/out/mov/set sources and destinations
+enum { LOC_PINS, LOC_X, LOC_Y, LOC_NULL, LOC_PINDIRS, LOC_PC, LOC_ISR, LOC_OSR };
+// irq modes
+enum { IRQ_SET, IRQ_CLEAR };
+
+#define MAX_TOKENS  8
+
+typedef struct {
+    const char *path;
+    int line;
+} SOURCE;
+
+static bool error(const SOURCE *src, const char *msg, const char *what)
+{
+    fprintf(stderr, "%s:%d: %s '%s'\n", src->path, src->line, msg, what);
+    return false;
+}
+
+static bool parse_number(const char *s, int *value)
+{
+    char *end;
+    if (!strncasecmp(s, "0b", 2))
+        *value = (int)strtol(s + 2, &end, 2);
+    else
+        *value = (int)strtol(s, &end, 0);
+    return *s && !*end;
+}
+
+static int location(const char *s)
+{
+    static const char *names[] = { "pins", "x", "y", "null", "pindirs", "pc", "isr", "osr" };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+        if (!strcasecmp(s, names[i]))
+            return i;
+    return -1;
+}
+
+// split a line into tokens on white space and commas, returns the count
+static int tokenise(char *line, char *tok[MAX_TOKENS])
+{
+    int n = 0;
+    for (char *s = strtok(line, " \t,\r\n"); s && n < MAX_TOKENS; s = strtok(NULL, " \t,\r\n"))
+        tok[n++] = s;
+    return n;
+}
+
+static bool parse_instr(const SOURCE *src, PIO_SIM_PROGRAM *prog, char **tok, int n, PIO_SIM_INSTR *in)
+{
+    int value;
+
+    memset(in, 0, sizeof(*in));
+    if (n > 1 && tok[n - 1][0] == '[') {
+        tok[n - 1][strlen(tok[n - 1]) - 1] = 0;
+        if (!parse_number(tok[n - 1] + 1, &value) || value > 31)
+            return error(src, "bad delay", tok[n - 1] + 1);
+        in->delay = value;
+        n--;
+    }
+
+    if (!strcasecmp(tok[0], "jmp")) {
+        static const char *conds[] = { "", "!x", "x--", "!y", "y--", "x!=y", "pin", "!osre" };
+        in->op = PIO_SIM_JMP;
+        if (n == 3) {
+            int c;
+            for (c = 1; c < (int)(sizeof(conds) / sizeof(conds[0])); c++)
+                if (!strcasecmp(tok[1], conds[c]))
+                    break;
+            if (c == sizeof(conds) / sizeof(conds[0]))
+                return error(src, "bad jmp condition", tok[1]);
+            in->arg = c;
+        }
+        else if (n != 2)
+            return error(src, "bad jmp", tok[0]);
+        int addr = pio_sim_label(prog, tok[n - 1]);
+        if (addr < 0 && !parse_number(tok[n - 1], &addr))
+            return error(src, "unknown label", tok[n - 1]);
+        in->addr = addr;
+    }
+    else if (!strcasecmp(tok[0], "wait")) {
+        in->op = PIO_SIM_WAIT;
+        if (n != 4 || !parse_number(tok[1], &value) || value > 1)
+            return error(src, "bad wait", tok[0]);
+        in->polarity = value;
+        if (!strcasecmp(tok[2], "gpio"))
+            in->arg = WAIT_GPIO;
+        else if (!strcasecmp(tok[2], "pin"))
+            in->arg = WAIT_PIN;
+        else if (!strcasecmp(tok[2], "irq"))
+            in->arg = WAIT_IRQ;
+        else
+            return error(src, "bad wait source", tok[2]);
+        if (!parse_number(tok[3], &value) || value > 31)
+            return error(src, "bad wait index", tok[3]);
+        in->count = value;
+    }
+    else if (!strcasecmp(tok[0], "in") || !strcasecmp(tok[0], "out")) {
+        in->op = tolower(tok[0][0]) == 'i' ? PIO_SIM_IN : PIO_SIM_OUT;
+        int loc = n == 3 ? location(tok[1]) : -1;
+        if (loc < 0 || (in->op == PIO_SIM_IN && (loc == LOC_PC || loc == LOC_PINDIRS)))
+            return error(src, "bad source/destination", n > 1 ? tok[1] : tok[0]);
+        if (!parse_number(tok[2], &value) || value < 1 || value > 32)
+            return error(src, "bad bit count", tok[2]);
+        if (in->op == PIO_SIM_IN)
+            in->arg = loc;
+        else
+            in->dest = loc;
+        in->count = value;
+    }
+    else if (!strcasecmp(tok[0], "push") || !strcasecmp(tok[0], "pull")) {
+        in->op = tolower(tok[0][1]) == 'u' && tolower(tok[0][2]) == 's' ? PIO_SIM_PUSH : PIO_SIM_PULL;
+        in->block = true;
+        for (int i = 1; i < n; i++) {
+            if (!strcasecmp(tok[i], "block"))
+                in->block = true;
+            else if (!strcasecmp(tok[i], "noblock"))
+                in->block = false;
+            else if (!strcasecmp(tok[i], in->op == PIO_SIM_PUSH ? "iffull" : "ifempty"))
+                in->cond = true;
+            else
+                return error(src, "bad push/pull option", tok[i]);
+        }
+    }
+    else if (!strcasecmp(tok[0], "mov")) {
+        in->op = PIO_SIM_MOV;
+        if (n != 3)
+            return error(src, "bad mov", tok[0]);
+        const char *s = tok[2];
+        if (*s == '~' || *s == '!')
+            in->mov_op = '~', s++;
+        else if (!strncmp(s, "::", 2))
+            in->mov_op = ':', s += 2;
+        int dest = location(tok[1]), loc = location(s);
+        if (dest < 0 || dest == LOC_NULL || dest == LOC_PINDIRS)
+            return error(src, "bad mov destination", tok[1]);
+        if (loc < 0 || loc == LOC_PINDIRS || loc == LOC_PC)
+            return error(src, "bad mov source", s);
+        in->dest = dest;
+        in->arg = loc;
+    }
+    else if (!strcasecmp(tok[0], "nop")) {
+        in->op = PIO_SIM_MOV;
+        in->dest = in->arg = LOC_Y;
+    }
+    else if (!strcasecmp(tok[0], "irq")) {
+        in->op = PIO_SIM_IRQ;
+        in->arg = IRQ_SET;
+        if (n == 3) {
+            if (!strcasecmp(tok[1], "clear"))
+                in->arg = IRQ_CLEAR;
+            else if (strcasecmp(tok[1], "set") && strcasecmp(tok[1], "nowait"))
+                return error(src, "bad irq mode", tok[1]);
+        }
+        else if (n != 2)
+            return error(src, "bad irq", tok[0]);
+        if (!parse_number(tok[n - 1], &value) || value > 7)
+            return error(src, "bad irq index", tok[n - 1]);
+        in->count = value;
+    }
+    else if (!strcasecmp(tok[0], "set")) {
+        in->op = PIO_SIM_SET;
+        int dest = n == 3 ? location(tok[1]) : -1;
+        if (dest != LOC_PINS && dest != LOC_X && dest != LOC_Y && dest != LOC_PINDIRS)
+            return error(src, "bad set destination", n > 1 ? tok[1] : tok[0]);
+        if (!parse_number(tok[2], &value) || value > 31)
+            return error(src, "bad set value", tok[2]);
+        in->dest = dest;
+        in->count = value;
+    }
+    else
+        return error(src, "unsupported instruction", tok[0]);
+    return true;
+}
+
+// two passes over the program, labels first
+bool pio_sim_load(PIO_SIM_PROGRAM *prog, const char *path, const char *name)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    memset(prog, 0, sizeof(*prog));
+
+    bool ok = true, found = false;
+    for (int pass = 0; pass < 2 && ok; pass++) {
+        char buf[256];
+        char *tok[MAX_TOKENS];
+        bool in_prog = false, in_sdk = false;
+        SOURCE src = { path, 0 };
+        prog->length = 0;
+        prog->wrap_target = 0;
+        prog->wrap = -1;
+        rewind(f);
+        while (ok && fgets(buf, sizeof(buf), f)) {
+            src.line++;
+            if (in_sdk) {
+                in_sdk = strncmp(buf, "%}", 2) != 0;
+                continue;
+            }
+            if (buf[0] == '%') {
+                in_sdk = true;
+                continue;
+            }
+            char *comment = strpbrk(buf, ";");
+            if (comment)
+                *comment = 0;
+            if ((comment = strstr(buf, "//")))
+                *comment = 0;
+            int n = tokenise(buf, tok);
+            if (!n)
+                continue;
+            if (!strcasecmp(tok[0], ".program")) {
+                in_prog = n == 2 && !strcmp(tok[1], name);
+                found |= in_prog;
+                continue;
+            }
+            if (!in_prog)
+                continue;
+            if (!strcasecmp(tok[0], ".wrap_target"))
+                prog->wrap_target = prog->length;
+            else if (!strcasecmp(tok[0], ".wrap"))
+                prog->wrap = prog->length - 1;
+            else if (!strcasecmp(tok[0], ".origin")) {
+                int origin;
+                if (n != 2 || !parse_number(tok[1], &origin) || origin != 0)
+                    ok = error(&src, "only .origin 0 is supported", n > 1 ? tok[1] : tok[0]);
+            }
+            else if (tok[0][0] == '.')
+                ok = error(&src, "unsupported directive", tok[0]);
+            else {
+                int t = !strcasecmp(tok[0], "public") ? 1 : 0;
+                size_t len = t < n ? strlen(tok[t]) : 0;
+                if (len && tok[t][len - 1] == ':') {
+                    tok[t][len - 1] = 0;
+                    if (pass == 0 && prog->num_labels < PIO_SIM_MAX_LABELS) {
+                        snprintf(prog->label[prog->num_labels].name, sizeof(prog->label[0].name), "%s", tok[t]);
+                        prog->label[prog->num_labels++].addr = prog->length;
+                    }
+                    t++;
+                }
+                else
+                    t = 0;
+                if (t < n) {
+                    if (prog->length == PIO_SIM_MAX_INSTR)
+                        ok = error(&src, "program too long", name);
+                    else if (pass == 1)
+                        ok = parse_instr(&src, prog, tok + t, n - t, &prog->instr[prog->length]);
+                    prog->length++;
+                }
+            }
+        }
+    }
+    fclose(f);
+    if (ok && !found) {
+        fprintf(stderr, "%s: no .program %s\n", path, name);
+        ok = false;
+    }
+    if (prog->wrap < 0)
+        prog->wrap = prog->length - 1;
+    return ok;
+}
+
+int pio_sim_label(const PIO_SIM_PROGRAM *prog, const char *name)
+{
+    for (int i = 0; i < prog->num_labels; i++)
+        if (!strcmp(prog->label[i].name, name))
+            return prog->label[i].addr;
+    return -1;
+}
+
+void pio_sim_init(PIO_SIM_SM *sm, const PIO_SIM_PROGRAM *prog, unsigned pc)
+{
+    memset(sm, 0, sizeof(*sm));
+    sm->prog = prog;
+    sm->out_count = 32;
+    sm->push_threshold = 32;
+    sm->pull_threshold = 32;
+    sm->in_shift_right = true;
+    sm->out_shift_right = true;
+    sm->osr_count = 32;     // empty
+    sm->pc = pc;
+    sm->io = &sm->own_io;
+}
+
+bool pio_sim_put(PIO_SIM_SM *sm, uint32_t data)
+{
+    if (sm->tx_level == PIO_SIM_FIFO_DEPTH)
+        return false;
+    sm->tx[sm->tx_level++] = data;
+    return true;
+}
+
+bool pio_sim_get(PIO_SIM_SM *sm, uint32_t *data)
+{
+    if (!sm->rx_level)
+        return false;
+    *data = sm->rx[0];
+    memmove(&sm->rx[0], &sm->rx[1], --sm->rx_level * sizeof(sm->rx[0]));
+    return true;
+}
+
+static uint32_t rotr(uint32_t v, unsigned n)
+{
+    n &= 31;
+    return n ? (v >> n) | (v << (32 - n)) : v;
+}
+
+static uint32_t mask(unsigned bits)
+{
+    return bits >= 32 ? 0xFFFFFFFF : (1u << bits) - 1;
+}
+
+static uint32_t reverse(uint32_t v)
+{
+    uint32_t r = 0;
+    for (int i = 0; i < 32; i++, v >>= 1)
+        r = (r << 1) | (v & 1);
+    return r;
+}
+
+static void write_pins(uint32_t *pins, unsigned base, unsigned count, uint32_t value)
+{
+    uint32_t m = rotr(mask(count), 32 - base);
+    *pins = (*pins & ~m) | (rotr(value, 32 - base) & m);
+}
+
+static uint32_t read_loc(PIO_SIM_SM *sm, int loc, uint32_t gpio)
+{
+    switch (loc) {
+    case LOC_PINS: return rotr(gpio, sm->in_base);
+    case LOC_X: return sm->x;
+    case LOC_Y: return sm->y;
+    case LOC_ISR: return sm->isr;
+    case LOC_OSR: return sm->osr;
+    default: return 0;
+    }
+}
+
+void pio_sim_clock(PIO_SIM_SM *sm, uint32_t gpio)
+{
+    const PIO_SIM_INSTR *in = &sm->prog->instr[sm->pc];
+    uint32_t seen = sm->sync[1];
+    sm->sync[1] = sm->sync[0];
+    sm->sync[0] = gpio;
+
+    if (sm->delay) {
+        sm->delay--;
+        return;
+    }
+
+    bool jump = false;
+    uint32_t data;
+    unsigned next = 0;
+
+    switch (in->op) {
+    case PIO_SIM_JMP:
+        switch (in->arg) {
+        case COND_ALWAYS: jump = true; break;
+        case COND_NOT_X: jump = !sm->x; break;
+        case COND_X_DEC: jump = sm->x != 0; sm->x--; break;
+        case COND_NOT_Y: jump = !sm->y; break;
+        case COND_Y_DEC: jump = sm->y != 0; sm->y--; break;
+        case COND_X_NE_Y: jump = sm->x != sm->y; break;
+        case COND_PIN: jump = (seen >> sm->jmp_pin) & 1; break;
+        case COND_NOT_OSRE: jump = sm->osr_count < sm->pull_threshold; break;
+        }
+        next = in->addr;
+        break;
+
+    case PIO_SIM_WAIT:
+        if (in->arg == WAIT_IRQ) {
+            if (((sm->io->irq >> in->count) & 1) != in->polarity)
+                return;
+            if (in->polarity)
+                sm->io->irq &= ~(1u << in->count);
+        }
+        else {
+            uint32_t level = in->arg == WAIT_GPIO ? seen : rotr(seen, sm->in_base);
+            if (((level >> in->count) & 1) != in->polarity)
+                return;
+        }
+        break;
+
+    case PIO_SIM_IN: {
+        unsigned count = sm->isr_count + in->count > 32 ? 32 : sm->isr_count + in->count;
+        if (sm->autopush && count >= sm->push_threshold && sm->rx_level == PIO_SIM_FIFO_DEPTH) {
+            sm->rxstall = true;
+            return;
+        }
+        data = read_loc(sm, in->arg, seen) & mask(in->count);
+        if (sm->in_shift_right)
+            sm->isr = (in->count == 32 ? 0 : sm->isr >> in->count) | (in->count == 32 ? data : data << (32 - in->count));
+        else
+            sm->isr = (in->count == 32 ? 0 : sm->isr << in->count) | data;
+        sm->isr_count = count;
+        if (sm->autopush && count >= sm->push_threshold) {
+            sm->rx[sm->rx_level++] = sm->isr;
+            sm->isr = 0;
+            sm->isr_count = 0;
+        }
+        break;
+    }
+
+    case PIO_SIM_OUT:
+        if (sm->out_shift_right) {
+            data = sm->osr & mask(in->count);
+            sm->osr = in->count == 32 ? 0 : sm->osr >> in->count;
+        }
+        else {
+            data = sm->osr >> (32 - in->count);
+            sm->osr = in->count == 32 ? 0 : sm->osr << in->count;
+        }
+        sm->osr_count = sm->osr_count + in->count > 32 ? 32 : sm->osr_count + in->count;
+        switch (in->dest) {
+        case LOC_PINS: write_pins(&sm->io->pins, sm->out_base, sm->out_count, data); break;
+        case LOC_PINDIRS: write_pins(&sm->io->pindirs, sm->out_base, sm->out_count, data); break;
+        case LOC_X: sm->x = data; break;
+        case LOC_Y: sm->y = data; break;
+        case LOC_ISR: sm->isr = data; sm->isr_count = in->count; break;
+        case LOC_PC: jump = true; next = data & 31; break;
+        }
+        break;
+
+    case PIO_SIM_PUSH:
+        if (in->cond && sm->isr_count < sm->push_threshold)
+            break;
+        if (sm->rx_level == PIO_SIM_FIFO_DEPTH) {
+            sm->rxstall = true;
+            if (in->block)
+                return;
+        }
+        else
+            sm->rx[sm->rx_level++] = sm->isr;
+        sm->isr = 0;
+        sm->isr_count = 0;
+        break;
+
+    case PIO_SIM_PULL:
+        if (in->cond && sm->osr_count < sm->pull_threshold)
+            break;
+        if (!sm->tx_level) {
+            sm->txstall = true;
+            if (in->block)
+                return;
+            sm->osr = sm->x;
+        }
+        else {
+            sm->osr = sm->tx[0];
+            memmove(&sm->tx[0], &sm->tx[1], --sm->tx_level * sizeof(sm->tx[0]));
+        }
+        sm->osr_count = 0;
+        break;
+
+    case PIO_SIM_MOV:
+        data = read_loc(sm, in->arg, seen);
+        if (in->mov_op == '~')
+            data = ~data;
+        else if (in->mov_op == ':')
+            data = reverse(data);
+        switch (in->dest) {
+        case LOC_PINS: write_pins(&sm->io->pins, sm->out_base, sm->out_count, data); break;
+        case LOC_X: sm->x = data; break;
+        case LOC_Y: sm->y = data; break;
+        case LOC_ISR: sm->isr = data; sm->isr_count = 0; break;
+        case LOC_OSR: sm->osr = data; sm->osr_count = 0; break;
+        case LOC_PC: jump = true; next = data & 31; break;
+        }
+        break;
+
+    case PIO_SIM_IRQ:
+        if (in->arg == IRQ_CLEAR)
+            sm->io->irq &= ~(1u << in->count);
+        else
+            sm->io->irq |= 1u << in->count;
+        break;
+
+    case PIO_SIM_SET:
+        switch (in->dest) {
+        case LOC_PINS: write_pins(&sm->io->pins, sm->set_base, sm->set_count, in->count); break;
+        case LOC_PINDIRS: write_pins(&sm->io->pindirs, sm->set_base, sm->set_count, in->count); break;
+        case LOC_X: sm->x = in->count; break;
+        case LOC_Y: sm->y = in->count; break;
+        }
+        break;
+    }
+
+    if (jump)
+        sm->pc = next;
+    else if ((int)sm->pc == sm->prog->wrap)
+        sm->pc = sm->prog->wrap_target;
+    else
+        sm->pc = (sm->pc + 1) % PIO_SIM_MAX_INSTR;
+    sm->delay = in->delay;
+}
@@ -0,0 +1,99 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * Host model of an RP2040 PIO state machine, for the tests
+ *
+ * Programs are loaded straight from the .pio source, so the tests run the same
+ * text pioasm assembles for the firmware. The state machine is stepped one
+ * system clock at a time against the GPIO levels the test puts on the pins,
+ * through the same 2 clock input synchroniser. Only what atari_bus.pio needs is
+ * covered: no side-set, autopull, status or exec.
+ */
+
+#ifndef __PIO_SIM_H__
+#define __PIO_SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PIO_SIM_MAX_INSTR   32
+#define PIO_SIM_MAX_LABELS  32
+#define PIO_SIM_FIFO_DEPTH  4
+
+typedef struct {
+    uint8_t op;         // PIO_SIM_JMP...
+    uint8_t arg;        // jmp condition, wait source, in/mov source, irq mode
+    uint8_t dest;       // out/mov/set destination
+    uint8_t mov_op;     // 0, '~' or ':' (bit reverse)
+    uint8_t count;      // bit count, wait/irq index, set value
+    uint8_t addr;       // jmp target
+    uint8_t delay;
+    bool polarity;      // wait
+    bool block;         // push/pull
+    bool cond;          // push iffull, pull ifempty
+} PIO_SIM_INSTR;
+
+typedef struct {
+    PIO_SIM_INSTR instr[PIO_SIM_MAX_INSTR];
+    int length;
+    int wrap_target;
+    int wrap;
+    int num_labels;
+    struct {
+        char name[32];
+        int addr;
+    } label[PIO_SIM_MAX_LABELS];
+} PIO_SIM_PROGRAM;
+
+// what the state machines of one PIO share: the output latches (the last one
+// to write a pin wins) and the IRQ flags
+typedef struct {
+    uint32_t pins, pindirs;
+    uint8_t irq;
+} PIO_SIM_IO;
+
+typedef struct {
+    const PIO_SIM_PROGRAM *prog;
+    // configuration, as the program's _program_init() in the .pio file sets it
+    unsigned in_base;
+    unsigned out_base, out_count;
+    unsigned set_base, set_count;
+    unsigned jmp_pin;
+    bool in_shift_right, autopush;
+    unsigned push_threshold;
+    bool out_shift_right;
+    unsigned pull_threshold;
+    // state
+    unsigned pc, delay;
+    uint32_t x, y, isr, osr;
+    unsigned isr_count, osr_count;
+    uint32_t rx[PIO_SIM_FIFO_DEPTH], tx[PIO_SIM_FIFO_DEPTH];
+    unsigned rx_level, tx_level;
+    bool rxstall, txstall;      // FDEBUG, sticky until cleared
+    uint32_t sync[2];           // input synchroniser
+    PIO_SIM_IO *io;             // its own, unless pointed at one shared with other state machines
+    PIO_SIM_IO own_io;
+} PIO_SIM_SM;
+
+// load .program name from a .pio file, false (with a message) on anything unsupported
+bool pio_sim_load(PIO_SIM_PROGRAM *prog, const char *path, const char *name);
+// address of a label, -1 if there isn't one
+int pio_sim_label(const PIO_SIM_PROGRAM *prog, const char *name);
+
+// a state machine with the SDK's default config, about to run from pc
+void pio_sim_init(PIO_SIM_SM *sm, const PIO_SIM_PROGRAM *prog, unsigned pc);
+// one system clock with gpio on the pins
+void pio_sim_clock(PIO_SIM_SM *sm, uint32_t gpio);
+
+bool pio_sim_put(PIO_SIM_SM *sm, uint32_t data);
+bool pio_sim_get(PIO_SIM_SM *sm, uint32_t *data);
+
+#endif
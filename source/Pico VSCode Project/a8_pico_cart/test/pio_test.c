@@ -0,0 +1,299 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * atari_bus.pio against a scripted 6502 bus
+ *
+ * Runs the atari_bus state machine (see pio_sim.h) on a pseudo random mix of
+ * read, write and unselected cycles at 250MHz and a 1.79MHz phi2, with a CPU
+ * that answers every sample a fixed number of clocks after it turns up in the
+ * RX FIFO. Checks that every cycle is sampled once on the right edge, that the
+ * data bus is only ever driven in the phi2 high half of a read the CPU answered
+ * (and for ATARI_BUS_RELEASE_CLOCKS after it), that it carries the answer when
+ * phi2 falls if the CPU kept within its budget, and that the PIO latency stays
+ * within ATARI_BUS_READ_CLOCKS. The CPU delay runs on past phi2 falling, where
+ * answers have to be dropped rather than driven into the phi2 low half, and
+ * each one dropped has to be flagged (ATARI_BUS_DROP_IRQ) for BUS_TIMING.
+ *
+ * usage: pio_test atari_bus.pio
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pio_sim.h"
+
+// ATARI_BUS_READ_CLOCKS, ATARI_BUS_RELEASE_CLOCKS and ATARI_BUS_DROP_IRQ come from
+// atari_bus.h (see CMakeLists.txt)
+
+// one 6502 cycle, in system clocks at 250MHz: phi2 falls at 0 and rises half way
+#define CYCLE_CLOCKS    140
+#define PHI2_RISE       70
+#define ADDR_VALID      10      // after phi2 falls, until the same point of the next cycle
+#define WRITE_VALID     (PHI2_RISE + 25)
+#define WRITE_HOLD      3       // after phi2 falls
+// an answer that reaches the TX FIFO just as phi2 falls can still get past the
+// phi2 check through the input synchroniser, the data bus must be free this soon
+#define RACE_CLOCKS     10
+
+#define ADDR_MASK       0x00001FFF
+#define DATA_MASK       0x001FE000
+#define CCTL_MASK       0x00200000
+#define PHI2_MASK       0x00400000
+#define RW_MASK         0x00800000
+#define S4_MASK         0x01000000
+#define S5_MASK         0x02000000
+#define BUS_MASK        0x03FFFFFF
+
+#define NUM_CYCLES      400
+
+typedef struct {
+    uint32_t pins;      // A0-A12, CCTL, R/W, S4, S5 as the atari puts them out
+    uint8_t data;       // written
+} BUS_CYCLE;
+
+static BUS_CYCLE script[NUM_CYCLES];
+static uint8_t rom[0x4000];
+static uint32_t seed = 1;
+
+static uint32_t rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static void make_script()
+{
+    for (int i = 0; i < (int)sizeof(rom); i++)
+        rom[i] = rnd();
+    for (int c = 0; c < NUM_CYCLES; c++) {
+        uint32_t r = rnd();
+        uint32_t pins = (rnd() & ADDR_MASK) | CCTL_MASK | S4_MASK | S5_MASK | RW_MASK;
+        switch (r % 8) {
+        case 0: case 1: case 2: pins &= ~S5_MASK; break;
+        case 3: pins &= ~S4_MASK; break;
+        case 4: pins &= ~CCTL_MASK; break;
+        case 5: pins &= ~RW_MASK; break;
+        case 6: pins &= ~(RW_MASK | CCTL_MASK); break;
+        }
+        script[c].pins = pins;
+        script[c].data = rnd();
+    }
+}
+
+static bool is_read(int c)
+{
+    return script[c].pins & RW_MASK;
+}
+
+// what the cartridge answers a read with, -1 to leave the bus alone
+static int answer(uint32_t pins)
+{
+    if (!(pins & S4_MASK))
+        return rom[pins & 0x1FFF];
+    if (!(pins & S5_MASK))
+        return rom[0x2000 | (pins & 0x1FFF)];
+    if (!(pins & CCTL_MASK))
+        return 0xA5;
+    return -1;
+}
+
+typedef struct {
+    int drive_clocks;       // worst phi2 rising to data driven, less the CPU's part
+    int release_clocks;     // worst phi2 falling to the data bus released
+    int late_driven;        // answers that came after phi2 fell but were driven
+    int dropped;            // flagged by the PIO
+    int errors;
+} RESULT;
+
+#define FAIL(...)   do { if (res->errors++ < 10) { printf("  cpu %u, cycle %d: ", cpu_clocks, c); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void run(const PIO_SIM_PROGRAM *prog, unsigned cpu_clocks, RESULT *res)
+{
+    PIO_SIM_SM sm;
+    pio_sim_init(&sm, prog, 0);
+    // as atari_bus_program_init()
+    sm.in_base = 0;
+    sm.in_shift_right = false;
+    sm.autopush = true;
+    sm.push_threshold = 26;
+    sm.out_base = 13;
+    sm.out_count = 8;
+    sm.out_shift_right = true;
+    sm.jmp_pin = 23;
+
+    memset(res, 0, sizeof(*res));
+    int sampled = 0;            // cycles the CPU has seen
+    long answer_at = -1;        // clock the pending answer goes into the TX FIFO
+    uint32_t pending = 0;
+    long answered_at[NUM_CYCLES];
+    int driven_from[NUM_CYCLES];
+    bool dropped[NUM_CYCLES];
+    int last_read = -1;         // the read the CPU answered last
+    uint32_t prev_dirs = 0;
+    memset(answered_at, 0, sizeof(answered_at));
+    memset(driven_from, -1, sizeof(driven_from));
+    memset(dropped, 0, sizeof(dropped));
+
+    for (long t = 0; t < (long)NUM_CYCLES * CYCLE_CLOCKS; t++) {
+        int c = t / CYCLE_CLOCKS, phase = t % CYCLE_CLOCKS;
+        int ac = phase < ADDR_VALID && c ? c - 1 : c;      // cycle on the address bus
+        uint32_t gpio = script[ac].pins;
+        if (phase >= PHI2_RISE)
+            gpio |= PHI2_MASK;
+
+        // data bus: the atari writing, the cartridge, or pulled up
+        bool atari_drives = c && !is_read(c - 1) && phase < WRITE_HOLD;
+        uint8_t atari_data = c ? script[c - 1].data : 0;
+        if (!is_read(c) && phase >= WRITE_VALID)
+            atari_drives = true, atari_data = script[c].data;
+        bool cart_drives = (sm.io->pindirs & DATA_MASK) != 0;
+        if (cart_drives && (sm.io->pindirs & DATA_MASK) != DATA_MASK)
+            FAIL("data bus partly driven");
+        if (atari_drives && cart_drives)
+            FAIL("bus fight with the atari writing");
+        if (atari_drives)
+            gpio |= (uint32_t)atari_data << 13;
+        else if (cart_drives)
+            gpio |= sm.io->pins & DATA_MASK;
+        else
+            gpio |= DATA_MASK;
+
+        if (cart_drives) {
+            // which read this belongs to: the one in phi2 high, or the one just before
+            int rc = phase >= PHI2_RISE ? c : c - 1;
+            bool ok = rc >= 0 && is_read(rc) && answer(script[rc].pins) >= 0;
+            long fall = (long)(rc + 1) * CYCLE_CLOCKS;
+            if (!ok)
+                FAIL("data bus driven in phi2 %s of a cycle that isn't a selected read", phase >= PHI2_RISE ? "high" : "low");
+            else if (answered_at[rc] >= fall) {
+                if (!(prev_dirs & DATA_MASK))
+                    res->late_driven++;
+            }
+            else if (phase < PHI2_RISE) {
+                if (answered_at[rc] + ATARI_BUS_READ_CLOCKS <= fall) {
+                    if (phase >= ATARI_BUS_RELEASE_CLOCKS)
+                        FAIL("data bus held %d clocks after phi2 fell", phase + 1);
+                    if (phase + 1 > res->release_clocks)
+                        res->release_clocks = phase + 1;
+                }
+                else if (phase >= RACE_CLOCKS)
+                    FAIL("answer racing phi2 held %d clocks after phi2 fell", phase + 1);
+            }
+            if (ok && !(prev_dirs & DATA_MASK))
+                driven_from[rc] = phase;
+        }
+        prev_dirs = sm.io->pindirs;
+
+        // the 6502 latches read data as phi2 falls
+        if (phase == CYCLE_CLOCKS - 1 && is_read(c) && answer(script[c].pins) >= 0 &&
+                driven_from[c] >= 0 && (int)((gpio & DATA_MASK) >> 13) != answer(script[c].pins))
+            FAIL("read $%02X instead of $%02X", (gpio & DATA_MASK) >> 13, answer(script[c].pins));
+        if (phase == CYCLE_CLOCKS - 1 && is_read(c) && answer(script[c].pins) >= 0 && driven_from[c] < 0 &&
+                cpu_clocks + ATARI_BUS_READ_CLOCKS < CYCLE_CLOCKS - PHI2_RISE)
+            FAIL("read answered within the budget but not driven");
+
+        pio_sim_clock(&sm, gpio);
+        if (sm.io->irq & (1u << ATARI_BUS_DROP_IRQ)) {
+            sm.io->irq &= ~(1u << ATARI_BUS_DROP_IRQ);
+            res->dropped++;
+            if (last_read < 0 || driven_from[last_read] >= 0)
+                FAIL("answer flagged as dropped but driven");
+            else
+                dropped[last_read] = true;
+        }
+        // by the end of the next cycle a read's answer has been driven or dropped
+        if (phase == CYCLE_CLOCKS - 1 && c && is_read(c - 1) && answer(script[c - 1].pins) >= 0 &&
+                answered_at[c - 1] && driven_from[c - 1] < 0 && !dropped[c - 1])
+            FAIL("read of cycle %d neither driven nor flagged as dropped", c - 1);
+
+        // the CPU
+        uint32_t sample;
+        if (answer_at < 0 && pio_sim_get(&sm, &sample)) {
+            int sc = sampled++;
+            uint32_t expect = is_read(sc) ? script[sc].pins | PHI2_MASK : script[sc].pins;
+            if ((sample & ~DATA_MASK) != expect)
+                FAIL("cycle %d sampled as %08X instead of %08X", sc, sample & ~DATA_MASK, expect);
+            else if (is_read(sc)) {
+                if (c != sc || phase < PHI2_RISE)
+                    FAIL("read of cycle %d sampled outside its phi2 high", sc);
+                int a = answer(sample);
+                pending = a < 0 ? 0 : ((uint32_t)a << 1) | 1;
+                answer_at = t + cpu_clocks;
+                answered_at[sc] = answer_at;
+                last_read = sc;
+            }
+            else {
+                if (c != sc + 1 || phase >= PHI2_RISE)
+                    FAIL("write of cycle %d not sampled as phi2 fell", sc);
+                if (((sample & DATA_MASK) >> 13) != script[sc].data)
+                    FAIL("write of $%02X sampled as $%02X", script[sc].data, (sample & DATA_MASK) >> 13);
+            }
+        }
+        if (answer_at == t) {
+            pio_sim_put(&sm, pending);
+            answer_at = -1;
+        }
+        if (c && phase == 0 && driven_from[c - 1] >= 0) {
+            int latency = driven_from[c - 1] - PHI2_RISE - cpu_clocks;
+            if (latency > res->drive_clocks)
+                res->drive_clocks = latency;
+        }
+    }
+    if (sampled != NUM_CYCLES - 1 && sampled != NUM_CYCLES) {
+        int c = sampled;
+        FAIL("only %d of %d cycles sampled", sampled, NUM_CYCLES);
+    }
+    if (sm.rxstall) {
+        int c = NUM_CYCLES;
+        FAIL("RX FIFO stalled");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    PIO_SIM_PROGRAM prog;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s atari_bus.pio\n", argv[0]);
+        return 2;
+    }
+    if (!pio_sim_load(&prog, argv[1], "atari_bus"))
+        return 1;
+    make_script();
+
+    int errors = 0, drive_clocks = 0, release_clocks = 0, dropped = 0;
+    // from answering straight away to answering after phi2 has fallen, up to the
+    // point where the next cycle's phi2 would be missed
+    for (unsigned cpu_clocks = 0; cpu_clocks < CYCLE_CLOCKS - 20; cpu_clocks++) {
+        RESULT res;
+        run(&prog, cpu_clocks, &res);
+        errors += res.errors;
+        if (res.drive_clocks > drive_clocks)
+            drive_clocks = res.drive_clocks;
+        if (res.release_clocks > release_clocks)
+            release_clocks = res.release_clocks;
+        dropped += res.dropped;
+        if (res.late_driven) {
+            printf("  cpu %u: %d answers driven after phi2 fell\n", cpu_clocks, res.late_driven);
+            errors++;
+        }
+    }
+    printf("phi2 rising to data driven: %d + CPU clocks (ATARI_BUS_READ_CLOCKS %d)\n", drive_clocks, ATARI_BUS_READ_CLOCKS);
+    printf("phi2 falling to data bus released: %d clocks (ATARI_BUS_RELEASE_CLOCKS %d)\n", release_clocks, ATARI_BUS_RELEASE_CLOCKS);
+    printf("late answers dropped and flagged: %d\n", dropped);
+    if (drive_clocks > ATARI_BUS_READ_CLOCKS) {
+        printf("  ATARI_BUS_READ_CLOCKS is too low\n");
+        errors++;
+    }
+    printf("%s\n", errors ? "FAILED" : "passed");
+    return errors != 0;
+}
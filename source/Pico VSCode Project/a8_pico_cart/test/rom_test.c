@@ -0,0 +1,259 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * atari_rom.pio and its DMA chain against a scripted 6502 bus
+ *
+ * Two atari_rom state machines (S4 and S5 windows, sharing the data pins as
+ * they do on pio1) run on the PIO model (see pio_sim.h) at 125MHz, the clock
+ * these carts run at. The DMA chain of rom_window_start() is modelled as the
+ * address channel taking the pushed SRAM address on the RX FIFO's DREQ and
+ * triggering the data channel, which puts the byte in the TX FIFO a number of
+ * clocks later and re-arms the address channel. That turnaround is swept.
+ *
+ * Checks that every read of a window sees the byte at the window's 8k aligned
+ * SRAM address + A0-A12 for the whole setup time before phi2 falls, that
+ * nothing is driven while the atari writes or in the phi2 high half of a cycle
+ * outside the windows, and reports the worst case from the address settling to the right data on
+ * the bus in system clocks, with S4/S5 following the address and with them
+ * qualified by phi2 as some machines do.
+ *
+ * usage: rom_test atari_bus.pio
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pio_sim.h"
+
+// one 6502 cycle at 125MHz: phi2 falls at 0 and rises half way
+#define CYCLE_CLOCKS    70
+#define PHI2_RISE       35
+#define ADDR_VALID      5       // after phi2 falls, until the same point of the next cycle
+#define WRITE_VALID     (PHI2_RISE + 6)
+#define WRITE_HOLD      2       // after phi2 falls
+#define SETUP_CLOCKS    3       // 6502 read data setup before phi2 falls, rounded up
+// the two chained transfers have to keep within this, they take a few clocks each
+// with the DMA channels at high priority
+#define DMA_BUDGET_CLOCKS   16
+
+#define ADDR_MASK       0x00001FFF
+#define DATA_MASK       0x001FE000
+#define CCTL_MASK       0x00200000
+#define PHI2_MASK       0x00400000
+#define RW_MASK         0x00800000
+#define S4_MASK         0x01000000
+#define S5_MASK         0x02000000
+
+#define NUM_CYCLES      2000
+
+// a slice of SRAM holding the two windows, 8k aligned as atari_rom_start() needs
+#define SRAM_BASE       0x20010000
+#define S4_WINDOW       0x20010000
+#define S5_WINDOW       0x20012000
+static uint8_t sram[0x4000];
+
+typedef struct {
+    uint32_t pins;      // A0-A12, CCTL, R/W, S4, S5
+    uint8_t data;       // written
+} BUS_CYCLE;
+
+static BUS_CYCLE script[NUM_CYCLES];
+static uint32_t seed = 1;
+
+static uint32_t rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+// mostly runs of reads in one window, as code and data fetches would be
+static void make_script()
+{
+    for (int i = 0; i < (int)sizeof(sram); i++)
+        sram[i] = rnd();
+    uint32_t addr = 0;
+    for (int c = 0; c < NUM_CYCLES; c++) {
+        uint32_t r = rnd();
+        addr = r & 0x10 ? (addr + 1) & ADDR_MASK : rnd() & ADDR_MASK;
+        uint32_t pins = addr | CCTL_MASK | S4_MASK | S5_MASK | RW_MASK;
+        switch ((r >> 8) % 8) {
+        case 0: case 1: case 2: pins &= ~S5_MASK; break;
+        case 3: case 4: pins &= ~S4_MASK; break;
+        case 5: pins &= ~(S5_MASK | RW_MASK); break;
+        case 6: pins &= ~RW_MASK; break;
+        }
+        script[c].pins = pins;
+        script[c].data = rnd();
+    }
+}
+
+static bool selected(uint32_t pins)
+{
+    return (pins & (S4_MASK | S5_MASK)) != (S4_MASK | S5_MASK);
+}
+
+static int expected(uint32_t pins)
+{
+    if (!(pins & RW_MASK) || !selected(pins))
+        return -1;
+    uint32_t window = !(pins & S4_MASK) ? S4_WINDOW : S5_WINDOW;
+    return sram[window - SRAM_BASE + (pins & ADDR_MASK)];
+}
+
+typedef struct {
+    bool armed;             // address channel waiting for DREQ
+    long trigger_at;        // data channel triggered
+    long done_at;           // byte written to the TX FIFO, address channel re-armed
+    uint32_t addr;
+} DMA_CHAIN;
+
+typedef struct {
+    int worst_clocks;       // address (or select) valid to the right data on the bus
+    int errors;
+} RESULT;
+
+#define FAIL(...)   do { if (res->errors++ < 10 && dma_clocks <= DMA_BUDGET_CLOCKS) { printf("  dma %d, %s, cycle %d: ", dma_clocks, qualified ? "qualified" : "unqualified", c); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void dma_clock(PIO_SIM_SM *sm, DMA_CHAIN *d, long t, int addr_clocks, int data_clocks)
+{
+    if (d->trigger_at == t) {
+        d->trigger_at = -1;
+        d->done_at = t + data_clocks;
+    }
+    if (d->done_at == t) {
+        d->done_at = -1;
+        uint32_t offset = d->addr - SRAM_BASE;
+        pio_sim_put(sm, offset < sizeof(sram) ? sram[offset] : 0xEE);
+        d->armed = true;
+    }
+    uint32_t addr;
+    if (d->armed && pio_sim_get(sm, &addr)) {
+        d->armed = false;
+        d->addr = addr;
+        d->trigger_at = t + addr_clocks;
+    }
+}
+
+static void run(const PIO_SIM_PROGRAM *prog, int dma_clocks, bool qualified, RESULT *res)
+{
+    PIO_SIM_IO io = { 0 };
+    PIO_SIM_SM sm[2];
+    DMA_CHAIN dma[2];
+    int c = 0;
+
+    for (int w = 0; w < 2; w++) {
+        // as atari_rom_program_init()
+        pio_sim_init(&sm[w], prog, 0);
+        sm[w].io = &io;
+        sm[w].in_base = 0;
+        sm[w].in_shift_right = false;
+        sm[w].autopush = true;
+        sm[w].push_threshold = 32;
+        sm[w].out_base = 13;
+        sm[w].out_count = 8;
+        sm[w].out_shift_right = true;
+        sm[w].jmp_pin = w ? 25 : 24;
+        sm[w].x = (w ? S5_WINDOW : S4_WINDOW) >> 13;
+        dma[w] = (DMA_CHAIN){ true, -1, -1, 0 };
+    }
+    memset(res, 0, sizeof(*res));
+
+    long right_since = -1;          // clock the data bus has carried the expected byte since
+    for (long t = 0; t < (long)NUM_CYCLES * CYCLE_CLOCKS; t++) {
+        c = t / CYCLE_CLOCKS;
+        int phase = t % CYCLE_CLOCKS;
+        int ac = phase < ADDR_VALID && c ? c - 1 : c;
+        uint32_t gpio = script[ac].pins;
+        if (phase >= PHI2_RISE)
+            gpio |= PHI2_MASK;
+        else if (qualified)
+            gpio |= S4_MASK | S5_MASK;
+
+        bool atari_drives = c && !(script[c - 1].pins & RW_MASK) && phase < WRITE_HOLD;
+        uint8_t atari_data = c ? script[c - 1].data : 0;
+        if (!(script[c].pins & RW_MASK) && phase >= WRITE_VALID)
+            atari_drives = true, atari_data = script[c].data;
+        uint32_t dirs = io.pindirs & DATA_MASK;
+        if (dirs && dirs != DATA_MASK)
+            FAIL("data bus partly driven");
+        if (atari_drives && dirs)
+            FAIL("bus fight with the atari writing");
+        if (dirs && !selected(script[c].pins) && phase >= PHI2_RISE)
+            FAIL("data bus driven in phi2 high outside the windows");
+        if (atari_drives)
+            gpio |= (uint32_t)atari_data << 13;
+        else
+            gpio |= dirs ? io.pins & DATA_MASK : DATA_MASK;
+
+        // reads of a window have to have the right byte on the bus for the setup time
+        int want = expected(script[c].pins);
+        if (want >= 0 && phase >= ADDR_VALID) {
+            if (dirs && (int)((gpio & DATA_MASK) >> 13) == want) {
+                if (right_since < 0) {
+                    right_since = t;
+                    int valid = qualified ? PHI2_RISE : ADDR_VALID;
+                    if (phase - valid > res->worst_clocks)
+                        res->worst_clocks = phase - valid;
+                }
+            }
+            else
+                right_since = -1;
+            if (phase == CYCLE_CLOCKS - 1 && (right_since < 0 || t - right_since < SETUP_CLOCKS))
+                FAIL("read of $%04X not answered with $%02X in time", script[c].pins & ADDR_MASK, want);
+        }
+        else
+            right_since = -1;
+
+        for (int w = 0; w < 2; w++)
+            pio_sim_clock(&sm[w], gpio);
+        for (int w = 0; w < 2; w++)
+            dma_clock(&sm[w], &dma[w], t, dma_clocks / 2, dma_clocks - dma_clocks / 2);
+    }
+    if (sm[0].rxstall || sm[1].rxstall)
+        FAIL("RX FIFO stalled, the DMA chain lost track");
+}
+
+int main(int argc, char **argv)
+{
+    PIO_SIM_PROGRAM prog;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s atari_bus.pio\n", argv[0]);
+        return 2;
+    }
+    if (!pio_sim_load(&prog, argv[1], "atari_rom"))
+        return 1;
+    make_script();
+
+    int errors = 0;
+    for (int qualified = 0; qualified < 2; qualified++) {
+        int keeps_up = 0;
+        for (int dma_clocks = 2; dma_clocks <= 24; dma_clocks++) {
+            RESULT res;
+            run(&prog, dma_clocks, qualified, &res);
+            if (res.errors) {
+                if (dma_clocks <= DMA_BUDGET_CLOCKS)
+                    errors += res.errors;
+                if (!keeps_up)
+                    keeps_up = dma_clocks - 1;
+            }
+            else if (!keeps_up)
+                printf("%s S4/S5, DMA turnaround %2d clocks: right data %2d clocks after the %s\n",
+                    qualified ? "phi2 qualified" : "unqualified", dma_clocks, res.worst_clocks,
+                    qualified ? "select" : "address");
+        }
+        printf("%s S4/S5: keeps up at 125MHz with a DMA turnaround of up to %d clocks (budget %d)\n",
+            qualified ? "phi2 qualified" : "unqualified", keeps_up ? keeps_up : 24, DMA_BUDGET_CLOCKS);
+    }
+    printf("%s\n", errors ? "FAILED" : "passed");
+    return errors != 0;
+}
@@ -0,0 +1,179 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * The boot ROM's mailbox and CART_CMD_MAP_WINDOW on the simulated bus
+ *
+ * boot_rom_start() puts the menu on core1 (emulate_boot_rom()), which is run
+ * here on the simulated bus (see cart_sim.h) against the menu's side of the
+ * mailbox: reads of the boot ROM at $A000-$BFFF, CART_CMD_MAP_WINDOW for
+ * every 8k block of cart_ram, out of range blocks and $FF to map the ROM
+ * back, each checked from the very next cycle on, with the copy loop of the
+ * soft OS load reading through the window. A command for core0 has to show
+ * CART_STATUS_BUSY and the progress count and ignore writes until
+ * boot_rom_done(), and the window has to stay where it is meanwhile.
+ *
+ * usage: window_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/multicore.h"
+#include "cart_sim.h"
+
+// atari_cart.c, for the tests only
+void boot_rom_start(int atrMode);
+void boot_rom_done();
+extern unsigned char cart_ram[128 * 1024];
+extern unsigned char cart_d5xx[256];
+extern unsigned char A8PicoCart_rom[];
+extern volatile uint8_t cart_progress;
+
+#define CART_STATUS_DONE    0x11
+#define CART_STATUS_BUSY    0x12
+#define CART_CMD_READ_DIR   0x01
+#define CART_CMD_MAP_WINDOW 0x12
+#define ROM_WINDOW          -1
+#define BLOCKS              (int)(sizeof(cart_ram) / 0x2000)
+
+static uint32_t seed = 1;
+
+static uint32_t rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static int errors;
+
+#define FAIL(...)   do { if (errors++ < 10) { printf("  "); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+#define MAX_CYCLES  200000
+static SIM_CYCLE trace[MAX_CYCLES];
+static int want[MAX_CYCLES];
+static SIM_RESULT res[MAX_CYCLES];
+static int cycles;
+
+static void cycle(uint16_t addr, bool write, uint8_t data, int expect)
+{
+    if (cycles < MAX_CYCLES) {
+        trace[cycles] = (SIM_CYCLE){ addr, data, write };
+        want[cycles++] = expect;
+    }
+}
+
+static int window_byte(int block, uint16_t addr)
+{
+    return block == ROM_WINDOW ? A8PicoCart_rom[addr & 0x1FFF] : cart_ram[block * 0x2000 + (addr & 0x1FFF)];
+}
+
+// reads of the window, the first straight after it was mapped
+static void read_window(int block, int n)
+{
+    for (int i = 0; i < n; i++) {
+        uint16_t addr = 0xA000 + rnd() % 0x2000;
+        cycle(addr, false, 0, window_byte(block, addr));
+        cycle(0x0600 + rnd() % 0x100, rnd() & 1, rnd(), SIM_NONE);
+    }
+}
+
+static void map_window(int n)
+{
+    cycle(0xD500, true, n, SIM_NONE);
+    cycle(0xD5DF, true, CART_CMD_MAP_WINDOW, SIM_NONE);
+    read_window(n < BLOCKS ? n : ROM_WINDOW, 1);
+    cycle(0xD500, false, 0, CART_STATUS_DONE);
+}
+
+// the soft OS copy: 256 bytes from the block, as LDA (zp),Y / STA (zp),Y
+static void copy_page(int block, int page)
+{
+    for (int y = 0; y < 256; y++) {
+        uint16_t addr = 0xA000 + page * 256 + y;
+        cycle(addr, false, 0, window_byte(block, addr));
+        cycle(0x4000 + page * 256 + y, true, rnd(), SIM_NONE);
+        cycle(0x0640 + y % 16, false, 0, SIM_FLOAT);
+    }
+}
+
+static bool run(const char *what)
+{
+    int wrong = sim_run(host_core1_entry, trace, cycles, res);
+    for (int i = 0; i < cycles; i++)
+        if (want[i] != SIM_NONE && res[i].answer != want[i] && wrong++ < 5)
+            FAIL("%s: cycle %d, %s $%04X answered with %d instead of %d", what, i,
+                trace[i].write ? "write" : "read", trace[i].addr, res[i].answer, want[i]);
+    printf("%s: %d cycles, %s\n", what, cycles, wrong ? "wrong" : "ok");
+    errors += wrong;
+    cycles = 0;
+    return !wrong;
+}
+
+int main()
+{
+    for (int i = 0; i < (int)sizeof(cart_ram); i++)
+        cart_ram[i] = rnd();
+    boot_rom_start(0);
+    if (!host_core1_entry) {
+        printf("boot_rom_start() didn't launch core1\n");
+        return 1;
+    }
+
+    read_window(ROM_WINDOW, 500);
+    cycle(0xD500, false, 0, CART_STATUS_DONE);
+    for (int n = 0; n < BLOCKS; n++) {
+        map_window(n);
+        read_window(n, 200);
+    }
+    for (int n = BLOCKS; n <= 0xFF; n += 37) {
+        map_window(n);
+        read_window(ROM_WINDOW, 20);
+    }
+    for (int n = 0; n < 2; n++) {
+        map_window(n);
+        for (int page = 0; page < 32; page++)
+            copy_page(n, page);
+    }
+    map_window(0xFF);
+    read_window(ROM_WINDOW, 200);
+    run("map window");
+
+    // a command for core0, nothing takes it here
+    map_window(3);
+    cycle(0xD501, true, 0x42, SIM_NONE);
+    cycle(0xD5DF, true, CART_CMD_READ_DIR, SIM_NONE);
+    cycle(0xD500, false, 0, CART_STATUS_BUSY);
+    cycle(0xD5DF, false, 0, 0);
+    cycle(0xD500, true, 7, SIM_NONE);
+    cycle(0xD5DF, true, CART_CMD_MAP_WINDOW, SIM_NONE);
+    read_window(3, 100);
+    cycle(0xD500, false, 0, CART_STATUS_BUSY);
+    cycle(0xD501, false, 0, 0x42);
+    run("busy");
+    if (cart_d5xx[0xDF] != CART_CMD_READ_DIR)
+        FAIL("command $%02X instead of $%02X", cart_d5xx[0xDF], CART_CMD_READ_DIR);
+
+    cart_progress = 77;
+    cycle(0xD5DF, false, 0, 77);
+    run("progress");
+
+    boot_rom_done();
+    cycle(0xD500, false, 0, CART_STATUS_DONE);
+    map_window(7);
+    read_window(7, 100);
+    map_window(0xFF);
+    read_window(ROM_WINDOW, 100);
+    run("done");
+
+    printf("%s\n", errors ? "FAILED" : "passed");
+    return errors != 0;
+}
@@ -0,0 +1,345 @@
+/**
+ *    _   ___ ___ _       ___          _   
+ *   /_\ ( _ ) _ (_)__ _ / __|__ _ _ _| |_ 
+ *  / _ \/ _ \  _/ / _/_\ (__/ _` | '_|  _|
+ * /_/ \_\___/_| |_\__\_/\___\__,_|_|  \__|
+ *                                         
+ * 
+ * Atari 8-bit cartridge for Raspberry Pi Pico
+ *
+ * Robin Edwards 2023
+ *
+ * XEX files through load_file() and the loader's $D5xx pages
+ *
+ * parse_xex() is given broken files (no $FFFF header, a segment that ends
+ * before it starts, a first segment that runs past the end of the file, too
+ * many segments, an empty file), which load_file() has to turn down with the
+ * right message. Files with bytes after the last segment that are too few for
+ * another one have to load, the table ending before them.
+ * Good files are loaded and then read on the simulated bus (see cart_sim.h)
+ * the way the loader in the boot ROM reads them: the segment table from the
+ * pages from $8000, the length at the start of page 0, and each segment from
+ * the page and position the table gives, a few cycles of the loader's own
+ * work between reads. Each page set is followed by a few polls of the wait
+ * page ($4000), the last of which has to say the page is ready. Every byte is checked against the file. Files are
+ * streamed through the bank cache, one of them fragmented (written a cluster
+ * at a time between the clusters of another file) and one of a few hundred
+ * bytes, shorter than a block.
+ *
+ * usage: xex_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ff.h"
+#include "fatfs_disk.h"
+#include "cart_sim.h"
+
+// atari_cart.c, for the tests only
+int load_file(char *filename);
+void emulate_cartridge(int cartType);
+extern char errorBuf[40];
+
+#define CART_TYPE_XEX       255
+#define ANY                 -3          // not checked
+#define READY               -4          // anything but 0
+#define MAX_SEGMENTS        1024        // XEX_MAX_SEGMENTS
+#define SEGMENT_SIZE        8           // of XEX_SEGMENT
+#define TABLE_PAGE          0x8000
+#define WAIT_PAGE           0x4000
+#define WAIT_POLLS          4
+#define SEG_INIT            0x01
+#define SEG_RUN             0x02
+#define SEG_END             0x80
+#define LOADER_CYCLES       3           // between the loader's reads of $D5xx
+#define LEAD_IN_CYCLES      4000        // the menu starting the loader
+
+#define BIG_SIZE            600000
+#define FRAG_SIZE           100000
+
+static uint32_t seed = 1;
+
+static uint32_t rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static int errors;
+
+#define FAIL(...)   do { if (errors++ < 10) { printf("  "); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+typedef struct {
+    uint16_t start, len;
+    uint32_t offset;            // of the data in the file
+} SEGMENT;
+
+typedef struct {
+    const char *name;
+    uint8_t *data;
+    uint32_t size;
+    SEGMENT seg[MAX_SEGMENTS];
+    int segments;
+    const char *error;          // load_file() turns it down with this
+} XEX;
+
+// a random XEX of size bytes with a header before some segments, and INITAD
+// or RUNAD set now and then
+static void make_xex(XEX *x, uint32_t size, int max_len)
+{
+    uint32_t pos = 0;
+    x->data = malloc(size);
+    x->size = size;
+    x->segments = 0;
+    while (pos < size) {
+        if (pos == 0 || rnd() % 8 == 0)
+            x->data[pos++] = 0xFF, x->data[pos++] = 0xFF;
+        uint32_t len = 1 + rnd() % max_len;
+        uint16_t start = rnd() % 8 == 0 ? 0x02E0 + (rnd() & 2) : 0x2000 + rnd() % 0x8000;
+        if (start < 0x2000)
+            len = 2;
+        if (pos + 4 + len > size) {
+            if (pos + 5 > size) {
+                // no room for another segment, the last one takes the rest
+                x->seg[x->segments - 1].len += size - pos;
+                memset(x->data + pos, 0xAA, size - pos);
+                uint32_t at = x->seg[x->segments - 1].offset - 2;
+                uint16_t end = x->seg[x->segments - 1].start + x->seg[x->segments - 1].len - 1;
+                x->data[at] = end & 0xFF;
+                x->data[at + 1] = end >> 8;
+                break;
+            }
+            len = size - pos - 4;
+            if (start + len > 0x10000)
+                start = 0x10000 - len;
+        }
+        uint16_t end = start + len - 1;
+        x->data[pos++] = start & 0xFF;
+        x->data[pos++] = start >> 8;
+        x->data[pos++] = end & 0xFF;
+        x->data[pos++] = end >> 8;
+        x->seg[x->segments++] = (SEGMENT){ start, len, pos };
+        for (uint32_t i = 0; i < len; i++)
+            x->data[pos++] = rnd();
+    }
+}
+
+// bytes after the last segment of x, which aren't one
+static void add_junk(XEX *x, const uint8_t *junk, uint32_t size)
+{
+    x->data = realloc(x->data, x->size + size);
+    memcpy(x->data + x->size, junk, size);
+    x->size += size;
+}
+
+static void make_bad(XEX *x, const char *name, const uint8_t *data, uint32_t size, const char *error)
+{
+    x->name = name;
+    x->data = malloc(size ? size : 1);
+    memcpy(x->data, data, size);
+    x->size = size;
+    x->segments = 0;
+    x->error = error;
+}
+
+static bool write_file(FIL *fil, const char *name, const uint8_t *data, uint32_t size)
+{
+    UINT bw;
+    return f_open(fil, name, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK &&
+        f_write(fil, data, size, &bw) == FR_OK && bw == size && f_close(fil) == FR_OK;
+}
+
+// frag is written a cluster at a time between the clusters of another file
+static bool write_drive(XEX *xex, int n, XEX *frag)
+{
+    FATFS fs;
+    FIL fil, pad;
+    UINT bw;
+    bool ok;
+
+    create_fatfs_disk();
+    if (f_mount(&fs, "", 1) != FR_OK)
+        return false;
+    for (int i = 0; i < n; i++)
+        if (!write_file(&fil, xex[i].name, xex[i].data, xex[i].size))
+            return false;
+    uint32_t cluster = fs.csize * FF_MIN_SS;
+    ok = f_open(&fil, frag->name, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK &&
+        f_open(&pad, "/PAD.BIN", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK;
+    for (uint32_t pos = 0; ok && pos < frag->size; pos += cluster) {
+        uint32_t len = frag->size - pos < cluster ? frag->size - pos : cluster;
+        ok = f_write(&fil, frag->data + pos, len, &bw) == FR_OK && bw == len &&
+            f_write(&pad, frag->data, cluster, &bw) == FR_OK && bw == cluster;
+    }
+    ok = ok && f_close(&fil) == FR_OK && f_close(&pad) == FR_OK;
+    printf("%s: %u fragments of %u bytes\n", frag->name, (frag->size + cluster - 1) / cluster, cluster);
+    f_mount(0, "", 0);
+    return ok;
+}
+
+static SIM_CYCLE *trace;
+static int *want;
+static int cycles, max_cycles;
+
+static void cycle(uint16_t addr, bool write, uint8_t data, int expect)
+{
+    if (cycles == max_cycles) {
+        max_cycles = max_cycles ? max_cycles * 2 : 65536;
+        trace = realloc(trace, max_cycles * sizeof(SIM_CYCLE));
+        want = realloc(want, max_cycles * sizeof(int));
+    }
+    trace[cycles] = (SIM_CYCLE){ addr, data, write };
+    want[cycles++] = expect;
+}
+
+static void set_page(uint16_t page)
+{
+    cycle(0xD500, true, page & 0xFF, SIM_NONE);
+    cycle(0xD501, true, page >> 8, SIM_NONE);
+    cycle(0xD501, true, WAIT_PAGE >> 8, SIM_NONE);
+    for (int i = 1; i <= WAIT_POLLS; i++)
+        cycle(0xD500, false, 0, i == WAIT_POLLS ? READY : ANY);
+    cycle(0xD501, true, page >> 8, SIM_NONE);
+}
+
+static void loader_read(uint8_t addr, int expect)
+{
+    cycle(0xD500 | addr, false, 0, expect);
+    for (int i = 0; i < LOADER_CYCLES; i++)
+        cycle(0x0600 + rnd() % 0x100, rnd() & 1, rnd(), SIM_NONE);
+}
+
+// the segment table as parse_xex() should have made it
+static void table_entry(const XEX *x, int s, uint8_t *e)
+{
+    memset(e, 0, SEGMENT_SIZE);
+    if (s == x->segments) {
+        e[7] = SEG_END;
+        return;
+    }
+    const SEGMENT *seg = &x->seg[s];
+    uint32_t at = 4 + seg->offset;
+    e[0] = seg->start & 0xFF;
+    e[1] = seg->start >> 8;
+    e[2] = seg->len & 0xFF;
+    e[3] = seg->len >> 8;
+    e[4] = (at >> 8) & 0xFF;
+    e[5] = at >> 16;
+    e[6] = at & 0xFF;
+    uint16_t end = seg->start + seg->len - 1;
+    e[7] = (seg->start <= 0x2E3 && end >= 0x2E2 ? SEG_INIT : 0) | (seg->start <= 0x2E1 && end >= 0x2E0 ? SEG_RUN : 0);
+}
+
+// the loader reading x, as A8PicoCart.asm does
+static void make_trace(const XEX *x)
+{
+    uint8_t e[SEGMENT_SIZE];
+
+    cycles = 0;
+    for (int i = 0; i < LEAD_IN_CYCLES; i++)
+        cycle(0x0600 + rnd() % 0x100, false, 0, SIM_NONE);
+    set_page(0);
+    for (int i = 0; i < 4; i++)
+        loader_read(i, (x->size >> (8 * i)) & 0xFF);
+    for (int s = 0; s <= x->segments; s++) {
+        uint32_t at = s * SEGMENT_SIZE;
+        table_entry(x, s, e);
+        set_page(TABLE_PAGE | (at >> 8));
+        // only the flags of the entry after the last one count
+        for (int i = 0; i < SEGMENT_SIZE; i++)
+            loader_read((at + i) & 0xFF, s == x->segments && i != 7 ? ANY : e[i]);
+        if (s == x->segments)
+            break;
+        uint32_t pos = 4 + x->seg[s].offset;
+        set_page(pos >> 8);
+        for (uint32_t i = 0; i < x->seg[s].len; i++, pos++) {
+            if (i && !(pos & 0xFF))
+                set_page(pos >> 8);
+            loader_read(pos & 0xFF, x->data[pos - 4]);
+        }
+    }
+}
+
+static void run_xex()
+{
+    emulate_cartridge(CART_TYPE_XEX);
+}
+
+static void check_xex(XEX *x)
+{
+    if (load_file((char *)x->name) != CART_TYPE_XEX) {
+        FAIL("%s: load_file() failed: %s", x->name, errorBuf);
+        return;
+    }
+    make_trace(x);
+    SIM_RESULT *res = malloc(cycles * sizeof(SIM_RESULT));
+    errors += sim_run(run_xex, trace, cycles, res);
+    int wrong = 0, filling = 0;
+    for (int i = 0; i < cycles; i++) {
+        if (want[i] == SIM_NONE || want[i] == ANY || res[i].answer == want[i] ||
+                (want[i] == READY && res[i].answer > 0))
+            continue;
+        if (res[i].filling)
+            filling++;
+        if (wrong++ < 5)
+            FAIL("%s: cycle %d, $%04X read as %d instead of %d%s", x->name, i, trace[i].addr,
+                res[i].answer, want[i], res[i].filling ? " while filling" : "");
+    }
+    printf("%s: %d segments, %u bytes, %d cycles, %d wrong (%d while filling)\n", x->name,
+        x->segments, x->size, cycles, wrong, filling);
+    if (wrong > 5)
+        errors += wrong - 5;
+    free(res);
+}
+
+int main()
+{
+    static XEX xex[10], frag;
+    static const uint8_t no_header[] = { 0x00, 0x20, 0x01, 0x20, 0xEA, 0xEA };
+    static const uint8_t backwards[] = { 0xFF, 0xFF, 0x00, 0x20, 0x00, 0x20, 0xEA, 0x10, 0x20, 0x0F, 0x20, 0xEA };
+    static const uint8_t truncated[] = { 0xFF, 0xFF, 0x00, 0x20, 0x03, 0x20, 0xEA, 0xEA };
+    static const uint8_t no_end[] = { 0x00, 0x30 };
+    static const uint8_t cut_short[] = { 0xFF, 0xFF, 0x00, 0x30, 0xFF, 0x30, 0xEA, 0xEA };
+    static uint8_t many[2 + MAX_SEGMENTS * 5];
+    int n = 0;
+
+    xex[n].name = "/BIG.XEX";
+    make_xex(&xex[n++], BIG_SIZE, 6000);
+    xex[n].name = "/SMALL.XEX";
+    make_xex(&xex[n++], 300, 40);
+    xex[n].name = "/NOEND.XEX";
+    make_xex(&xex[n], 2000, 100);
+    add_junk(&xex[n++], no_end, sizeof(no_end));
+    xex[n].name = "/CUT.XEX";
+    make_xex(&xex[n], 2000, 100);
+    add_junk(&xex[n++], cut_short, sizeof(cut_short));
+    many[0] = many[1] = 0xFF;
+    for (int s = 0; s < MAX_SEGMENTS; s++) {
+        uint8_t *p = many + 2 + s * 5;
+        p[0] = 0x00, p[1] = 0x20, p[2] = 0x00, p[3] = 0x20, p[4] = s;
+    }
+    make_bad(&xex[n++], "/NOHDR.XEX", no_header, sizeof(no_header), "Not an XEX file");
+    make_bad(&xex[n++], "/BACK.XEX", backwards, sizeof(backwards), "XEX segment 2 ends before start");
+    make_bad(&xex[n++], "/TRUNC.XEX", truncated, sizeof(truncated), "XEX segment 1 is truncated");
+    make_bad(&xex[n++], "/MANY.XEX", many, sizeof(many), "XEX has over 1023 segments");
+    make_bad(&xex[n++], "/EMPTY.XEX", NULL, 0, "Empty XEX file");
+    frag.name = "/FRAG.XEX";
+    make_xex(&frag, FRAG_SIZE, 3000);
+    if (!write_drive(xex, n, &frag)) {
+        printf("can't write the test drive\n");
+        return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!xex[i].error)
+            check_xex(&xex[i]);
+        else if (load_file((char *)xex[i].name) || strcmp(errorBuf, xex[i].error))
+            FAIL("%s: \"%s\" instead of \"%s\"", xex[i].name, errorBuf, xex[i].error);
+    }
+    check_xex(&frag);
+
+    printf("%s\n", errors ? "FAILED" : "passed");
+    return errors != 0;
+}